@@ -61,7 +61,7 @@ namespace ikura::discord
 		if(userid == twitch::MAGIC_OWNER_USERID)
 			return true;
 
-		return database().map_read([&](auto& db) {
+		return db::read({ db::Section::Discord }, [&](auto& db) {
 			// mfw "const correctness", so we can't use operator[]
 			auto guild = this->getGuild();
 			if(!guild) { lg::warn("discord", "no guild"); return false; }
@@ -423,7 +423,7 @@ namespace ikura::discord
 	{
 		this->ws.onReceiveText([](auto, auto) { });
 
-		database().perform_write([this](auto& db) {
+		db::write({ db::Section::Discord }, [this](auto& db) {
 			db.discordData.lastSequence = this->sequence;
 			db.discordData.lastSession = this->session_id;
 		});
@@ -535,7 +535,7 @@ namespace ikura::discord
 
 		int64_t seq = 0;
 		std::string ses;
-		std::tie(seq, ses) = database().map_read([](auto& db) -> auto {
+		std::tie(seq, ses) = db::read({ db::Section::Discord }, [](auto& db) -> auto {
 			return std::pair(db.discordData.lastSequence, db.discordData.lastSession);
 		});
 
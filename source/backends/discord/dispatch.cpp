@@ -59,7 +59,7 @@ namespace ikura::discord
 		else if(type == "GUILD_EMOJIS_UPDATE")
 		{
 			auto id = Snowflake(msg["d"].as_obj()["guild_id"].as_str());
-			database().perform_write([&](auto& db) {
+			db::write({ db::Section::Discord }, [&](auto& db) {
 				auto& dd = db.discordData;
 				if(auto it = dd.guilds.find(id); it != dd.guilds.end())
 				{
@@ -4,6 +4,7 @@
 
 #include "db.h"
 #include "twitch.h"
+#include "markov.h"
 #include "serialise.h"
 
 namespace ikura::discord
@@ -26,13 +27,19 @@ namespace ikura::discord
 		msg.channelId = channel.id;
 		msg.channelName = channel.name;
 
-		msg.message = database().wlock()->messageData.logMessageContents(message);
 		msg.emotePositions = emote_idxs;
 
 		msg.isEdit = isEdit;
 		msg.isCommand = isCmd;
 
-		database().wlock()->discordData.messageLog.messages.push_back(std::move(msg));
+		// the model gets it while the log is still locked, so that it sees messages in the same order as the log
+		// (see markov::retrain).
+		db::write_quiet({ db::Section::Discord, db::Section::Messages, db::Section::Search }, [&](auto& db) {
+			db::journal::logMessage(db, std::move(msg), message);
+
+			if(!isCmd && channel.name != "bot-shrine")
+				markov::process(message, emote_idxs, channel.name);
+		});
 	}
 
 
@@ -93,12 +100,72 @@ namespace ikura::discord
 
 
 
+	void DiscordMessageLog::add(const DiscordMessage& msg)
+	{
+		this->timestamps.push_back(msg.timestamp);
+		this->messageIds.push_back(msg.messageId.value);
+		this->userIds.push_back(msg.userId.value);
+		this->usernames.push_back(this->strings.add(msg.username));
+		this->nicknames.push_back(this->strings.add(msg.nickname));
+		this->guildIds.push_back(msg.guildId.value);
+		this->guildNames.push_back(this->strings.add(msg.guildName));
+		this->channelIds.push_back(msg.channelId.value);
+		this->channelNames.push_back(this->strings.add(msg.channelName));
+		this->contents.push_back(msg.message);
+		this->flags.push_back((msg.isEdit ? FLAG_EDIT : 0) | (msg.isCommand ? FLAG_COMMAND : 0));
+
+		this->emoteStarts.push_back((uint32_t) this->emotePositions.size());
+		this->emotePositions.insert(this->emotePositions.end(), msg.emotePositions.begin(), msg.emotePositions.end());
+
+		this->index.add(this->channelIds.back(), this->usernames.back(), msg.timestamp);
+	}
+
+	ikura::span<ikura::relative_str> DiscordMessageLog::getEmotePositions(size_t i) const
+	{
+		auto end = (i + 1 < this->emoteStarts.size() ? this->emoteStarts[i + 1] : this->emotePositions.size());
+		return ikura::span<ikura::relative_str>(this->emotePositions.data() + this->emoteStarts[i],
+			end - this->emoteStarts[i]);
+	}
+
+	DiscordMessage DiscordMessageLog::get(size_t i) const
+	{
+		DiscordMessage ret;
+		ret.timestamp = this->timestamps[i];
+		ret.messageId = Snowflake(this->messageIds[i]);
+		ret.userId = Snowflake(this->userIds[i]);
+		ret.username = this->strings.get(this->usernames[i]).str();
+		ret.nickname = this->strings.get(this->nicknames[i]).str();
+		ret.guildId = Snowflake(this->guildIds[i]);
+		ret.guildName = this->strings.get(this->guildNames[i]).str();
+		ret.channelId = Snowflake(this->channelIds[i]);
+		ret.channelName = this->strings.get(this->channelNames[i]).str();
+		ret.message = this->contents[i];
+		ret.emotePositions = this->getEmotePositions(i).vec();
+		ret.isEdit = this->isEdit(i);
+		ret.isCommand = this->isCommand(i);
+
+		return ret;
+	}
+
 	void DiscordMessageLog::serialise(Buffer& buf) const
 	{
 		auto wr = serialise::Writer(buf);
 		wr.tag(TYPE_TAG);
 
-		wr.write(this->messages);
+		wr.write(this->strings);
+		wr.writeArray(this->timestamps);
+		wr.writeArray(this->messageIds);
+		wr.writeArray(this->userIds);
+		wr.writeArray(this->usernames);
+		wr.writeArray(this->nicknames);
+		wr.writeArray(this->guildIds);
+		wr.writeArray(this->guildNames);
+		wr.writeArray(this->channelIds);
+		wr.writeArray(this->channelNames);
+		wr.writeArray(this->contents);
+		wr.writeArray(this->emoteStarts);
+		wr.writeArray(this->flags);
+		wr.writeArray(this->emotePositions);
 	}
 
 	std::optional<DiscordMessageLog> DiscordMessageLog::deserialise(Span& buf)
@@ -108,8 +175,56 @@ namespace ikura::discord
 			return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, TYPE_TAG);
 
 		DiscordMessageLog ret;
-		if(!rd.read(&ret.messages))
-			return { };
+
+		// before version 35, it was just a list of messages.
+		if(db::getVersion() < 35)
+		{
+			auto msgs = rd.read<std::vector<DiscordMessage>>();
+			if(!msgs)
+				return { };
+
+			for(auto& msg : msgs.value())
+				ret.add(msg);
+
+			return ret;
+		}
+
+		if(!rd.read(&ret.strings))                  return { };
+		if(!rd.readArray(&ret.timestamps))          return { };
+		if(!rd.readArray(&ret.messageIds))          return { };
+		if(!rd.readArray(&ret.userIds))             return { };
+		if(!rd.readArray(&ret.usernames))           return { };
+		if(!rd.readArray(&ret.nicknames))           return { };
+		if(!rd.readArray(&ret.guildIds))            return { };
+		if(!rd.readArray(&ret.guildNames))          return { };
+		if(!rd.readArray(&ret.channelIds))          return { };
+		if(!rd.readArray(&ret.channelNames))        return { };
+		if(!rd.readArray(&ret.contents))            return { };
+		if(!rd.readArray(&ret.emoteStarts))         return { };
+		if(!rd.readArray(&ret.flags))               return { };
+		if(!rd.readArray(&ret.emotePositions))      return { };
+
+		// make sure the columns line up, so nobody else has to check.
+		auto n = ret.timestamps.size();
+		if(ret.messageIds.size() != n || ret.userIds.size() != n || ret.usernames.size() != n || ret.nicknames.size() != n
+			|| ret.guildIds.size() != n || ret.guildNames.size() != n || ret.channelIds.size() != n
+			|| ret.channelNames.size() != n || ret.contents.size() != n || ret.emoteStarts.size() != n || ret.flags.size() != n)
+		{
+			return lg::error_o("db", "discord message log is inconsistent");
+		}
+
+		auto nstrs = ret.strings.size();
+		for(size_t i = 0; i < n; i++)
+		{
+			auto end = (i + 1 < n ? ret.emoteStarts[i + 1] : ret.emotePositions.size());
+			if(ret.emoteStarts[i] > end || ret.usernames[i] >= nstrs || ret.nicknames[i] >= nstrs
+				|| ret.guildNames[i] >= nstrs || ret.channelNames[i] >= nstrs)
+			{
+				return lg::error_o("db", "discord message log is inconsistent");
+			}
+
+			ret.index.add(ret.channelIds[i], ret.usernames[i], ret.timestamps[i]);
+		}
 
 		return ret;
 	}
@@ -10,7 +10,6 @@
 #include "defs.h"
 #include "timer.h"
 #include "config.h"
-#include "markov.h"
 #include "discord.h"
 
 #include "picojson.h"
@@ -76,12 +75,10 @@ namespace ikura::discord
 			).as_str());
 		*/
 
-		if(!ran_cmd && chan.name != "bot-shrine")
-			markov::process(sanitised, emote_idxs);
-
 		// zpr::println("the raw message:\n{}", json["content"].as_str());
 		// zpr::println("the sanitised message:\n{}", sanitised);
 
+		// this trains the model as well (but not on commands).
 		auto ts = util::getMillisecondTimestamp();
 		this->logMessage(ts, author, chan, guild, Snowflake(json["id"].as_str()), sanitised, emote_idxs, ran_cmd, wasEdit);
 
@@ -117,7 +114,7 @@ namespace ikura::discord
 	{
 		auto id = Snowflake(json["id"].as_str());
 
-		database().perform_write([&](auto& db) {
+		db::write({ db::Section::Discord }, [&](auto& db) {
 			auto& guild = db.discordData.guilds[id];
 
 			guild.id = id;
@@ -325,7 +322,18 @@ namespace ikura::discord
 
 	static DiscordGuild& get_guild(Snowflake id)
 	{
-		return database().wlock()->discordData.guilds[id];
+		// this happens for every message, so only make the database dirty if it's a new guild.
+		auto guild = db::write_quiet({ db::Section::Discord }, [&id](auto& db) -> DiscordGuild* {
+			if(auto it = db.discordData.guilds.find(id); it != db.discordData.guilds.end())
+				return &it.value();
+
+			return nullptr;
+		});
+
+		if(guild != nullptr)
+			return *guild;
+
+		return db::write({ db::Section::Discord }, [&id](auto& db) -> DiscordGuild& { return db.discordData.guilds[id]; });
 	}
 
 	static DiscordUser& update_user(DiscordGuild& guild, pj::object json)
@@ -334,51 +342,71 @@ namespace ikura::discord
 		auto& j_member = json["member"].as_obj();
 
 		auto id = Snowflake(j_author["id"].as_str());
-		auto& user = guild.knownUsers[id];
+		auto guildId = Snowflake(json["guild_id"].as_str());
 
-		auto old_username = user.username;
-		auto old_nickname = user.nickname;
+		// this also happens for every message, so it goes in the journal instead of making the database
+		// dirty -- but only if something actually changed.
+		return db::write_quiet({ db::Section::Discord }, [&](auto& db) -> DiscordUser& {
+			auto it = guild.knownUsers.find(id);
+			auto existing = (it != guild.knownUsers.end() ? &it.value() : nullptr);
 
-		user.username = j_author["username"].as_str();
-		user.nickname = (j_member["nick"].is_null()
-			? user.username
-			: j_member["nick"].as_str()
-		);
+			// work on a copy, so we can see if it changed. the journal fixes up the name maps.
+			auto user = (existing ? *existing : DiscordUser());
 
-		user.permissions |= permissions::EVERYONE;
+			auto old_username = user.username;
+			auto old_nickname = user.nickname;
 
-		if(user.id.empty())
-		{
-			user.id = id;
+			user.username = j_author["username"].as_str();
+			user.nickname = (j_member["nick"].is_null()
+				? user.username
+				: j_member["nick"].as_str()
+			);
 
-			lg::log("discord", "adding (nick: {}, user: {}, id: {}) to guild '{}'",
-				user.nickname, user.username, id.str(), guild.name);
-		}
-		else if(!old_username.empty() && old_username != user.username)
-		{
-			guild.usernameMap.erase(old_username);
-			lg::log("discord", "username changed; old: {}, new: {}", old_username, user.username);
-		}
-		else if(!old_nickname.empty() && old_nickname != user.nickname)
-		{
-			guild.nicknameMap.erase(old_nickname);
-			lg::log("discord", "nickname changed; old: {}, new: {}", old_nickname, user.nickname);
-		}
-		else if(user.id != id)
-		{
-			lg::warn("discord", "user id got changed?! old: {}, new: {}",
-				user.id.str(), id.str());
-		}
+			user.permissions |= permissions::EVERYONE;
 
-		// just re-do the roles every time, i guess. there's no good way to do deltas anyway.
-		user.discordRoles = zfu::map(j_member["roles"].as_arr(), [](auto& o) -> auto {
-			return Snowflake(o.as_str());
-		});
+			if(user.id.empty())
+			{
+				user.id = id;
 
-		guild.usernameMap[user.username] = user.id;
-		guild.nicknameMap[user.nickname] = user.id;
+				lg::log("discord", "adding (nick: {}, user: {}, id: {}) to guild '{}'",
+					user.nickname, user.username, id.str(), guild.name);
+			}
+			else if(!old_username.empty() && old_username != user.username)
+			{
+				lg::log("discord", "username changed; old: {}, new: {}", old_username, user.username);
+			}
+			else if(!old_nickname.empty() && old_nickname != user.nickname)
+			{
+				lg::log("discord", "nickname changed; old: {}, new: {}", old_nickname, user.nickname);
+			}
+			else if(user.id != id)
+			{
+				lg::warn("discord", "user id got changed?! old: {}, new: {}",
+					user.id.str(), id.str());
+			}
+
+			// just re-do the roles every time, i guess. there's no good way to do deltas anyway.
+			user.discordRoles = zfu::map(j_member["roles"].as_arr(), [](auto& o) -> auto {
+				return Snowflake(o.as_str());
+			});
+
+			auto un = guild.usernameMap.find(user.username);
+			auto nn = guild.nicknameMap.find(user.nickname);
 
-		return user;
+			bool changed = !existing
+				|| existing->id != user.id
+				|| existing->username != user.username
+				|| existing->nickname != user.nickname
+				|| existing->permissions != user.permissions
+				|| existing->discordRoles != user.discordRoles
+				|| un == guild.usernameMap.end() || un->second != user.id
+				|| nn == guild.nicknameMap.end() || nn->second != user.id;
+
+			if(changed)
+				db::journal::updateUser(db, guildId, user);
+
+			return guild.knownUsers[id];
+		});
 	}
 
 	static auto timestamp_regex = std::regex("(\\d{4})-(\\d{2})-(\\d{2})T(\\d{2}):(\\d{2}):(\\d{2})\\.(\\d+)(\\+|-)(\\d{2}):(\\d{2})");
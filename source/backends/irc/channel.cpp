@@ -28,7 +28,7 @@ namespace ikura::irc
 		if(username == irc::MAGIC_OWNER_USERID || username == this->server->owner)
 			return true;
 
-		return database().map_read([&](auto& db) {
+		return ikura::db::read({ ikura::db::Section::Irc }, [&](auto& db) {
 			auto srv = db.ircData.getServer(this->server->name);
 			if(!srv) return false;
 
@@ -3,6 +3,7 @@
 
 #include "db.h"
 #include "irc.h"
+#include "markov.h"
 #include "serialise.h"
 
 namespace ikura::irc
@@ -19,10 +20,14 @@ namespace ikura::irc
 		msg.channel = chan->getName();
 		msg.server  = chan->server->name;
 
-		msg.message = database().wlock()->messageData.logMessageContents(message);
 		msg.isCommand = isCmd;
 
-		database().wlock()->ircData.messageLog.messages.push_back(std::move(msg));
+		ikura::db::write_quiet({ ikura::db::Section::Irc, ikura::db::Section::Messages, ikura::db::Section::Search }, [&](auto& db) {
+			ikura::db::journal::logMessage(db, std::move(msg), message);
+
+			if(!isCmd)
+				markov::process(message, { }, chan->getName());
+		});
 	}
 
 	void db::IRCMessage::serialise(Buffer& buf) const
@@ -66,12 +71,46 @@ namespace ikura::irc
 
 
 
+	void db::IRCMessageLog::add(const IRCMessage& msg)
+	{
+		this->timestamps.push_back(msg.timestamp);
+		this->nicknames.push_back(this->strings.add(msg.nickname));
+		this->usernames.push_back(this->strings.add(msg.username));
+		this->channels.push_back(this->strings.add(msg.channel));
+		this->servers.push_back(this->strings.add(msg.server));
+		this->contents.push_back(msg.message);
+		this->flags.push_back(msg.isCommand ? FLAG_COMMAND : 0);
+
+		this->index.add(channelKey(this->servers.back(), this->channels.back()), this->nicknames.back(), msg.timestamp);
+	}
+
+	db::IRCMessage db::IRCMessageLog::get(size_t i) const
+	{
+		IRCMessage ret;
+		ret.timestamp = this->timestamps[i];
+		ret.nickname = this->strings.get(this->nicknames[i]).str();
+		ret.username = this->strings.get(this->usernames[i]).str();
+		ret.channel = this->strings.get(this->channels[i]).str();
+		ret.server = this->strings.get(this->servers[i]).str();
+		ret.message = this->contents[i];
+		ret.isCommand = this->isCommand(i);
+
+		return ret;
+	}
+
 	void db::IRCMessageLog::serialise(Buffer& buf) const
 	{
 		auto wr = serialise::Writer(buf);
 		wr.tag(TYPE_TAG);
 
-		wr.write(this->messages);
+		wr.write(this->strings);
+		wr.writeArray(this->timestamps);
+		wr.writeArray(this->nicknames);
+		wr.writeArray(this->usernames);
+		wr.writeArray(this->channels);
+		wr.writeArray(this->servers);
+		wr.writeArray(this->contents);
+		wr.writeArray(this->flags);
 	}
 
 	std::optional<db::IRCMessageLog> db::IRCMessageLog::deserialise(Span& buf)
@@ -81,8 +120,45 @@ namespace ikura::irc
 			return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, TYPE_TAG);
 
 		db::IRCMessageLog ret;
-		if(!rd.read(&ret.messages))
-			return { };
+
+		// before version 35, it was just a list of messages.
+		if(ikura::db::getVersion() < 35)
+		{
+			auto msgs = rd.read<std::vector<IRCMessage>>();
+			if(!msgs)
+				return { };
+
+			for(auto& msg : msgs.value())
+				ret.add(msg);
+
+			return ret;
+		}
+
+		if(!rd.read(&ret.strings))                  return { };
+		if(!rd.readArray(&ret.timestamps))          return { };
+		if(!rd.readArray(&ret.nicknames))           return { };
+		if(!rd.readArray(&ret.usernames))           return { };
+		if(!rd.readArray(&ret.channels))            return { };
+		if(!rd.readArray(&ret.servers))             return { };
+		if(!rd.readArray(&ret.contents))            return { };
+		if(!rd.readArray(&ret.flags))               return { };
+
+		// make sure the columns line up, so nobody else has to check.
+		auto n = ret.timestamps.size();
+		if(ret.nicknames.size() != n || ret.usernames.size() != n || ret.channels.size() != n || ret.servers.size() != n
+			|| ret.contents.size() != n || ret.flags.size() != n)
+		{
+			return lg::error_o("db", "irc message log is inconsistent");
+		}
+
+		auto nstrs = ret.strings.size();
+		for(size_t i = 0; i < n; i++)
+		{
+			if(ret.nicknames[i] >= nstrs || ret.usernames[i] >= nstrs || ret.channels[i] >= nstrs || ret.servers[i] >= nstrs)
+				return lg::error_o("db", "irc message log is inconsistent");
+
+			ret.index.add(channelKey(ret.servers[i], ret.channels[i]), ret.nicknames[i], ret.timestamps[i]);
+		}
 
 		return ret;
 	}
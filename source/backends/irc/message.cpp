@@ -5,7 +5,6 @@
 #include "irc.h"
 #include "cmd.h"
 #include "timer.h"
-#include "markov.h"
 
 namespace ikura::irc
 {
@@ -109,7 +108,10 @@ namespace ikura::irc
 		auto sys = zpr::sprint("irc/{}", srv->name);
 
 		uint64_t perms = permissions::EVERYONE;
-		database().perform_write([&](auto& db) {
+
+		// this happens for every message, so it goes in the journal instead of making the database
+		// dirty -- but only if something actually changed.
+		ikura::db::write_quiet({ ikura::db::Section::Irc }, [&](auto& db) {
 
 			// no need to check for existence; just use operator[] and create things as we go along.
 			{
@@ -127,10 +129,11 @@ namespace ikura::irc
 					return;
 				}
 
-				if(chan->knownUsers.find(username) == chan->knownUsers.end())
+				auto existing = chan->getUser(username);
+				if(!existing)
 					lg::log(sys, "new user '{}' (nick: {})", username, nickname);
 
-				auto& user = chan->knownUsers[username];
+				auto user = (existing ? *existing : db::IRCUser());
 				user.username = username;
 
 				if(!user.nickname.empty() && user.nickname != nickname)
@@ -140,7 +143,15 @@ namespace ikura::irc
 
 				// update the credentials:
 				user.permissions = perms;
-				chan->nicknameMapping[user.nickname] = user.username;
+
+				auto mapping = chan->nicknameMapping.find(user.nickname);
+				bool changed = !existing
+					|| existing->nickname != user.nickname
+					|| existing->permissions != user.permissions
+					|| mapping == chan->nicknameMapping.end() || mapping->second != user.username;
+
+				if(changed)
+					ikura::db::journal::updateUser(db, srv->name, channel, user);
 			}
 		});
 	}
@@ -177,10 +188,7 @@ namespace ikura::irc
 			if(!srv->channels[channel].shouldLurk() && !msg.isCTCP)
 				ran_cmd = cmd::processMessage(username, username, &srv->channels[channel], message, /* enablePings: */ true);
 
-			// don't train on commands. (no emotes btw)
-			if(!ran_cmd)
-				markov::process(message, { });
-
+			// this trains the model as well (but not on commands).
 			srv->logMessage(util::getMillisecondTimestamp(), username, msg.nick, &srv->channels[channel], message, ran_cmd);
 
 			console::logMessage(Backend::IRC, srv->name, channel, time.measure(), msg.nick, message);
@@ -286,7 +286,7 @@ namespace ikura::irc
 		this->rx_thread = std::thread(&IRCServer::recv_worker, this);
 		this->tx_thread = std::thread(&IRCServer::send_worker, this);
 
-		database().perform_write([&](auto& db) {
+		ikura::db::write({ ikura::db::Section::Irc }, [&](auto& db) {
 			auto& srv = db.ircData.servers[this->name];
 
 			srv.name        = this->name;
@@ -31,7 +31,7 @@ namespace ikura::twitch
 		if(userid == MAGIC_OWNER_USERID)
 			return true;
 
-		return database().map_read([&](auto& db) {
+		return db::read({ db::Section::Twitch }, [&](auto& db) {
 			// mfw "const correctness", so we can't use operator[]
 			auto chan = db.twitchData.getChannel(this->name);
 			if(!chan) return false;
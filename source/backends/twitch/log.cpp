@@ -4,6 +4,7 @@
 
 #include "db.h"
 #include "twitch.h"
+#include "markov.h"
 #include "serialise.h"
 
 namespace ikura::twitch
@@ -13,7 +14,7 @@ namespace ikura::twitch
 	{
 		TwitchMessage tmsg;
 
-		auto tchan = database().rlock()->twitchData.getChannel(chan->getName());
+		auto tchan = db::read({ db::Section::Twitch }, [chan](auto& db) { return db.twitchData.getChannel(chan->getName()); });
 		if(!tchan) return;
 
 		auto user = tchan->getUser(userid);
@@ -29,9 +30,15 @@ namespace ikura::twitch
 		tmsg.isCommand = isCmd;
 
 		tmsg.emotePositions = emote_idxs;
-		tmsg.message = database().wlock()->messageData.logMessageContents(message);
 
-		database().wlock()->twitchData.messageLog.messages.push_back(std::move(tmsg));
+		// the model gets it while the log is still locked, so that it sees messages in the same order as the log
+		// (see markov::retrain).
+		db::write_quiet({ db::Section::Twitch, db::Section::Messages, db::Section::Search }, [&](auto& db) {
+			db::journal::logMessage(db, std::move(tmsg), message);
+
+			if(!isCmd)
+				markov::process(message, emote_idxs, chan->getName());
+		});
 	}
 
 
@@ -89,12 +96,59 @@ namespace ikura::twitch
 
 
 
+	void TwitchMessageLog::add(const TwitchMessage& msg)
+	{
+		this->timestamps.push_back(msg.timestamp);
+		this->userids.push_back(this->strings.add(msg.userid));
+		this->usernames.push_back(this->strings.add(msg.username));
+		this->displaynames.push_back(this->strings.add(msg.displayname));
+		this->channels.push_back(this->strings.add(msg.channel));
+		this->contents.push_back(msg.message);
+		this->flags.push_back(msg.isCommand ? FLAG_COMMAND : 0);
+
+		this->emoteStarts.push_back((uint32_t) this->emotePositions.size());
+		this->emotePositions.insert(this->emotePositions.end(), msg.emotePositions.begin(), msg.emotePositions.end());
+
+		this->index.add(this->channels.back(), this->usernames.back(), msg.timestamp);
+	}
+
+	ikura::span<ikura::relative_str> TwitchMessageLog::getEmotePositions(size_t i) const
+	{
+		auto end = (i + 1 < this->emoteStarts.size() ? this->emoteStarts[i + 1] : this->emotePositions.size());
+		return ikura::span<ikura::relative_str>(this->emotePositions.data() + this->emoteStarts[i],
+			end - this->emoteStarts[i]);
+	}
+
+	TwitchMessage TwitchMessageLog::get(size_t i) const
+	{
+		TwitchMessage ret;
+		ret.timestamp = this->timestamps[i];
+		ret.userid = this->strings.get(this->userids[i]).str();
+		ret.username = this->strings.get(this->usernames[i]).str();
+		ret.displayname = this->strings.get(this->displaynames[i]).str();
+		ret.channel = this->strings.get(this->channels[i]).str();
+		ret.message = this->contents[i];
+		ret.emotePositions = this->getEmotePositions(i).vec();
+		ret.isCommand = this->isCommand(i);
+
+		return ret;
+	}
+
 	void TwitchMessageLog::serialise(Buffer& buf) const
 	{
 		auto wr = serialise::Writer(buf);
 		wr.tag(TYPE_TAG);
 
-		wr.write(this->messages);
+		wr.write(this->strings);
+		wr.writeArray(this->timestamps);
+		wr.writeArray(this->userids);
+		wr.writeArray(this->usernames);
+		wr.writeArray(this->displaynames);
+		wr.writeArray(this->channels);
+		wr.writeArray(this->contents);
+		wr.writeArray(this->emoteStarts);
+		wr.writeArray(this->flags);
+		wr.writeArray(this->emotePositions);
 	}
 
 	std::optional<TwitchMessageLog> TwitchMessageLog::deserialise(Span& buf)
@@ -104,8 +158,51 @@ namespace ikura::twitch
 			return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, TYPE_TAG);
 
 		TwitchMessageLog ret;
-		if(!rd.read(&ret.messages))
-			return { };
+
+		// before version 35, it was just a list of messages.
+		if(db::getVersion() < 35)
+		{
+			auto msgs = rd.read<std::vector<TwitchMessage>>();
+			if(!msgs)
+				return { };
+
+			for(auto& msg : msgs.value())
+				ret.add(msg);
+
+			return ret;
+		}
+
+		if(!rd.read(&ret.strings))                  return { };
+		if(!rd.readArray(&ret.timestamps))          return { };
+		if(!rd.readArray(&ret.userids))             return { };
+		if(!rd.readArray(&ret.usernames))           return { };
+		if(!rd.readArray(&ret.displaynames))        return { };
+		if(!rd.readArray(&ret.channels))            return { };
+		if(!rd.readArray(&ret.contents))            return { };
+		if(!rd.readArray(&ret.emoteStarts))         return { };
+		if(!rd.readArray(&ret.flags))               return { };
+		if(!rd.readArray(&ret.emotePositions))      return { };
+
+		// make sure the columns line up, so nobody else has to check.
+		auto n = ret.timestamps.size();
+		if(ret.userids.size() != n || ret.usernames.size() != n || ret.displaynames.size() != n
+			|| ret.channels.size() != n || ret.contents.size() != n || ret.emoteStarts.size() != n || ret.flags.size() != n)
+		{
+			return lg::error_o("db", "twitch message log is inconsistent");
+		}
+
+		auto nstrs = ret.strings.size();
+		for(size_t i = 0; i < n; i++)
+		{
+			auto end = (i + 1 < n ? ret.emoteStarts[i + 1] : ret.emotePositions.size());
+			if(ret.emoteStarts[i] > end || ret.userids[i] >= nstrs || ret.usernames[i] >= nstrs
+				|| ret.displaynames[i] >= nstrs || ret.channels[i] >= nstrs)
+			{
+				return lg::error_o("db", "twitch message log is inconsistent");
+			}
+
+			ret.index.add(ret.channels[i], ret.usernames[i], ret.timestamps[i]);
+		}
 
 		return ret;
 	}
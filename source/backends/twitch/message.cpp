@@ -9,7 +9,6 @@
 #include "defs.h"
 #include "timer.h"
 #include "config.h"
-#include "markov.h"
 #include "twitch.h"
 
 namespace ikura::twitch
@@ -138,10 +137,7 @@ namespace ikura::twitch
 				: util::getMillisecondTimestamp()
 			);
 
-			// don't train on commands.
-			if(!ran_cmd)
-				markov::process(message_u8, rel_emotes);
-
+			// this trains the model as well (but not on commands).
 			this->logMessage(ts, userid, &this->channels[channel], message_u8, rel_emotes, ran_cmd);
 
 			// lg::log("msg", "twitch/#{}: ({.2f} ms) <{}> {}", channel, time.measure(), username, message_u8);
@@ -224,15 +220,17 @@ namespace ikura::twitch
 			return "";
 		}
 
-		// acquire a big lock.
-		database().perform_write([&](auto& db) {
+		// lock the twitch part of the database. this happens for every message, so it goes in the journal instead of making
+		// the database dirty -- but only if something actually changed.
+		db::write_quiet({ db::Section::Twitch }, [&](auto& db) {
 
 			// no need to check for existence; just use operator[] and create things as we go along.
-			// update the user:
+			// update the user (a copy of it, so we can see if it changed):
 			{
 				auto& tchan = db.twitchData.channels[channel];
-				auto& tuser = tchan.knownUsers[userid];
+				auto existing = tchan.getUser(userid);
 
+				auto tuser = (existing ? *existing : TwitchUser());
 				tuser.username = user.str();
 				tuser.displayname = displayname;
 
@@ -252,7 +250,17 @@ namespace ikura::twitch
 				tuser.permissions = perms;
 				tuser.subscribedMonths = sublen;
 
-				tchan.usernameMapping[tuser.username] = tuser.id;
+				auto mapping = tchan.usernameMapping.find(tuser.username);
+				bool changed = !existing
+					|| existing->id != tuser.id
+					|| existing->username != tuser.username
+					|| existing->displayname != tuser.displayname
+					|| existing->permissions != tuser.permissions
+					|| existing->subscribedMonths != tuser.subscribedMonths
+					|| mapping == tchan.usernameMapping.end() || mapping->second != tuser.id;
+
+				if(changed)
+					db::journal::updateUser(db, channel, tuser);
 			}
 		});
 
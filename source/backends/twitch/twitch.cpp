@@ -160,7 +160,7 @@ namespace ikura::twitch
 				cfg.mod, cfg.respondToPings, cfg.silentInterpErrors, cfg.runMessageHandlers, cfg.commandPrefixes,
 				cfg.haveFFZEmotes, cfg.haveBTTVEmotes));
 
-			database().wlock()->twitchData.channels[cfg.name].name = cfg.name;
+			db::write({ db::Section::Twitch }, [&](auto& db) { db.twitchData.channels[cfg.name].name = cfg.name; });
 
 			dispatcher().run([=]() -> std::string {
 
@@ -190,7 +190,7 @@ namespace ikura::twitch
 				auto id = json.as_obj()["data"].as_arr()[0].as_obj()["id"].as_str();
 				auto name = json.as_obj()["data"].as_arr()[0].as_obj()["login"].as_str();
 
-				database().wlock()->twitchData.channels[name].id = id;
+				db::write({ db::Section::Twitch }, [&](auto& db) { db.twitchData.channels[name].id = id; });
 				lg::log("twitch", "#{} -> id {}", name, id);
 
 			}).discard();
@@ -399,6 +399,6 @@ namespace ikura::cmd
 
 	static Message generateResponse(str_view userid, const Channel* chan, str_view msg)
 	{
-		return markov::generateMessage();
+		return markov::getMessage();
 	}
 }
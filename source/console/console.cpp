@@ -12,6 +12,7 @@
 #include "db.h"
 #include "cmd.h"
 #include "defs.h"
+#include "timer.h"
 #include "types.h"
 #include "config.h"
 #include "interp.h"
@@ -304,7 +305,7 @@ namespace ikura::console
 						return true;
 					}
 
-					database().rlock()->sync();
+					db::sync();
 				}
 				else if(cmd == "retrain")
 				{
@@ -330,6 +331,118 @@ namespace ikura::console
 
 					thr.detach();
 				}
+				else if(cmd == "prune")
+				{
+					if(!args.empty())
+					{
+						echo_message(sock, "'prune' takes 0 arguments\n");
+						return true;
+					}
+
+					markov::prune();
+				}
+				else if(cmd == "pool")
+				{
+					if(!args.empty())
+					{
+						echo_message(sock, "'pool' takes 0 arguments\n");
+						return true;
+					}
+
+					auto stats = markov::getPoolStats();
+					auto total = stats.hits + stats.misses;
+
+					echo_message(sock, zpr::sprint("markov pool: {} message{} in {} class{}\n", stats.pooled,
+						stats.pooled == 1 ? "" : "s", stats.classes, stats.classes == 1 ? "" : "es"));
+
+					echo_message(sock, zpr::sprint("  {} hit{}, {} miss{} ({.1f}% hit rate)\n", stats.hits, stats.hits == 1 ? "" : "s",
+						stats.misses, stats.misses == 1 ? "" : "es", total == 0 ? 0.0 : 100.0 * (double) stats.hits / (double) total));
+
+					echo_message(sock, zpr::sprint("  {} refill{} (avg {.2f} ms)\n", stats.refills, stats.refills == 1 ? "" : "s",
+						stats.refillTime));
+				}
+				else if(cmd == "filter")
+				{
+					if(!args.empty())
+					{
+						echo_message(sock, "'filter' takes 0 arguments\n");
+						return true;
+					}
+
+					auto stats = markov::getFilterStats();
+
+					echo_message(sock, zpr::sprint("markov filter: {} message{} checked in {} channel{}\n", stats.checked,
+						stats.checked == 1 ? "" : "s", stats.channels, stats.channels == 1 ? "" : "s"));
+
+					echo_message(sock, zpr::sprint("  {} dropped ({.1f}%), saving {} word{} ({} byte{})\n", stats.dropped,
+						stats.checked == 0 ? 0.0 : 100.0 * (double) stats.dropped / (double) stats.checked,
+						stats.droppedWords, stats.droppedWords == 1 ? "" : "s", stats.droppedBytes, stats.droppedBytes == 1 ? "" : "s"));
+				}
+				else if(cmd == "seen" || cmd == "quote")
+				{
+					if(args.size() != 1)
+					{
+						echo_message(sock, zpr::sprint("'{}' takes 1 argument\n", cmd));
+						return true;
+					}
+
+					if(State.currentChannel == nullptr)
+					{
+						echo_message(sock, "not in a channel\n");
+						return true;
+					}
+
+					auto user = args[0];
+					if(cmd == "quote")
+					{
+						if(auto msg = db::query::randomMessage(State.currentChannel, user); msg.has_value())
+							echo_message(sock, zpr::sprint("<{}> {}\n", user, msg.value()));
+
+						else
+							echo_message(sock, zpr::sprint("'{}' hasn't said anything here\n", user));
+					}
+					else
+					{
+						auto count = db::query::messageCount(State.currentChannel, user);
+						auto last = db::query::lastSeen(State.currentChannel, user);
+						if(!last.has_value())
+						{
+							echo_message(sock, zpr::sprint("'{}' hasn't said anything here\n", user));
+							goto end;
+						}
+
+						auto now = util::getMillisecondTimestamp();
+						auto ago = (now - std::min(now, last.value())) / 1000;
+
+						std::string str;
+						if(ago < 60)            str = zpr::sprint("{} second{}", ago, ago == 1 ? "" : "s");
+						else if(ago < 3600)     str = zpr::sprint("{} minute{}", ago / 60, ago / 60 == 1 ? "" : "s");
+						else if(ago < 86400)    str = zpr::sprint("{} hour{}", ago / 3600, ago / 3600 == 1 ? "" : "s");
+						else                    str = zpr::sprint("{} day{}", ago / 86400, ago / 86400 == 1 ? "" : "s");
+
+						echo_message(sock, zpr::sprint("'{}': {} message{}, last seen {} ago\n", user, count,
+							count == 1 ? "" : "s", str));
+					}
+				}
+				else if(cmd == "search")
+				{
+					if(args.empty())
+					{
+						echo_message(sock, "'search' takes at least 1 argument\n");
+						return true;
+					}
+
+					// if we're in a channel, only look there.
+					auto t = timer();
+					auto results = db::query::search(State.currentChannel, argstr, 10);
+					auto time = t.measure();
+
+					for(auto it = results.rbegin(); it != results.rend(); ++it)
+						echo_message(sock, zpr::sprint("{} <{}> {}\n", it->channel, it->user, it->message));
+
+					echo_message(sock, zpr::sprint("{} result{} ({.2f} ms)\n", results.size(),
+						results.size() == 1 ? "" : "s", time));
+				}
 				else if(cmd == "join")
 				{
 					if(args.size() < 2)
@@ -385,7 +498,7 @@ namespace ikura::console
 						auto& guild_name = server;
 						auto& channel_name = channel;
 
-						auto guild = database().map_read([&guild_name](auto& db) -> const discord::DiscordGuild* {
+						auto guild = db::read({ db::Section::Discord }, [&guild_name](auto& db) -> const discord::DiscordGuild* {
 							auto& dd = db.discordData;
 							for(const auto& [ s, g ] : dd.guilds)
 								if(g.name == guild_name)
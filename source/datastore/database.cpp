@@ -5,13 +5,16 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
-
+#include <sys/wait.h>
 
 #include <filesystem>
 
 #include "db.h"
+#include "async.h"
 #include "timer.h"
+#include "interp.h"
 #include "twitch.h"
 #include "markov.h"
 #include "discord.h"
@@ -31,18 +34,149 @@ namespace ikura::db
 		uint64_t timestamp; // the timestamp, in milliseconds when the database was last modified
 	};
 
+	// since version 33, the superblock is followed by a table of contents, and each part of the database is its
+	// own section. this lets us load the sections in parallel, and if one of them is broken, we know which. it also
+	// means sync only has to serialise the sections that changed; the rest are copied from the old file. each
+	// section starts on a SECTION_ALIGNMENT boundary, so that the copy can share blocks with the old file (on
+	// filesystems that can do that).
+	struct SectionTable
+	{
+		uint32_t count;     // the number of SectionEntries that follow
+		uint32_t flags;     // there are none defined
+	};
+
+	struct SectionEntry
+	{
+		uint32_t id;        // see db::Section
+		uint32_t flags;     // there are none defined
+		uint64_t offset;    // from the start of the file
+		uint64_t size;
+		uint64_t checksum;  // see checksum()
+	};
+
 	static_assert(sizeof(Superblock) == 24);
+	static_assert(sizeof(SectionTable) == 8);
+	static_assert(sizeof(SectionEntry) == 32);
 
-	constexpr uint32_t DB_VERSION   = 30;
+	constexpr uint32_t DB_VERSION   = 37;
 	constexpr const char* DB_MAGIC  = "ikura_db";
 
+	constexpr size_t NUM_SECTIONS           = 8;
+	constexpr size_t SECTION_ALIGNMENT      = 4096;
+
+	constexpr size_t HEADER_SIZE            = sizeof(Superblock) + sizeof(SectionTable) + NUM_SECTIONS * sizeof(SectionEntry);
+	static_assert(HEADER_SIZE <= SECTION_ALIGNMENT);
+
+	struct SectionInfo
+	{
+		Section id;
+		const char* name;
+		bool (*read)(Database& db, Span& buf);
+
+		// the interpreter state has its own lock, so sync serialises it beforehand (see sync).
+		void (*write)(const Database& db, const Buffer& interpState, Buffer& buf);
+
+		// the version that added this section; older databases don't have it, so it's left empty.
+		uint32_t since = 33;
+	};
+
+	// the file that's being loaded (only while load is running), so that the message logs can use it directly.
+	static std::shared_ptr<const uint8_t> loadedFile;
+
+	// the sections don't depend on each other, so they can be read in any order (or all at once).
+	static const SectionInfo Sections[NUM_SECTIONS] = {
+		{
+			Section::Twitch, "twitch",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.twitchData); },
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.twitchData); }
+		},
+		{
+			Section::Interp, "interp",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.interpState); },
+			[](const Database& db, const Buffer& interpState, Buffer& buf) {
+				serialise::Writer(buf).bytes(interpState.data(), interpState.size());
+			}
+		},
+		{
+			Section::Markov, "markov",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.markovData); },
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.markovData); }
+		},
+		{
+			Section::Shared, "shared",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.sharedData); },
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.sharedData); }
+		},
+		{
+			Section::Discord, "discord",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.discordData); },
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.discordData); }
+		},
+		{
+			Section::Irc, "irc",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.ircData); },
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.ircData); }
+		},
+		{
+			Section::Messages, "messages",
+			[](Database& db, Span& buf) -> bool {
+				auto msgs = MessageDB::deserialise(buf, loadedFile);
+				if(!msgs.has_value())
+					return false;
+
+				db.messageData = std::move(msgs.value());
+				return true;
+			},
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.messageData); }
+		},
+		{
+			Section::Search, "search",
+			[](Database& db, Span& buf) { return serialise::Reader(buf).read(&db.searchData); },
+			[](const Database& db, const Buffer&, Buffer& buf) { serialise::Writer(buf).write(db.searchData); },
+			36
+		},
+	};
+
+	constexpr uint32_t ALL_SECTIONS = []() {
+		uint32_t ret = 0;
+		for(uint32_t i = 1; i <= NUM_SECTIONS; i++)
+			ret |= sectionBit((Section) i);
+
+		return ret;
+	}();
+
 	// the database will only sync to disk if it was modified
-	// or rather, if anyone took a write lock on it. so we can afford
+	// or rather, if anyone took a write lock on it (see markDirty). so we can afford
 	// to set the interval a little shorter.
 	constexpr auto SYNC_INTERVAL    = 30s;
 
-	static std::atomic<bool> databaseDirty = false;
-	static Synchronised<Database> TheDatabase;
+	// the journal (see journal.cpp) is folded into the database (ie. we sync) once it gets this big,
+	// or once it's this old, even if nothing else changed.
+	constexpr size_t MAX_JOURNAL_SIZE       = 64 * 1024 * 1024;
+	constexpr uint64_t CHECKPOINT_INTERVAL  = 60 * 60 * 1000;
+
+	// sync streams each section straight into the new file through a buffer of this size, instead of building the
+	// whole thing in memory first.
+	constexpr size_t SYNC_BUFFER_SIZE       = 256 * 1024;
+
+	// how long the sync process gets before we decide that it's stuck, and kill it. writing everything from scratch
+	// (eg. after an upgrade) can take a while, so this is quite generous.
+	constexpr uint64_t SYNC_TIMEOUT         = 10 * 60 * 1000;
+
+	// the sections that changed since the last sync (as sectionBits).
+	static std::atomic<uint32_t> dirtySections = 0;
+
+	// where the sections are in the file that's on disk now, so sync can copy the ones that didn't change. this is
+	// only used by sync (which has its own lock) and load. if we don't have it, everything gets written.
+	static std::array<SectionEntry, NUM_SECTIONS> diskSections;
+	static bool haveDiskSections = false;
+
+	// one lock per section, indexed by its id (see db::read in db.h).
+	static std::shared_mutex sectionLocks[NUM_SECTIONS + 1];
+
+	static std::atomic<uint64_t> lastCheckpoint = 0;
+	static Database TheDatabase;
+	static std::mutex syncLock;
 	static std::fs::path databasePath;
 	static bool readOnly = false;
 
@@ -62,6 +196,91 @@ namespace ikura::db
 		return std::nullopt;
 	}
 
+	// this isn't cryptographic, it just needs to notice when a section got mangled. it has to be fast though, since
+	// the message logs get pretty big; so it does 32 bytes at a time, in 4 independent lanes (like xxhash). it can be
+	// fed in pieces, since sync doesn't have the whole section at once.
+	struct Checksum
+	{
+		void update(const uint8_t* data, size_t len)
+		{
+			this->length += len;
+
+			// finish off the block from last time first.
+			if(this->pending > 0)
+			{
+				auto n = std::min(len, 32 - this->pending);
+				memcpy(this->tail + this->pending, data, n);
+
+				this->pending += n;
+				data += n;
+				len -= n;
+
+				if(this->pending < 32)
+					return;
+
+				this->block(this->tail);
+				this->pending = 0;
+			}
+
+			for(; len >= 32; data += 32, len -= 32)
+				this->block(data);
+
+			memcpy(this->tail, data, len);
+			this->pending = len;
+		}
+
+		uint64_t finish() const
+		{
+			auto& l = this->lanes;
+			uint64_t h = rotl(l[0], 1) + rotl(l[1], 7) + rotl(l[2], 12) + rotl(l[3], 18) + this->length;
+
+			size_t i = 0;
+			for(; i + 8 <= this->pending; i += 8)
+			{
+				uint64_t x = 0;
+				memcpy(&x, this->tail + i, 8);
+				h = rotl(h ^ round(0, x), 27) * P1 + P2;
+			}
+
+			for(; i < this->pending; i++)
+				h = rotl(h ^ (this->tail[i] * P2), 11) * P1;
+
+			h ^= h >> 33; h *= P2;
+			h ^= h >> 29; h *= P1;
+			return h ^ (h >> 32);
+		}
+
+	private:
+		static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL;
+		static constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+
+		static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+		static uint64_t round(uint64_t acc, uint64_t x) { return rotl(acc + x * P2, 31) * P1; }
+
+		void block(const uint8_t* data)
+		{
+			uint64_t x[4];
+			memcpy(x, data, 32);
+
+			for(size_t k = 0; k < 4; k++)
+				this->lanes[k] = round(this->lanes[k], x[k]);
+		}
+
+		uint64_t lanes[4] = { P1 + P2, P2, 0, 0 - P1 };
+		uint64_t length = 0;
+
+		uint8_t tail[32];
+		size_t pending = 0;
+	};
+
+	static uint64_t checksum(const uint8_t* data, size_t len)
+	{
+		Checksum sum;
+		sum.update(data, len);
+
+		return sum.finish();
+	}
+
 	Database Database::create()
 	{
 		Database db;
@@ -78,8 +297,12 @@ namespace ikura::db
 	{
 		lg::log("db", "creating new database '{}'", path.string());
 
-		*TheDatabase.wlock().get() = Database::create();
-		TheDatabase.rlock()->sync();
+		{
+			auto lk = __detail::SectionLock(ALL_SECTIONS, /* exclusive: */ true);
+			TheDatabase = Database::create();
+		}
+
+		sync();
 	}
 
 	bool load(ikura::str_view p, bool create, bool readonly)
@@ -88,6 +311,8 @@ namespace ikura::db
 		databasePath = path;
 		readOnly = readonly;
 
+		markov::setSnapshotPath(path.string() + ".markov");
+
 		if(!std::fs::exists(path))
 		{
 			if(create)  createNewDatabase(path);
@@ -111,14 +336,30 @@ namespace ikura::db
 		if(buf == nullptr || len == 0)
 			return false;
 
+		// the message logs keep pointing into the file after we're done (see MessageDB), so it stays mapped
+		// until they let go of it. sync never writes to this file (it makes a new one), so that's safe.
+		loadedFile = std::shared_ptr<const uint8_t>(buf, [fd = fd, len = len](const uint8_t* p) {
+			util::munmapEntireFile(fd, const_cast<uint8_t*>(p), len);
+		});
+
 		bool succ = false;
 		auto span = Span(buf, len);
 
 		lg::log("db", "loading database...");
 		if(auto db = Database::deserialise(span); db.has_value())
-			succ = true, *TheDatabase.wlock().get() = std::move(db.value());
+		{
+			// the journal has everything that happened since the last sync.
+			if(journal::open(path.string() + ".journal", db.value(), readOnly))
+			{
+				// this needs all the message logs (including what was in the journal), so it has to wait until now.
+				db->searchData.catchUp(db.value());
+
+				auto lk = __detail::SectionLock(ALL_SECTIONS, /* exclusive: */ true);
+				succ = true, TheDatabase = std::move(db.value());
+			}
+		}
 
-		util::munmapEntireFile(fd, buf, len);
+		loadedFile = nullptr;
 
 		if(succ)
 		{
@@ -139,17 +380,30 @@ namespace ikura::db
 						return lg::error_b("db", "failed to create backup: {}", ec.message());
 				}
 
-				TheDatabase.on_write_lock([]() { databaseDirty = true; });
+				// the interpreter state is saved with the database, but it has its own lock.
+				interpreter().on_write_lock([]() { markDirty({ Section::Interp }); });
 
-				// setup an idiot to periodically synchronise the database to disk.
+				lastCheckpoint = util::getMillisecondTimestamp();
+
+				// setup an idiot to periodically synchronise the database to disk. most of the time, only the
+				// journal changed, so there's nothing to do.
 				auto thr = std::thread([]() {
 					while(true)
 					{
 						util::sleep_for(SYNC_INTERVAL);
-						if(databaseDirty)
+
+						auto jsize = journal::size();
+						auto now = util::getMillisecondTimestamp();
+
+						if(dirtySections != 0 || jsize >= MAX_JOURNAL_SIZE || (now >= lastCheckpoint + CHECKPOINT_INTERVAL
+							&& jsize > 0))
+						{
+							sync();
+						}
+						else
 						{
-							databaseDirty = false;
-							ikura::database().rlock()->sync();
+							// the model isn't part of the database, so it still needs saving.
+							markov::saveSnapshot();
 						}
 					}
 				});
@@ -165,151 +419,664 @@ namespace ikura::db
 		return succ;
 	}
 
-	void Database::serialise(Buffer& buf) const
+	static size_t align_section(size_t offset)
 	{
-		auto wr = serialise::Writer(buf);
+		return (offset + SECTION_ALIGNMENT - 1) & ~(SECTION_ALIGNMENT - 1);
+	}
 
-		Superblock sb;
-		memcpy(sb.magic, this->_magic, 8);
-		sb.flags = this->_flags;
-		sb.version = this->_version;
-		sb.timestamp = util::getMillisecondTimestamp();
+	// the start of a database file; the sections come after it, one after another (aligned).
+	struct Header
+	{
+		Superblock superblock;
+		SectionTable table;
+		SectionEntry sections[NUM_SECTIONS];
+	};
 
-		currentDatabaseVersion = this->_version;
+	static_assert(sizeof(Header) == HEADER_SIZE);
 
-		buf.write(&sb, sizeof(Superblock));
+	// the sections are filled in as they get written.
+	static Header make_header(const Database& db, uint64_t timestamp)
+	{
+		Header hdr;
+		memset(&hdr, 0, sizeof(Header));
+
+		memcpy(hdr.superblock.magic, DB_MAGIC, 8);
+		hdr.superblock.version = db.version();
+		hdr.superblock.flags = 0;
+		hdr.superblock.timestamp = timestamp;
+
+		hdr.table.count = NUM_SECTIONS;
+		hdr.table.flags = 0;
 
-		wr.write(this->twitchData);
-		wr.write(this->interpState);
-		wr.write(this->markovData);
-		wr.write(this->sharedData);
-		wr.write(this->discordData);
-		wr.write(this->ircData);
-		wr.write(this->messageData);
+		for(size_t i = 0; i < NUM_SECTIONS; i++)
+			hdr.sections[i].id = (uint32_t) Sections[i].id;
+
+		return hdr;
 	}
 
-	std::optional<Database> Database::deserialise(Span& buf)
+	void Database::serialise(Buffer& buf) const
 	{
-		auto rd = serialise::Reader(buf);
-		auto sb = buf.as<Superblock>();
+		auto interp = Buffer(512);
+		this->interpState.serialise(interp);
 
-		if(buf.size() < sizeof(Superblock))
-			return error("database truncated (not enough bytes!)");
+		currentDatabaseVersion = this->_version;
+		auto hdr = make_header(*this, util::getMillisecondTimestamp());
 
-		if(strncmp(sb->magic, DB_MAGIC, 8) != 0)
-			return error("invalid database identifier (expected '{}', got '{}')", DB_MAGIC, zpr::p(8)(sb->magic));
+		// the offsets in the table are from the start of the file, ie. this buffer. the header goes in last, once
+		// we know where everything is (so this doesn't work with streaming buffers; sync does its own thing).
+		auto wr = serialise::Writer(buf);
+		auto base = buf.size();
 
-		if(sb->version > DB_VERSION)
-			return error("invalid version {} (expected <= {})", sb->version, DB_VERSION);
+		static const uint8_t padding[SECTION_ALIGNMENT] = { };
+		wr.bytes(padding, HEADER_SIZE);
 
-		auto t = timer();
-		double times[7] = { };
+		for(size_t i = 0; i < NUM_SECTIONS; i++)
+		{
+			auto& sec = hdr.sections[i];
 
-		Database db;
-		memcpy(db._magic, sb->magic, 8);
-		db._flags = sb->flags;
-		db._version = sb->version;
-		db._timestamp = sb->timestamp;
+			sec.offset = align_section(buf.size() - base);
+			wr.bytes(padding, base + sec.offset - buf.size());
 
-		buf.remove_prefix(sizeof(Superblock));
+			Sections[i].write(*this, interp, buf);
 
-		currentDatabaseVersion = db._version;
-		if(currentDatabaseVersion < DB_VERSION)
-			lg::log("db", "upgrading database from version {} to {}", currentDatabaseVersion, DB_VERSION);
+			sec.size = buf.size() - base - sec.offset;
+			sec.checksum = checksum(buf.data() + base + sec.offset, sec.size);
+		}
+
+		memcpy(buf.data() + base, &hdr, sizeof(Header));
+	}
+
+	// before version 33, the database was just all the parts one after another.
+	static bool read_sequential(Database& db, Span& buf)
+	{
+		auto rd = serialise::Reader(buf);
+
+		auto t = timer();
+		double times[7] = { };
 
 		if(!rd.read(&db.twitchData))
-			return error("failed to read twitch data");
+			return lg::error_b("db", "failed to read twitch data");
 
 		times[0] = t.reset();
 		if(!rd.read(&db.interpState))
-			return error("failed to read command interpreter state");
+			return lg::error_b("db", "failed to read command interpreter state");
 
 		times[1] = t.reset();
 		if(!rd.read(&db.markovData))
-			return error("failed to read markov data");
+			return lg::error_b("db", "failed to read markov data");
 
 		times[2] = t.reset();
 		if(!rd.read(&db.sharedData))
-			return error("failed to read shared data");
+			return lg::error_b("db", "failed to read shared data");
 
 		times[3] = t.reset();
 		if(!rd.read(&db.discordData))
-			return error("failed to read discord data");
+			return lg::error_b("db", "failed to read discord data");
 
 		times[4] = t.reset();
-		if(currentDatabaseVersion >= 25 && !rd.read(&db.ircData))
-			return error("failed to read irc data");
+		if(getVersion() >= 25 && !rd.read(&db.ircData))
+			return lg::error_b("db", "failed to read irc data");
 
 		times[5] = t.reset();
 		if(!rd.read(&db.messageData))
-			return error("failed to read message logs");
+			return lg::error_b("db", "failed to read message logs");
 
 		times[6] = t.reset();
 
+		lg::log("db", "db loads (ms): [ {.2f}, {.2f}, {.2f}, {.2f}, {.2f}, {.2f}, {.2f} ]",
+			times[0], times[1], times[2], times[3], times[4], times[5], times[6]);
+
+		return true;
+	}
+
+	// finds the sections in the table, in the same order as Sections.
+	static bool read_section_table(const Span& file, std::array<SectionEntry, NUM_SECTIONS>& sections)
+	{
+		auto buf = file.drop(sizeof(Superblock));
+		if(buf.size() < sizeof(SectionTable))
+			return lg::error_b("db", "database truncated (no section table)");
+
+		SectionTable table;
+		memcpy(&table, buf.data(), sizeof(SectionTable));
+		buf.remove_prefix(sizeof(SectionTable));
+
+		if(buf.size() / sizeof(SectionEntry) < table.count)
+			return lg::error_b("db", "database truncated (section table has {} entries, but only {} fit)", table.count,
+				buf.size() / sizeof(SectionEntry));
+
+		bool found[NUM_SECTIONS] = { };
+		for(uint32_t i = 0; i < table.count; i++)
+		{
+			SectionEntry entry;
+			memcpy(&entry, buf.data() + i * sizeof(SectionEntry), sizeof(SectionEntry));
+
+			auto it = std::find_if(std::begin(Sections), std::end(Sections), [&](auto& s) {
+				return (uint32_t) s.id == entry.id;
+			});
+
+			if(it == std::end(Sections))
+			{
+				lg::warn("db", "ignoring unknown section (id {})", entry.id);
+				continue;
+			}
+
+			auto idx = (size_t) (it - std::begin(Sections));
+			if(found[idx])
+				return lg::error_b("db", "duplicate '{}' section", it->name);
+
+			if(entry.offset > file.size() || entry.size > file.size() - entry.offset)
+				return lg::error_b("db", "section '{}' is out of bounds (offset {}, size {}, file is {} bytes)",
+					it->name, entry.offset, entry.size, file.size());
+
+			found[idx] = true;
+			sections[idx] = entry;
+		}
+
+		for(size_t i = 0; i < NUM_SECTIONS; i++)
+		{
+			if(found[i])
+				continue;
+
+			if(getVersion() >= Sections[i].since)
+				return lg::error_b("db", "missing '{}' section", Sections[i].name);
+
+			// an empty one, which read_sections skips.
+			sections[i] = SectionEntry { (uint32_t) Sections[i].id, 0, 0, 0, 0 };
+		}
+
+		return true;
+	}
+
+	static bool read_sections(Database& db, const Span& file)
+	{
+		std::array<SectionEntry, NUM_SECTIONS> sections;
+		if(!read_section_table(file, sections))
+			return false;
+
+		struct Job
+		{
+			const SectionInfo* section = nullptr;
+			SectionEntry entry;
+			double time = 0;
+		};
+
+		std::array<Job, NUM_SECTIONS> jobs;
+		for(size_t i = 0; i < NUM_SECTIONS; i++)
+			jobs[i] = Job { &Sections[i], sections[i] };
+
+		// start the biggest ones first, so the small ones can fill in around them.
+		Job* order[NUM_SECTIONS];
+		for(size_t i = 0; i < NUM_SECTIONS; i++)
+			order[i] = &jobs[i];
+
+		std::sort(std::begin(order), std::end(order), [](auto a, auto b) { return a->entry.size > b->entry.size; });
+
+		std::vector<future<bool>> results;
+		for(auto job : order)
+		{
+			if(job->entry.offset == 0)
+				continue;
+
+			results.push_back(dispatcher().run([&db, &file, job]() -> bool {
+				auto t = timer();
+				auto name = job->section->name;
+				auto span = file.drop(job->entry.offset).take(job->entry.size);
+
+				if(checksum(span.data(), span.size()) != job->entry.checksum)
+					return lg::error_b("db", "section '{}' is corrupted (checksum mismatch)", name);
+
+				if(!job->section->read(db, span))
+					return lg::error_b("db", "failed to read section '{}'", name);
+
+				job->time = t.measure();
+				return true;
+			}));
+		}
+
+		bool ok = true;
+		for(auto& r : results)
+			ok &= r.get();
+
+		if(!ok)
+			return false;
+
+		lg::log("db", "db loads (ms): {}", zfu::listToString(jobs, [](const Job& job) -> std::string {
+			return zpr::sprint("{}: {.2f}", job.section->name, job.time);
+		}));
+
+		// the next sync can copy the sections that don't change from here -- unless it's an older format.
+		if(getVersion() == DB_VERSION)
+		{
+			diskSections = sections;
+			haveDiskSections = true;
+		}
+
+		return true;
+	}
+
+	std::optional<Database> Database::deserialise(Span& buf)
+	{
+		auto sb = buf.as<Superblock>();
+
+		if(buf.size() < sizeof(Superblock))
+			return error("database truncated (not enough bytes!)");
+
+		if(strncmp(sb->magic, DB_MAGIC, 8) != 0)
+			return error("invalid database identifier (expected '{}', got '{}')", DB_MAGIC, zpr::p(8)(sb->magic));
+
+		if(sb->version > DB_VERSION)
+			return error("invalid version {} (expected <= {})", sb->version, DB_VERSION);
+
+		Database db;
+		memcpy(db._magic, sb->magic, 8);
+		db._flags = sb->flags;
+		db._version = sb->version;
+		db._timestamp = sb->timestamp;
+
+		currentDatabaseVersion = db._version;
+		if(currentDatabaseVersion < DB_VERSION)
+			lg::log("db", "upgrading database from version {} to {}", currentDatabaseVersion, DB_VERSION);
+
+		if(currentDatabaseVersion >= 33)
+		{
+			if(!read_sections(db, buf))
+				return { };
+		}
+		else
+		{
+			buf.remove_prefix(sizeof(Superblock));
+			if(!read_sequential(db, buf))
+				return { };
+		}
+
 		// once we are done reading the database from disk, the in-memory state is considered gospel.
 		// thus, we can "upgrade" the version.
 		db._version = DB_VERSION;
 
-		lg::log("db", "db loads (ms): [ {.2f}, {.2f}, {.2f}, {.2f}, {.2f}, {.2f}, {.2f} ]",
-			times[0], times[1], times[2], times[3], times[4], times[5], times[6]);
-
 		return db;
 	}
 
 
-	void Database::sync() const
+	static int write_all(int fd, const uint8_t* data, size_t len, uint64_t offset)
+	{
+		while(len > 0)
+		{
+			auto ret = pwrite(fd, data, len, (off_t) offset);
+			if(ret <= 0)
+				return (ret < 0 ? errno : EIO);
+
+			data += ret;
+			len -= ret;
+			offset += ret;
+		}
+
+		return 0;
+	}
+
+	static int copy_range(int from, uint64_t fromOffset, int to, uint64_t toOffset, size_t len)
+	{
+		auto in = (loff_t) fromOffset;
+		auto out = (loff_t) toOffset;
+
+		while(len > 0)
+		{
+			auto ret = copy_file_range(from, &in, to, &out, len, 0);
+			if(ret > 0)
+			{
+				len -= ret;
+				continue;
+			}
+
+			if(ret == 0)
+				return EIO;
+
+			// not supported (old kernel, different filesystems, etc.), so copy it ourselves.
+			if(errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+				return errno;
+
+			auto buf = std::make_unique<uint8_t[]>(1024 * 1024);
+			while(len > 0)
+			{
+				auto n = pread(from, buf.get(), std::min(len, (size_t) 1024 * 1024), in);
+				if(n <= 0)
+					return (n < 0 ? errno : EIO);
+
+				if(auto err = write_all(to, buf.get(), n, out); err != 0)
+					return err;
+
+				in += n;
+				out += n;
+				len -= n;
+			}
+		}
+
+		return 0;
+	}
+
+	// a file, where we also need the checksum of everything that went into it.
+	struct SectionStream : FileStream
+	{
+		explicit SectionStream(int fd) : FileStream(fd) { }
+
+		virtual bool write(const struct iovec* iov, int count) override
+		{
+			for(int i = 0; i < count; i++)
+				this->sum.update((const uint8_t*) iov[i].iov_base, iov[i].iov_len);
+
+			return FileStream::write(iov, count);
+		}
+
+		Checksum sum;
+	};
+
+	// writes the database to `path`; `dirty` is the sections to serialise (as sectionBits), and the rest are copied
+	// from `old` (see diskSections). the sections go straight to the file as they're serialised, and the header goes
+	// in last, once we know how big they were.
+	// this runs in the snapshot process (see sync), where the other threads (and any locks they were holding) are
+	// gone, so it can't log; it returns errno instead. see sync for why the rest of it is fine.
+	static int write_image(const std::fs::path& path, const std::fs::path& old, const Database& db,
+		const Buffer& interpState, uint64_t timestamp, uint32_t dirty)
+	{
+		int fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+		if(fd < 0)
+			return errno;
+
+		int oldfd = -1;
+		auto fail = [&](int err) -> int {
+			close(fd);
+			if(oldfd >= 0)
+				close(oldfd);
+
+			return err;
+		};
+
+		auto hdr = make_header(db, timestamp);
+
+		size_t offset = HEADER_SIZE;
+		for(size_t i = 0; i < NUM_SECTIONS; i++)
+		{
+			auto& sec = hdr.sections[i];
+			offset = align_section(offset);
+			sec.offset = offset;
+
+			if(dirty & sectionBit(Sections[i].id))
+			{
+				// the gaps between sections are just holes.
+				if(lseek(fd, (off_t) offset, SEEK_SET) < 0)
+					return fail(errno);
+
+				auto stream = SectionStream(fd);
+				{
+					auto buf = Buffer::streaming(&stream, SYNC_BUFFER_SIZE);
+					Sections[i].write(db, interpState, buf);
+					buf.flush();
+				}
+
+				if(stream.error != 0)
+					return fail(stream.error);
+
+				sec.size = stream.written;
+				sec.checksum = stream.sum.finish();
+			}
+			else
+			{
+				if(oldfd < 0 && (oldfd = open(old.c_str(), O_RDONLY)) < 0)
+					return fail(errno);
+
+				sec.size = diskSections[i].size;
+				sec.checksum = diskSections[i].checksum;
+
+				if(auto err = copy_range(oldfd, diskSections[i].offset, fd, sec.offset, sec.size); err != 0)
+					return fail(err);
+			}
+
+			offset += sec.size;
+		}
+
+		if(auto err = write_all(fd, (const uint8_t*) &hdr, HEADER_SIZE, 0); err != 0)
+			return fail(err);
+
+		// the file still needs to end in the right place, even if the last section was empty.
+		if(ftruncate(fd, (off_t) offset) != 0)
+			return fail(errno);
+
+		// the journal is about to be thrown away, so this needs to actually be on disk.
+		if(fsync(fd) != 0)
+			return fail(errno);
+
+		close(fd);
+		if(oldfd >= 0)
+			close(oldfd);
+
+		return 0;
+	}
+
+	void markDirty(std::initializer_list<Section> sections)
+	{
+		uint32_t bits = 0;
+		for(auto s : sections)
+			bits |= sectionBit(s);
+
+		dirtySections |= bits;
+	}
+
+	// waits for the sync process, and kills it if it takes too long. returns the same thing as write_image; `exited`
+	// is set if it actually finished.
+	static int wait_for_child(pid_t pid, bool* exited)
+	{
+		auto deadline = util::getMillisecondTimestamp() + SYNC_TIMEOUT;
+		while(true)
+		{
+			int status = 0;
+			auto ret = waitpid(pid, &status, WNOHANG);
+
+			if(ret < 0 && errno == EINTR)
+				continue;
+
+			if(ret < 0)
+				return errno;
+
+			if(ret == pid)
+			{
+				*exited = WIFEXITED(status);
+				return (*exited ? WEXITSTATUS(status) : ECHILD);
+			}
+
+			if(util::getMillisecondTimestamp() >= deadline)
+			{
+				lg::error("db", "sync process (pid {}) is still going after {} seconds, killing it", pid, SYNC_TIMEOUT / 1000);
+				kill(pid, SIGKILL);
+
+				while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+					;
+
+				return ETIMEDOUT;
+			}
+
+			util::sleep_for(5ms);
+		}
+	}
+
+	// serialising (and writing) the whole database takes a while, and nobody can log a message while we hold the
+	// lock. so instead, we fork, and the child gets a copy-on-write snapshot of the database to write out at its
+	// leisure; the lock is only held for as long as fork() takes (which is mostly copying the page tables). also,
+	// only the sections that changed are serialised; the rest are copied from the current file.
+	//
+	// the child only has the thread that forked it, so it has to be careful about what it touches, since anything
+	// that another thread was in the middle of stays that way. what it does is:
+	// - read the database. the forking thread holds every section lock (for reading), so nobody was halfway through
+	//   changing it, and the child doesn't take the locks again. the interpreter state (which has its own lock) is
+	//   serialised before we fork, for the same reason.
+	// - allocate (the serialisers and the stream buffer). glibc takes all of malloc's locks around fork() and resets
+	//   them in the child, so that's fine.
+	// - read the model, for the snapshot (see markov::beginSnapshot). that takes the model's read locks, but the
+	//   published model is never written to, so the worst case is that another thread had it locked for reading,
+	//   and taking a read lock on top of that doesn't block. the model is picked up before forking, since getting
+	//   the published one (an atomic shared_ptr load) can take a lock.
+	// - system calls, and nothing else. it doesn't log (the logger has a lock), and returns errno instead.
+	// if that ever stops being true and the child gets stuck, the parent kills it after SYNC_TIMEOUT, and the sync
+	// fails (so it gets tried again later).
+	void sync()
 	{
 		if(readOnly)
 			return;
 
+		// the journal can only do one checkpoint at a time.
+		auto lk = std::unique_lock(syncLock);
 		auto t = timer();
 
-		auto buf = Buffer(512);
-		this->serialise(buf);
+		// the model is a separate file, but the child writes that too.
+		bool snapshot = markov::beginSnapshot();
+
+		// the interpreter state has its own lock, which the child can't take (someone else might be holding it
+		// when we fork). it's small, so just do it here.
+		auto interp = Buffer(512);
+		DbInterpState().serialise(interp);
 
-		// make the new one
 		std::fs::path newdb = databasePath;
 		newdb.concat(".new");
 
-		int fd = open(newdb.string().c_str(), O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-		if(fd < 0)
-		{
-			error("failed to open for writing! error: {}", strerror(errno));
-			return;
-		}
+		auto timestamp = util::getMillisecondTimestamp();
 
-		size_t todo = buf.size();
-		while(todo > 0)
+		int err = 0;
+		pid_t pid = -1;
+		uint32_t dirty = 0;
+		size_t journalled = 0;
+		double locked = 0;
 		{
-			auto ret = write(fd, buf.data(), todo);
-			if(ret <= 0)
+			auto t = timer();
+
+			// everything is locked (for reading) here, so that nothing is halfway through a change when we fork.
+			auto lk = __detail::SectionLock(ALL_SECTIONS, /* exclusive: */ false);
+			auto& db = TheDatabase;
+
+			// this is a checkpoint as far as the journal is concerned; the journal gets restarted once the new
+			// database is in place, keeping only what came in after this (since it won't be in this one). so, the
+			// sections that the journal changed need to be written too.
+			journalled = journal::size();
+			dirty = dirtySections.exchange(0) | journal::beginCheckpoint(db);
+
+			if(!haveDiskSections)
+				dirty = ALL_SECTIONS;
+
+			currentDatabaseVersion = db.version();
+
+			pid = fork();
+			if(pid == 0)
 			{
-				error("failed to sync! write error: {}", strerror(errno));
-				close(fd);
-				return;
+				auto ret = write_image(newdb, databasePath, db, interp, timestamp, dirty);
+				if(snapshot)
+					markov::writeSnapshot();
+
+				_exit(ret);
+			}
+			else if(pid < 0)
+			{
+				// probably out of memory; do it the slow way.
+				lg::warn("db", "failed to fork ({}), syncing with the database locked", strerror(errno));
+				err = write_image(newdb, databasePath, db, interp, timestamp, dirty);
 			}
 
-			todo -= ret;
+			locked = t.measure();
 		}
 
-		close(fd);
+		if(snapshot)
+		{
+			if(pid < 0)
+				markov::writeSnapshot();
 
-		std::error_code ec;
-		std::fs::rename(newdb, databasePath, ec);
-		if(ec)
+			markov::releaseSnapshot();
+		}
+
+		bool exited = (pid < 0);
+		if(pid > 0)
+			err = wait_for_child(pid, &exited);
+
+		if(snapshot)
+			markov::finishSnapshot(exited);
+
+		if(err != 0)
+			error("failed to sync! write error: {}", strerror(err));
+
+		bool ok = journal::finishCheckpoint(err == 0, timestamp, dirty, [&newdb]() -> bool {
+			std::error_code ec;
+			std::fs::rename(newdb, databasePath, ec);
+			if(ec)
+				return lg::error_b("db", "failed to sync! error: {}", ec.message());
+
+			return true;
+		});
+
+		if(!ok)
 		{
-			error("failed to sync! error: {}", ec.message());
+			// try again next time.
+			dirtySections |= dirty;
 			return;
 		}
 
-		lg::log("db", "sync in {.2f} ms", t.measure());
+		// the next sync copies from this one, so we need to know where everything went.
+		{
+			auto [ fd, buf, len ] = util::mmapEntireFile(databasePath.string());
+			haveDiskSections = (buf != nullptr && read_section_table(Span(buf, len), diskSections));
+
+			if(buf != nullptr)
+				util::munmapEntireFile(fd, buf, len);
+		}
+
+		std::vector<const char*> written;
+		for(auto& sec : Sections)
+		{
+			if(dirty & sectionBit(sec.id))
+				written.push_back(sec.name);
+		}
+
+		lastCheckpoint = util::getMillisecondTimestamp();
+		lg::log("db", "sync in {.2f} ms ({.2f} ms locked, folded {.1f} KB of journal, rewrote {})", t.measure(), locked,
+			(double) journalled / 1024.0, written.empty() ? "nothing" : zfu::listToString(written, [](auto s) {
+				return std::string(s);
+			}));
 	}
 }
 
-namespace ikura
+namespace ikura::db::__detail
 {
-	Synchronised<db::Database>& database()
+	Database& get()
+	{
+		return TheDatabase;
+	}
+
+	uint32_t sectionBits(std::initializer_list<Section> sections)
+	{
+		uint32_t ret = 0;
+		for(auto s : sections)
+			ret |= sectionBit(s);
+
+		return ret;
+	}
+
+	// always in the order of the ids, so that two threads that want overlapping sections
+	// can't each be holding one that the other is waiting for.
+	void lock(uint32_t sections, bool exclusive)
+	{
+		for(uint32_t i = 1; i <= NUM_SECTIONS; i++)
+		{
+			if(!(sections & (1u << i)))
+				continue;
+
+			if(exclusive)   sectionLocks[i].lock();
+			else            sectionLocks[i].lock_shared();
+		}
+	}
+
+	void unlock(uint32_t sections, bool exclusive)
 	{
-		return db::TheDatabase;
+		for(uint32_t i = NUM_SECTIONS; i >= 1; i--)
+		{
+			if(!(sections & (1u << i)))
+				continue;
+
+			if(exclusive)   sectionLocks[i].unlock();
+			else            sectionLocks[i].unlock_shared();
+		}
 	}
 }
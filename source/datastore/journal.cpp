@@ -0,0 +1,839 @@
+// journal.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <filesystem>
+
+#include "db.h"
+#include "timer.h"
+#include "synchro.h"
+#include "serialise.h"
+
+namespace std { namespace fs = filesystem; }
+
+// every chat message gets logged, so if the logs were part of the normal database, it would be dirty all the time,
+// and we'd end up rewriting the whole thing every sync (which gets slow, once the logs are a few gigabytes). so
+// the logs (and the user updates that come with every message) are appended to a journal instead, which lives next
+// to the database. records are collected in memory as they come in, and written out together every so often (or
+// when there's enough of them); only the checkpoints (ie. db::sync) rewrite the database, after which the
+// journal starts over.
+//
+// even then, the message contents (Section::Messages) and the search index are only written when the message log
+// compresses a block (see log_contents); the rest of the contents are carried over from one journal to the next,
+// so they can be put back when loading. the search index catches up on its own (see SearchIndex::catchUp).
+//
+// the journal has a header with the timestamp of the database it applies to; if that doesn't match, it's stale --
+// everything in it is already in the database. records keep going into the journal while a checkpoint is being
+// written; once it's done, the ones that came in after it started are copied to a new journal (journal.new), which
+// replaces the old one. the new journal is ready before the new database is put in place, so if we crash after that
+// but before the journal is replaced, the one to use is journal.new. each record is its size and a checksum (of the
+// payload), followed by the payload: a kind, then the serialised fields. when loading, we stop at the first record
+// that's cut off or broken, since that's where we crashed while writing.
+namespace ikura::db::journal
+{
+	struct JournalHeader
+	{
+		char magic[8];          // "ikura_jn"
+		uint32_t version;       // see JOURNAL_VERSION
+		uint32_t flags;         // there are none defined
+		uint64_t base;          // the timestamp of the database that this journal applies to
+	};
+
+	struct RecordHeader
+	{
+		uint32_t size;
+		uint32_t checksum;
+	};
+
+	static_assert(sizeof(JournalHeader) == 24);
+	static_assert(sizeof(RecordHeader) == 8);
+
+	constexpr uint32_t JOURNAL_VERSION          = 2;
+	constexpr const char* JOURNAL_MAGIC         = "ikura_jn";
+
+	// records that haven't been written are lost if we crash, so don't wait too long.
+	constexpr auto FLUSH_INTERVAL               = std::chrono::seconds(1);
+
+	// if this much piles up before then, write it out right away.
+	constexpr size_t FLUSH_THRESHOLD            = 1024 * 1024;
+	constexpr size_t PENDING_CAPACITY           = 64 * 1024;
+
+	constexpr uint8_t KIND_TWITCH_MESSAGE       = 1;
+	constexpr uint8_t KIND_DISCORD_MESSAGE      = 2;
+	constexpr uint8_t KIND_IRC_MESSAGE          = 3;
+	constexpr uint8_t KIND_TWITCH_USER          = 4;
+	constexpr uint8_t KIND_DISCORD_USER         = 5;
+	constexpr uint8_t KIND_IRC_USER             = 6;
+
+	// just the contents of a message (and where they go in the message log), for the ones that are in the database
+	// but not its message log (see finishCheckpoint). since version 2.
+	constexpr uint8_t KIND_MESSAGE_CONTENTS     = 7;
+
+	static struct {
+		// protects `pending`, `held`, and `checkpointing`; taken when appending (with the database locked).
+		std::mutex lock;
+		Buffer pending = Buffer(PENDING_CAPACITY);
+		bool checkpointing = false;
+
+		// the records from before the checkpoint started (which are in it), so we know where the ones that
+		// aren't in it start (see checkpointStart).
+		Buffer held = Buffer(PENDING_CAPACITY);
+
+		// the sections of the database that the records in the journal changed (as sectionBits).
+		uint32_t sections = 0;
+
+		// protects the file; taken when writing to it (without the database locked).
+		std::mutex fileLock;
+		std::string path;
+		int fd = -1;
+		std::atomic<size_t> size = 0;
+
+		// during a checkpoint, where the records that came after it started begin in the file, once we know.
+		std::optional<size_t> checkpointStart;
+
+		// how much of the message log is in the database on disk, and how much there was when the checkpoint
+		// started (which is how much it'll have, if the checkpoint writes the message log).
+		size_t messagesOnDisk = 0;
+		size_t checkpointMessages = 0;
+
+		// how many bytes of KIND_MESSAGE_CONTENTS records are in the journal. those aren't anything new, so they
+		// don't count towards the size.
+		size_t carried = 0;
+
+		std::atomic<bool> enabled = false;
+		condvar<bool> wakeup;
+	} Journal;
+
+	static uint32_t sections_of(uint8_t kind)
+	{
+		switch(kind)
+		{
+			// the message log and the search index get marked separately, see log_contents.
+			case KIND_TWITCH_MESSAGE:   return sectionBit(Section::Twitch);
+			case KIND_DISCORD_MESSAGE:  return sectionBit(Section::Discord);
+			case KIND_IRC_MESSAGE:      return sectionBit(Section::Irc);
+			case KIND_TWITCH_USER:      return sectionBit(Section::Twitch);
+			case KIND_DISCORD_USER:     return sectionBit(Section::Discord);
+			case KIND_IRC_USER:         return sectionBit(Section::Irc);
+			default:                    return 0;
+		}
+	}
+
+	static uint32_t checksum(const uint8_t* data, size_t len)
+	{
+		// fnv-1a; it only needs to catch torn writes.
+		uint32_t h = 0x811C9DC5;
+		for(size_t i = 0; i < len; i++)
+			h = (h ^ data[i]) * 0x01000193;
+
+		return h;
+	}
+
+	static bool write_all(int fd, const uint8_t* data, size_t len)
+	{
+		while(len > 0)
+		{
+			auto ret = ::write(fd, data, len);
+			if(ret <= 0)
+				return lg::error_b("db", "failed to write journal: {}", strerror(errno));
+
+			data += ret;
+			len -= ret;
+		}
+
+		return true;
+	}
+
+	// the caller needs the file lock.
+	static void write_pending(Buffer& buf)
+	{
+		if(buf.size() == 0)
+			return;
+
+		if(write_all(Journal.fd, buf.data(), buf.size()))
+		{
+			fdatasync(Journal.fd);
+			Journal.size += buf.size();
+		}
+		else
+		{
+			// don't leave half a write behind, or everything after it would be unreadable (and we'd lose track
+			// of where the records are).
+			if(ftruncate(Journal.fd, Journal.size) != 0)
+				lg::error("db", "failed to truncate journal: {}", strerror(errno));
+		}
+
+		buf.clear();
+	}
+
+	// the caller needs the file lock.
+	static void flush_locked()
+	{
+		auto held = Buffer(PENDING_CAPACITY);
+		auto buf = Buffer(PENDING_CAPACITY);
+		bool checkpointing = false;
+
+		{
+			auto lk = std::unique_lock(Journal.lock);
+			std::swap(held, Journal.held);
+			std::swap(buf, Journal.pending);
+			checkpointing = Journal.checkpointing;
+		}
+
+		// the records that are part of the checkpoint go first, then the ones that aren't.
+		write_pending(held);
+
+		if(checkpointing && !Journal.checkpointStart.has_value())
+			Journal.checkpointStart = Journal.size.load();
+
+		write_pending(buf);
+	}
+
+	static void flush()
+	{
+		auto lk = std::unique_lock(Journal.fileLock);
+		flush_locked();
+	}
+
+	// adds a record to the end of `buf`; `fn` writes the fields.
+	template <typename Functor>
+	static void write_record(Buffer& buf, uint8_t kind, Functor&& fn)
+	{
+		// write the header after, once we know the size.
+		auto start = buf.size();
+		auto hdr = RecordHeader { };
+
+		while(buf.remaining() < sizeof(RecordHeader))
+			buf.grow();
+
+		buf.write(&hdr, sizeof(RecordHeader));
+
+		auto wr = serialise::Writer(buf);
+		wr.tag(kind);
+		fn(wr);
+
+		hdr.size = (uint32_t) (buf.size() - start - sizeof(RecordHeader));
+		hdr.checksum = checksum(buf.data() + start + sizeof(RecordHeader), hdr.size);
+		memcpy(buf.data() + start, &hdr, sizeof(RecordHeader));
+	}
+
+	template <typename Functor>
+	static void append(uint8_t kind, Functor&& fn)
+	{
+		if(!Journal.enabled)
+			return;
+
+		bool full = false;
+		{
+			auto lk = std::unique_lock(Journal.lock);
+			write_record(Journal.pending, kind, fn);
+
+			full = Journal.pending.size() >= FLUSH_THRESHOLD;
+			Journal.sections |= sections_of(kind);
+		}
+
+		if(full)
+			Journal.wakeup.set(true);
+	}
+
+
+
+
+
+	// once a block of the message log is compressed, it won't change anymore, so that's when it gets written
+	// out (along with the search index, so that it doesn't fall too far behind).
+	static ikura::relative_str log_contents(Database& db, ikura::str_view contents)
+	{
+		auto compactions = db.messageData.compactions();
+		auto ret = db.messageData.logMessageContents(contents);
+
+		if(db.messageData.compactions() != compactions)
+			markDirty({ Section::Messages, Section::Search });
+
+		return ret;
+	}
+
+	// when replaying, the search index is left alone; it's caught up after everything is loaded (since it might
+	// be missing messages from before the journal as well, and it has to be updated in order).
+	static void apply_message(Database& db, twitch::TwitchMessage msg, ikura::str_view contents, bool index)
+	{
+		msg.message = log_contents(db, contents);
+		db.twitchData.messageLog.add(msg);
+
+		if(index)
+			db.searchData.twitch.add((uint32_t) (db.twitchData.messageLog.size() - 1), contents);
+	}
+
+	static void apply_message(Database& db, discord::DiscordMessage msg, ikura::str_view contents, bool index)
+	{
+		msg.message = log_contents(db, contents);
+		db.discordData.messageLog.add(msg);
+
+		if(index)
+			db.searchData.discord.add((uint32_t) (db.discordData.messageLog.size() - 1), contents);
+	}
+
+	static void apply_message(Database& db, irc::db::IRCMessage msg, ikura::str_view contents, bool index)
+	{
+		msg.message = log_contents(db, contents);
+		db.ircData.messageLog.add(msg);
+
+		if(index)
+			db.searchData.irc.add((uint32_t) (db.ircData.messageLog.size() - 1), contents);
+	}
+
+	static void apply_user(Database& db, ikura::str_view channel, const twitch::TwitchUser& user)
+	{
+		auto& tchan = db.twitchData.channels[channel];
+
+		tchan.knownUsers[user.id] = user;
+		tchan.usernameMapping[user.username] = user.id;
+	}
+
+	static void apply_user(Database& db, discord::Snowflake guildId, const discord::DiscordUser& user)
+	{
+		auto& guild = db.discordData.guilds[guildId];
+		auto& existing = guild.knownUsers[user.id];
+
+		if(!existing.username.empty() && existing.username != user.username)
+			guild.usernameMap.erase(existing.username);
+
+		if(!existing.nickname.empty() && existing.nickname != user.nickname)
+			guild.nicknameMap.erase(existing.nickname);
+
+		existing = user;
+		guild.usernameMap[user.username] = user.id;
+		guild.nicknameMap[user.nickname] = user.id;
+	}
+
+	static void apply_user(Database& db, ikura::str_view server, ikura::str_view channel, const irc::db::IRCUser& user)
+	{
+		auto serv = db.ircData.getServer(server);
+		if(!serv)
+		{
+			lg::warn("db", "journal: unknown irc server '{}'", server);
+			return;
+		}
+
+		auto chan = serv->getChannel(channel);
+		if(!chan)
+		{
+			lg::warn("db", "journal: unknown irc channel '{}' in server '{}'", channel, server);
+			return;
+		}
+
+		chan->knownUsers[user.username] = user;
+		chan->nicknameMapping[user.nickname] = user.username;
+	}
+
+	void logMessage(Database& db, twitch::TwitchMessage msg, ikura::str_view contents)
+	{
+		append(KIND_TWITCH_MESSAGE, [&](auto& wr) { wr.write(contents); wr.write(msg); });
+		apply_message(db, std::move(msg), contents, /* index: */ true);
+	}
+
+	void logMessage(Database& db, discord::DiscordMessage msg, ikura::str_view contents)
+	{
+		append(KIND_DISCORD_MESSAGE, [&](auto& wr) { wr.write(contents); wr.write(msg); });
+		apply_message(db, std::move(msg), contents, /* index: */ true);
+	}
+
+	void logMessage(Database& db, irc::db::IRCMessage msg, ikura::str_view contents)
+	{
+		append(KIND_IRC_MESSAGE, [&](auto& wr) { wr.write(contents); wr.write(msg); });
+		apply_message(db, std::move(msg), contents, /* index: */ true);
+	}
+
+	void updateUser(Database& db, ikura::str_view channel, const twitch::TwitchUser& user)
+	{
+		append(KIND_TWITCH_USER, [&](auto& wr) { wr.write(channel); wr.write(user); });
+		apply_user(db, channel, user);
+	}
+
+	void updateUser(Database& db, discord::Snowflake guild, const discord::DiscordUser& user)
+	{
+		append(KIND_DISCORD_USER, [&](auto& wr) { wr.write(guild); wr.write(user); });
+		apply_user(db, guild, user);
+	}
+
+	void updateUser(Database& db, ikura::str_view server, ikura::str_view channel, const irc::db::IRCUser& user)
+	{
+		append(KIND_IRC_USER, [&](auto& wr) { wr.write(server); wr.write(channel); wr.write(user); });
+		apply_user(db, server, channel, user);
+	}
+
+
+
+
+	template <typename T>
+	static bool replay_message(Database& db, serialise::Reader& rd)
+	{
+		std::string contents;
+		T msg;
+
+		if(!rd.read(&contents) || !rd.read(&msg))
+			return false;
+
+		apply_message(db, std::move(msg), contents, /* index: */ false);
+		return true;
+	}
+
+	static bool replay(Database& db, Span span)
+	{
+		auto rd = serialise::Reader(span);
+		switch(rd.tag())
+		{
+			case KIND_TWITCH_MESSAGE:   return replay_message<twitch::TwitchMessage>(db, rd);
+			case KIND_DISCORD_MESSAGE:  return replay_message<discord::DiscordMessage>(db, rd);
+			case KIND_IRC_MESSAGE:      return replay_message<irc::db::IRCMessage>(db, rd);
+
+			case KIND_MESSAGE_CONTENTS: {
+				auto offset = rd.read<uint64_t>();
+				auto contents = rd.read<ikura::str_view>();
+				if(!offset || !contents)
+					return false;
+
+				// the messages in the database point at these, so they have to go exactly where they were.
+				if(offset.value() != db.messageData.size())
+				{
+					return lg::error_b("db", "journal: message contents are for offset {}, but the message log ends at {}",
+						offset.value(), db.messageData.size());
+				}
+
+				log_contents(db, contents.value());
+				Journal.carried += span.size() + sizeof(RecordHeader);
+				return true;
+			}
+
+			case KIND_TWITCH_USER: {
+				std::string channel;
+				twitch::TwitchUser user;
+				if(!rd.read(&channel) || !rd.read(&user))
+					return false;
+
+				apply_user(db, channel, user);
+				return true;
+			}
+
+			case KIND_DISCORD_USER: {
+				discord::Snowflake guild;
+				discord::DiscordUser user;
+				if(!rd.read(&guild) || !rd.read(&user))
+					return false;
+
+				apply_user(db, guild, user);
+				return true;
+			}
+
+			case KIND_IRC_USER: {
+				std::string server;
+				std::string channel;
+				irc::db::IRCUser user;
+				if(!rd.read(&server) || !rd.read(&channel) || !rd.read(&user))
+					return false;
+
+				apply_user(db, server, channel, user);
+				return true;
+			}
+
+			default:
+				return false;
+		}
+	}
+
+	// copies `len` bytes at `offset` in `from` to the end of `to`.
+	static bool copy_records(int from, size_t offset, int to, size_t len)
+	{
+		auto chunk = std::min(len, (size_t) 1024 * 1024);
+		auto buf = std::make_unique<uint8_t[]>(chunk);
+
+		while(len > 0)
+		{
+			auto n = pread(from, buf.get(), std::min(len, chunk), offset);
+			if(n <= 0)
+				return lg::error_b("db", "failed to read journal: {}", n < 0 ? strerror(errno) : "unexpected end of file");
+
+			if(!write_all(to, buf.get(), n))
+				return false;
+
+			offset += n;
+			len -= n;
+		}
+
+		return true;
+	}
+
+	static bool is_message(uint8_t kind)
+	{
+		return kind == KIND_TWITCH_MESSAGE || kind == KIND_DISCORD_MESSAGE || kind == KIND_IRC_MESSAGE;
+	}
+
+	// writes the contents of every message in the current journal before `end` to `fd`, as KIND_MESSAGE_CONTENTS
+	// records, and returns how many bytes that was (or nothing, if it failed). the caller needs the file lock.
+	static std::optional<size_t> carry_contents(int fd, size_t end)
+	{
+		if(end <= sizeof(JournalHeader))
+			return 0;
+
+		auto map = (const uint8_t*) mmap(nullptr, end, PROT_READ, MAP_SHARED, Journal.fd, 0);
+		if(map == MAP_FAILED)
+			return lg::error_o("db", "failed to read journal: {}", strerror(errno));
+
+		auto buf = Buffer(PENDING_CAPACITY);
+		auto offset = Journal.messagesOnDisk;
+
+		size_t total = 0;
+		bool ok = true;
+
+		// these were all written (or checked, when we replayed them) by us, so the records are fine.
+		for(size_t ofs = sizeof(JournalHeader); ok && ofs + sizeof(RecordHeader) <= end; )
+		{
+			RecordHeader rec;
+			memcpy(&rec, map + ofs, sizeof(RecordHeader));
+
+			auto span = Span(map + ofs + sizeof(RecordHeader), std::min((size_t) rec.size, end - ofs - sizeof(RecordHeader)));
+			ofs += sizeof(RecordHeader) + rec.size;
+
+			auto rd = serialise::Reader(span);
+			auto kind = rd.tag();
+
+			if(kind == KIND_MESSAGE_CONTENTS)   rd.read<uint64_t>();
+			else if(!is_message(kind))          continue;
+
+			// the contents come first in all of them.
+			auto contents = rd.read<ikura::str_view>();
+			if(!contents)
+			{
+				ok = lg::error_b("db", "journal record at offset {} is broken", ofs - sizeof(RecordHeader) - rec.size);
+				break;
+			}
+
+			write_record(buf, KIND_MESSAGE_CONTENTS, [&](auto& wr) {
+				wr.write((uint64_t) offset);
+				wr.write(contents.value());
+			});
+
+			offset += contents->size();
+
+			if(buf.size() >= FLUSH_THRESHOLD)
+			{
+				ok = write_all(fd, buf.data(), buf.size());
+				total += buf.size();
+				buf.clear();
+			}
+		}
+
+		if(ok && buf.size() > 0)
+			ok = write_all(fd, buf.data(), buf.size()), total += buf.size();
+
+		munmap((void*) map, end);
+
+		if(!ok)
+			return { };
+
+		return total;
+	}
+
+	// makes a journal for the database with the given timestamp at `path`, starting with the records in the current
+	// journal from `start` onwards (if any), and returns the fd. if `carry` is set, the contents of the messages
+	// before `start` go first (see carry_contents), and `carried` is how many bytes that was. the caller needs the
+	// file lock.
+	static int create_journal(const std::string& path, uint64_t base, size_t start, bool carry, size_t* carried)
+	{
+		// if the last checkpoint couldn't rename its journal, we're still appending to this one, so don't truncate it.
+		unlink(path.c_str());
+
+		int fd = ::open(path.c_str(), O_RDWR | O_TRUNC | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+		if(fd < 0)
+		{
+			lg::error("db", "failed to create journal: {}", strerror(errno));
+			return -1;
+		}
+
+		JournalHeader hdr;
+		memcpy(hdr.magic, JOURNAL_MAGIC, 8);
+		hdr.version = JOURNAL_VERSION;
+		hdr.flags = 0;
+		hdr.base = base;
+
+		bool ok = write_all(fd, (const uint8_t*) &hdr, sizeof(JournalHeader));
+		if(ok && carry)
+		{
+			auto n = carry_contents(fd, start);
+			if((ok = n.has_value()))
+				*carried = n.value();
+		}
+
+		if(ok && start < Journal.size)
+			ok = copy_records(Journal.fd, start, fd, Journal.size - start);
+
+		if(ok && fsync(fd) == 0)
+			return fd;
+
+		close(fd);
+		unlink(path.c_str());
+		return -1;
+	}
+
+	// returns the offset of the end of the last good record, or 0 if the journal doesn't belong to `db`.
+	static size_t replay_journal(const std::string& path, Database& db)
+	{
+		auto [ fd, buf, len ] = util::mmapEntireFile(path);
+		if(buf == nullptr)
+			return 0;
+
+		auto t = timer();
+		auto hdr = (const JournalHeader*) buf;
+
+		if(len < sizeof(JournalHeader) || strncmp(hdr->magic, JOURNAL_MAGIC, 8) != 0 || hdr->version > JOURNAL_VERSION)
+		{
+			lg::warn("db", "ignoring invalid journal");
+			util::munmapEntireFile(fd, buf, len);
+			return 0;
+		}
+
+		if(hdr->base != db.timestamp())
+		{
+			lg::log("db", "journal is from an older checkpoint, ignoring it");
+			util::munmapEntireFile(fd, buf, len);
+			return 0;
+		}
+
+		size_t records = 0;
+		size_t offset = sizeof(JournalHeader);
+		while(offset + sizeof(RecordHeader) <= len)
+		{
+			RecordHeader rec;
+			memcpy(&rec, buf + offset, sizeof(RecordHeader));
+
+			auto data = buf + offset + sizeof(RecordHeader);
+			if(offset + sizeof(RecordHeader) + rec.size > len || checksum(data, rec.size) != rec.checksum)
+				break;
+
+			if(!replay(db, Span(data, rec.size)))
+			{
+				lg::error("db", "failed to replay journal record at offset {}", offset);
+				break;
+			}
+
+			// the first byte is the kind.
+			Journal.sections |= sections_of(data[0]);
+
+			offset += sizeof(RecordHeader) + rec.size;
+			records++;
+		}
+
+		if(offset < len)
+			lg::warn("db", "journal was cut off (discarded {} bytes)", len - offset);
+
+		util::munmapEntireFile(fd, buf, len);
+
+		if(records > 0)
+			lg::log("db", "replayed {} journal record{} in {.2f} ms", records, records == 1 ? "" : "s", t.measure());
+
+		return offset;
+	}
+
+	static void flusher_thread()
+	{
+		while(true)
+		{
+			Journal.wakeup.wait(true, FLUSH_INTERVAL);
+			Journal.wakeup.set_quiet(false);
+
+			flush();
+		}
+	}
+
+	// if the journal that had the contents of some messages went missing, the logs point past the end of the message
+	// log; fill in the gap, so that new messages don't end up where those ones were supposed to be. the filler goes in
+	// the journal as well (if it's open), so it's still there the next time.
+	static void fill_missing(Database& db)
+	{
+		size_t end = 0;
+		for(auto log : { &db.twitchData.messageLog.contents, &db.discordData.messageLog.contents, &db.ircData.messageLog.contents })
+		{
+			if(!log->empty())
+				end = std::max(end, log->back().end_excl());
+		}
+
+		if(end <= db.messageData.size())
+			return;
+
+		lg::warn("db", "{} bytes of messages are missing from the journal", end - db.messageData.size());
+
+		auto offset = db.messageData.size();
+		auto filler = std::string(end - offset, ' ');
+
+		log_contents(db, filler);
+		append(KIND_MESSAGE_CONTENTS, [&](auto& wr) {
+			wr.write((uint64_t) offset);
+			wr.write(filler);
+		});
+	}
+
+	bool open(const std::string& path, Database& db, bool readonly)
+	{
+		Journal.path = path;
+		Journal.messagesOnDisk = db.messageData.size();
+
+		size_t good = 0;
+		if(std::fs::exists(path))
+			good = replay_journal(path, db);
+
+		// if we crashed after the last checkpoint put the new database in place, but before it replaced the
+		// journal, then the right one is still off to the side. otherwise, it's from a checkpoint that didn't
+		// finish, and we don't need it.
+		auto next = path + ".new";
+		if(std::fs::exists(next))
+		{
+			if(good == 0 && (good = replay_journal(next, db)) > 0)
+			{
+				lg::log("db", "using the journal from the last checkpoint");
+				if(!readonly)
+				{
+					std::error_code ec;
+					std::fs::rename(next, path, ec);
+					if(ec)
+						return lg::error_b("db", "failed to replace journal: {}", ec.message());
+				}
+			}
+			else if(!readonly)
+			{
+				std::error_code ec;
+				std::fs::remove(next, ec);
+			}
+		}
+
+		if(readonly)
+		{
+			fill_missing(db);
+			return true;
+		}
+
+		int fd = -1;
+		if(good > 0)
+		{
+			fd = ::open(path.c_str(), O_RDWR | O_APPEND);
+			if(fd < 0)
+				return lg::error_b("db", "failed to open journal: {}", strerror(errno));
+
+			// get rid of anything after the last good record, or we'd be appending after garbage.
+			if(ftruncate(fd, good) != 0)
+				return lg::error_b("db", "failed to truncate journal: {}", strerror(errno));
+		}
+		else
+		{
+			if(fd = create_journal(next, db.timestamp(), 0, /* carry: */ false, nullptr); fd < 0)
+				return false;
+
+			std::error_code ec;
+			std::fs::rename(next, path, ec);
+			if(ec)
+			{
+				close(fd);
+				return lg::error_b("db", "failed to create journal: {}", ec.message());
+			}
+
+			good = sizeof(JournalHeader);
+		}
+
+		Journal.fd = fd;
+		Journal.size = good;
+		Journal.enabled = true;
+		fill_missing(db);
+
+		auto thr = std::thread(flusher_thread);
+		thr.detach();
+
+		return true;
+	}
+
+	size_t size()
+	{
+		if(!Journal.enabled)
+			return 0;
+
+		auto lk = std::unique_lock(Journal.lock);
+		return Journal.size - sizeof(JournalHeader) - Journal.carried + Journal.pending.size();
+	}
+
+	uint32_t beginCheckpoint(const Database& db)
+	{
+		if(!Journal.enabled)
+			return 0;
+
+		// the database is locked here, so don't touch the file; the flusher writes these out.
+		uint32_t sections = 0;
+		{
+			auto lk = std::unique_lock(Journal.lock);
+			std::swap(Journal.held, Journal.pending);
+			std::swap(sections, Journal.sections);
+			Journal.checkpointing = true;
+			Journal.checkpointMessages = db.messageData.size();
+		}
+
+		Journal.wakeup.set(true);
+		return sections;
+	}
+
+	bool finishCheckpoint(bool success, uint64_t timestamp, uint32_t written, const std::function<bool ()>& install)
+	{
+		if(!Journal.enabled)
+			return success && install();
+
+		// nothing gets written while we hold this, so the new journal can't miss anything.
+		auto lk = std::unique_lock(Journal.fileLock);
+		flush_locked();
+
+		auto start = Journal.checkpointStart.value_or(Journal.size);
+		Journal.checkpointStart.reset();
+
+		{
+			auto lk = std::unique_lock(Journal.lock);
+			Journal.checkpointing = false;
+		}
+
+		if(!success)
+			return false;
+
+		// the new journal has to be ready before the new database is in place. if we can't make it, then the
+		// checkpoint fails, and we keep the old database (which the old journal still goes with). if the checkpoint
+		// didn't write the message log, then the new journal needs whatever the database doesn't have.
+		bool carry = !(written & sectionBit(Section::Messages));
+		size_t carried = 0;
+
+		auto next = Journal.path + ".new";
+		int fd = create_journal(next, timestamp, start, carry, &carried);
+		if(fd < 0)
+			return lg::error_b("db", "failed to restart journal");
+
+		if(!install())
+		{
+			close(fd);
+			unlink(next.c_str());
+			return false;
+		}
+
+		// if this fails, the new journal is still the right one (see open), so keep using it.
+		std::error_code ec;
+		std::fs::rename(next, Journal.path, ec);
+		if(ec)
+			lg::error("db", "failed to replace journal: {}", ec.message());
+
+		close(Journal.fd);
+		Journal.fd = fd;
+		Journal.size = sizeof(JournalHeader) + carried + (Journal.size - start);
+		Journal.carried = carried;
+
+		if(!carry)
+			Journal.messagesOnDisk = Journal.checkpointMessages;
+
+		return true;
+	}
+}
@@ -0,0 +1,59 @@
+// msgindex.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "defs.h"
+
+namespace ikura
+{
+	void MessageIndex::add(uint64_t channel, uint64_t user, uint64_t timestamp)
+	{
+		auto row = (uint32_t) this->count++;
+
+		auto& chan = this->channels[channel];
+		chan.rows.push_back(row);
+		chan.users[user].push_back(row);
+
+		this->newest = std::max(this->newest, timestamp);
+		if(this->count % CHECKPOINT == 0)
+			this->checkpoints.push_back(this->newest);
+	}
+
+	ikura::span<uint32_t> MessageIndex::byChannel(uint64_t channel) const
+	{
+		if(auto it = this->channels.find(channel); it != this->channels.end())
+			return it->second.rows;
+
+		return { };
+	}
+
+	ikura::span<uint32_t> MessageIndex::byUser(uint64_t channel, uint64_t user) const
+	{
+		auto it = this->channels.find(channel);
+		if(it == this->channels.end())
+			return { };
+
+		if(auto u = it->second.users.find(user); u != it->second.users.end())
+			return u->second;
+
+		return { };
+	}
+
+	size_t MessageIndex::firstSince(const std::vector<uint64_t>& timestamps, uint64_t ts) const
+	{
+		// the checkpoints only ever go up, so we can binary search them to find the chunk where
+		// the timestamps first reach `ts`, then look through that chunk.
+		auto it = std::lower_bound(this->checkpoints.begin(), this->checkpoints.end(), ts);
+
+		auto i = (size_t) (it - this->checkpoints.begin()) * CHECKPOINT;
+		auto end = std::min(i + CHECKPOINT, std::min(this->count, timestamps.size()));
+
+		for(; i < end; i++)
+		{
+			if(timestamps[i] >= ts)
+				return i;
+		}
+
+		return end;
+	}
+}
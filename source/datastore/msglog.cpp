@@ -3,14 +3,158 @@
 // Licensed under the Apache License Version 2.0.
 
 #include "db.h"
+#include "timer.h"
 #include "serialise.h"
 
 namespace ikura::db
 {
+	static size_t frame_size(size_t block_size, size_t frame)
+	{
+		return std::min(MessageDB::FRAME_SIZE, block_size - frame * MessageDB::FRAME_SIZE);
+	}
+
+	static size_t num_frames(size_t block_size)
+	{
+		return (block_size + MessageDB::FRAME_SIZE - 1) / MessageDB::FRAME_SIZE;
+	}
+
+	const MessageDB::Block* MessageDB::findBlock(size_t offset) const
+	{
+		if(this->blocks.empty())
+			return nullptr;
+
+		// almost everyone wants something recent, so try the last block first.
+		if(offset >= this->blocks.back().start)
+			return &this->blocks.back();
+
+		auto it = std::upper_bound(this->blocks.begin(), this->blocks.end(), offset,
+			[](size_t ofs, const Block& b) -> bool { return ofs < b.start; });
+
+		return &*(it - 1);
+	}
+
+	ikura::str_view MessageDB::Cursor::get(ikura::relative_str str)
+	{
+		auto blk = this->db.findBlock(str.start());
+
+		// messages never span blocks.
+		if(blk == nullptr || str.end_excl() > blk->start + blk->size)
+			return "";
+
+		auto ofs = str.start() - blk->start;
+		if(blk->packed == nullptr)
+			return ikura::str_view(blk->data + ofs, str.size());
+
+		// but they can span frames.
+		auto first = ofs / FRAME_SIZE;
+		auto last = std::max(first + 1, num_frames(ofs + str.size()));
+
+		if(blk != this->block || first < this->firstFrame || last > this->lastFrame)
+		{
+			this->block = nullptr;
+			this->buffer.resize((last - first) * FRAME_SIZE);
+
+			size_t out = 0;
+			for(size_t i = first; i < last; i++)
+			{
+				auto len = frame_size(blk->size, i);
+				auto src = blk->packed + blk->frames[i];
+				auto srclen = blk->frames[i + 1] - blk->frames[i];
+				auto dst = (uint8_t*) &this->buffer[out];
+
+				if(srclen == len)
+				{
+					memcpy(dst, src, len);
+				}
+				else if(!lz::decompress(src, srclen, dst, len))
+				{
+					lg::error("db", "message log is corrupted (block at {}, frame {})", blk->start, i);
+					return "";
+				}
+
+				out += len;
+			}
+
+			this->block = blk;
+			this->firstFrame = first;
+			this->lastFrame = last;
+		}
+
+		return ikura::str_view(this->buffer.data() + (ofs - this->firstFrame * FRAME_SIZE), str.size());
+	}
+
+	void MessageDB::compress(Block& blk)
+	{
+		auto nframes = num_frames(blk.size);
+		auto src = (const uint8_t*) blk.data;
+
+		std::vector<uint8_t> out;
+		out.reserve(blk.size / 4);
+
+		auto tmp = std::make_unique<uint8_t[]>(FRAME_SIZE);
+
+		blk.frames.clear();
+		blk.frames.push_back(0);
+
+		for(size_t i = 0; i < nframes; i++)
+		{
+			auto len = frame_size(blk.size, i);
+			auto frame = src + i * FRAME_SIZE;
+
+			// it has to be smaller, otherwise there's no point (and we wouldn't be able to tell).
+			if(auto n = lz::compress(frame, len, tmp.get(), len - 1); n > 0)
+				out.insert(out.end(), tmp.get(), tmp.get() + n);
+			else
+				out.insert(out.end(), frame, frame + len);
+
+			blk.frames.push_back(out.size());
+		}
+
+		auto packed = std::unique_ptr<uint8_t[]>(new uint8_t[out.size()]);
+		memcpy(packed.get(), out.data(), out.size());
+
+		blk.capacity = 0;
+		blk.data = nullptr;
+		blk.packed = packed.get();
+		blk.owned = std::move(packed);
+	}
+
+	size_t MessageDB::packedSize() const
+	{
+		size_t ret = 0;
+		for(auto& blk : this->blocks)
+			ret += (blk.packed ? blk.frames.back() : blk.size);
+
+		return ret;
+	}
+
 	ikura::relative_str MessageDB::logMessageContents(ikura::str_view contents)
 	{
-		auto idx = this->rawData.size();
-		this->rawData.append(contents.data(), contents.size());
+		if(this->blocks.empty() || this->blocks.back().size + contents.size() > this->blocks.back().capacity)
+		{
+			// the old one is left alone (even if it has space left), so that nothing gets moved. this happens
+			// every few thousand messages, and compressing it takes a couple of milliseconds.
+			if(!this->blocks.empty() && this->blocks.back().capacity > 0)
+			{
+				compress(this->blocks.back());
+				this->numCompactions++;
+			}
+
+			Block blk;
+			blk.start = this->totalSize;
+			blk.capacity = std::max(BLOCK_SIZE, contents.size());
+			blk.owned = std::unique_ptr<uint8_t[]>(new uint8_t[blk.capacity]);
+			blk.data = (const char*) blk.owned.get();
+
+			this->blocks.push_back(std::move(blk));
+		}
+
+		auto& blk = this->blocks.back();
+		memcpy(blk.owned.get() + blk.size, contents.data(), contents.size());
+		blk.size += contents.size();
+
+		auto idx = this->totalSize;
+		this->totalSize += contents.size();
 
 		return ikura::relative_str(idx, contents.size());
 	}
@@ -20,19 +164,164 @@ namespace ikura::db
 		auto wr = serialise::Writer(buf);
 		wr.tag(TYPE_TAG);
 
-		wr.write(this->rawData);
+		wr.write((uint64_t) this->totalSize);
+		wr.write((uint64_t) this->blocks.size());
+
+		// the compressed blocks are written as they are, so they're small on disk as well.
+		for(auto& blk : this->blocks)
+		{
+			wr.write((uint64_t) blk.size);
+			if(blk.packed == nullptr)
+			{
+				wr.write((uint64_t) 0);
+				wr.bytes(blk.data, blk.size);
+			}
+			else
+			{
+				wr.write((uint64_t) (blk.frames.size() - 1));
+				wr.bytes(blk.frames.data(), blk.frames.size() * sizeof(uint64_t));
+				wr.bytes(blk.packed, blk.frames.back());
+			}
+		}
 	}
 
-	std::optional<MessageDB> MessageDB::deserialise(Span& buf)
+	std::optional<MessageDB> MessageDB::deserialise(Span& buf, std::shared_ptr<const void> backing)
 	{
 		auto rd = serialise::Reader(buf);
 		if(auto t = rd.tag(); t != TYPE_TAG)
 			return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, TYPE_TAG);
 
+		auto take = [&buf](size_t len) -> const uint8_t* {
+			if(buf.size() < len)
+				return nullptr;
+
+			const uint8_t* ret = buf.data();
+			buf.remove_prefix(len);
+
+			return ret;
+		};
+
 		MessageDB ret;
-		if(!rd.read(&ret.rawData))
+
+		// before version 34, it was just one big string. it can't be cut into normal blocks, since we don't know
+		// where the messages are, so it's compressed into one (very) big one.
+		if(getVersion() < 34)
+		{
+			if(auto t = rd.tag(); t != serialise::TAG_STRING)
+				return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, serialise::TAG_STRING);
+
+			auto size = rd.read<uint64_t>();
+			if(!size)
+				return { };
+
+			auto data = take(size.value());
+			if(data == nullptr)
+				return lg::error_o("db", "message log truncated");
+
+			if(size.value() > 0)
+			{
+				auto t = timer();
+
+				Block blk;
+				blk.size = size.value();
+				blk.data = (const char*) data;
+				compress(blk);
+
+				ret.totalSize = blk.size;
+				ret.blocks.push_back(std::move(blk));
+
+				lg::log("db", "compressed message logs ({.1f} MB -> {.1f} MB) in {.2f} ms", ret.size() / 1048576.0,
+					ret.packedSize() / 1048576.0, t.measure());
+			}
+
+			return ret;
+		}
+
+		auto total = rd.read<uint64_t>();
+		auto count = rd.read<uint64_t>();
+		if(!total || !count)
 			return { };
 
+		for(size_t i = 0; i < count.value(); i++)
+		{
+			auto size = rd.read<uint64_t>();
+			auto nframes = rd.read<uint64_t>();
+			if(!size || !nframes)
+				return { };
+
+			Block blk;
+			blk.start = ret.totalSize;
+			blk.size = size.value();
+
+			const uint8_t* data = nullptr;
+			size_t len = 0;
+
+			if(nframes.value() == 0)
+			{
+				len = blk.size;
+				if(data = take(len); data == nullptr)
+					return lg::error_o("db", "message log truncated");
+			}
+			else
+			{
+				if(nframes.value() != num_frames(blk.size))
+					return lg::error_o("db", "message log block has {} frames, expected {}", nframes.value(), num_frames(blk.size));
+
+				auto table = take((nframes.value() + 1) * sizeof(uint64_t));
+				if(table == nullptr)
+					return lg::error_o("db", "message log truncated");
+
+				blk.frames.resize(nframes.value() + 1);
+				memcpy(blk.frames.data(), table, blk.frames.size() * sizeof(uint64_t));
+
+				// make sure the frames make sense, so Cursor doesn't have to.
+				if(blk.frames[0] != 0)
+					return lg::error_o("db", "invalid message log block");
+
+				for(size_t k = 0; k < nframes.value(); k++)
+				{
+					if(blk.frames[k + 1] < blk.frames[k] || blk.frames[k + 1] - blk.frames[k] > frame_size(blk.size, k))
+						return lg::error_o("db", "invalid message log block");
+				}
+
+				len = blk.frames.back();
+				if(data = take(len); data == nullptr)
+					return lg::error_o("db", "message log truncated");
+			}
+
+			if(backing == nullptr)
+			{
+				blk.owned = std::unique_ptr<uint8_t[]>(new uint8_t[std::max(len, (size_t) 1)]);
+				memcpy(blk.owned.get(), data, len);
+				data = blk.owned.get();
+			}
+
+			if(nframes.value() == 0)    blk.data = (const char*) data;
+			else                        blk.packed = data;
+
+			ret.totalSize += blk.size;
+			ret.blocks.push_back(std::move(blk));
+		}
+
+		if(ret.totalSize != total.value())
+			return lg::error_o("db", "message log size mismatch (expected {}, found {})", total.value(), ret.totalSize);
+
+		// the last block is usually not full; keep appending to it (instead of starting another one), otherwise
+		// we'd end up with a bunch of small uncompressed blocks after a few restarts.
+		if(!ret.blocks.empty() && ret.blocks.back().packed == nullptr && ret.blocks.back().size < BLOCK_SIZE)
+		{
+			auto& blk = ret.blocks.back();
+			auto tail = std::unique_ptr<uint8_t[]>(new uint8_t[BLOCK_SIZE]);
+			memcpy(tail.get(), blk.data, blk.size);
+
+			blk.capacity = BLOCK_SIZE;
+			blk.data = (const char*) tail.get();
+			blk.owned = std::move(tail);
+		}
+
+		if(backing != nullptr)
+			ret.backing = std::move(backing);
+
 		return ret;
 	}
 }
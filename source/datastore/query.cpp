@@ -0,0 +1,331 @@
+// query.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "db.h"
+
+namespace ikura::db::query
+{
+	// the bits of a message log that we need, so the queries don't have to care which backend it is.
+	struct Rows
+	{
+		Backend backend = Backend::Invalid;
+		ikura::span<uint32_t> rows;
+
+		// if this is set, `rows` is empty, and we want all of them (ie. every channel).
+		bool everything = false;
+
+		const MessageIndex* index = nullptr;
+		const SearchIndex::Log* words = nullptr;
+		const std::vector<uint64_t>* timestamps = nullptr;
+		const std::vector<ikura::relative_str>* contents = nullptr;
+		const std::vector<uint8_t>* flags = nullptr;
+
+		// rows with these flags aren't really messages (commands, edits).
+		uint8_t skip = 0;
+	};
+
+	static Section section_for(const Channel* chan)
+	{
+		switch(chan->getBackend())
+		{
+			case Backend::Twitch:   return Section::Twitch;
+			case Backend::Discord:  return Section::Discord;
+			case Backend::IRC:      return Section::Irc;
+			default:                return Section::Messages;
+		}
+	}
+
+	static Rows all_rows(const Database& db, Backend backend)
+	{
+		Rows ret;
+		ret.backend = backend;
+		ret.everything = true;
+
+		auto fill = [&ret](const auto& log, const SearchIndex::Log& words, uint8_t skip) {
+			ret.index = &log.index;
+			ret.words = &words;
+			ret.timestamps = &log.timestamps;
+			ret.contents = &log.contents;
+			ret.flags = &log.flags;
+			ret.skip = skip;
+		};
+
+		if(backend == Backend::Twitch)
+		{
+			fill(db.twitchData.messageLog, db.searchData.twitch, twitch::TwitchMessageLog::FLAG_COMMAND);
+		}
+		else if(backend == Backend::Discord)
+		{
+			fill(db.discordData.messageLog, db.searchData.discord,
+				discord::DiscordMessageLog::FLAG_COMMAND | discord::DiscordMessageLog::FLAG_EDIT);
+		}
+		else if(backend == Backend::IRC)
+		{
+			fill(db.ircData.messageLog, db.searchData.irc, irc::db::IRCMessageLog::FLAG_COMMAND);
+		}
+
+		return ret;
+	}
+
+	// the messages in `chan`, or only the ones by `user` if it's not empty.
+	static Rows find_rows(const Database& db, const Channel* chan, ikura::str_view user)
+	{
+		Rows ret = all_rows(db, chan->getBackend());
+		ret.everything = false;
+
+		auto lookup = [&](const MessageIndex& index, uint64_t channel, const StringTable& strings, ikura::str_view name) {
+			if(user.empty())
+			{
+				ret.rows = index.byChannel(channel);
+			}
+			else if(auto id = strings.find(name); id.has_value())
+			{
+				ret.rows = index.byUser(channel, id.value());
+			}
+		};
+
+		if(auto tc = dynamic_cast<const twitch::Channel*>(chan); tc != nullptr)
+		{
+			auto& log = db.twitchData.messageLog;
+			if(auto chan_id = log.strings.find(tc->getName()); chan_id.has_value())
+				lookup(log.index, chan_id.value(), log.strings, util::lowercase(user));
+		}
+		else if(auto dc = dynamic_cast<const discord::Channel*>(chan); dc != nullptr)
+		{
+			auto& log = db.discordData.messageLog;
+			lookup(log.index, dc->getChannelId().value, log.strings, user);
+		}
+		else if(auto ic = dynamic_cast<const irc::Channel*>(chan); ic != nullptr)
+		{
+			auto& log = db.ircData.messageLog;
+
+			auto srv_id = log.strings.find(ic->getServer()->name);
+			auto chan_id = log.strings.find(ic->getName());
+			if(srv_id.has_value() && chan_id.has_value())
+				lookup(log.index, irc::db::IRCMessageLog::channelKey(srv_id.value(), chan_id.value()), log.strings, user);
+		}
+
+		return ret;
+	}
+
+	// who said it, and where.
+	static std::pair<std::string, std::string> describe(const Database& db, Backend backend, uint32_t row)
+	{
+		if(backend == Backend::Twitch)
+		{
+			auto& log = db.twitchData.messageLog;
+			return { log.strings.get(log.usernames[row]).str(), zpr::sprint("#{}", log.strings.get(log.channels[row])) };
+		}
+		else if(backend == Backend::Discord)
+		{
+			auto& log = db.discordData.messageLog;
+			return { log.strings.get(log.usernames[row]).str(), zpr::sprint("{}/#{}", log.strings.get(log.guildNames[row]),
+				log.strings.get(log.channelNames[row])) };
+		}
+		else
+		{
+			auto& log = db.ircData.messageLog;
+			return { log.strings.get(log.nicknames[row]).str(), zpr::sprint("{}/{}", log.strings.get(log.servers[row]),
+				log.strings.get(log.channels[row])) };
+		}
+	}
+
+	size_t messageCount(const Channel* chan, ikura::str_view user)
+	{
+		if(chan == nullptr)
+			return 0;
+
+		return db::read({ section_for(chan) }, [&](auto& db) -> size_t {
+			return find_rows(db, chan, user).rows.size();
+		});
+	}
+
+	size_t messagesSince(const Channel* chan, uint64_t timestamp)
+	{
+		if(chan == nullptr)
+			return 0;
+
+		return db::read({ section_for(chan) }, [&](auto& db) -> size_t {
+			auto r = find_rows(db, chan, "");
+			if(r.index == nullptr)
+				return 0;
+
+			// the channel's rows are in order, so skip the ones that can't be new enough. the few that are left
+			// (since messages aren't always logged in order) still need to be checked.
+			auto first = r.index->firstSince(*r.timestamps, timestamp);
+			auto it = std::lower_bound(r.rows.begin(), r.rows.end(), (uint32_t) first);
+
+			return (size_t) std::count_if(it, r.rows.end(), [&](uint32_t row) -> bool {
+				return (*r.timestamps)[row] >= timestamp;
+			});
+		});
+	}
+
+	std::optional<uint64_t> lastSeen(const Channel* chan, ikura::str_view user)
+	{
+		if(chan == nullptr)
+			return { };
+
+		return db::read({ section_for(chan) }, [&](auto& db) -> std::optional<uint64_t> {
+			auto r = find_rows(db, chan, user);
+			if(r.rows.empty())
+				return { };
+
+			return (*r.timestamps)[r.rows.back()];
+		});
+	}
+
+	std::optional<std::string> randomMessage(const Channel* chan, ikura::str_view user)
+	{
+		if(chan == nullptr)
+			return { };
+
+		return db::read({ section_for(chan), Section::Messages }, [&](auto& db) -> std::optional<std::string> {
+			auto r = find_rows(db, chan, user);
+			if(r.rows.empty())
+				return { };
+
+			// most things people say aren't commands, so a few tries is usually enough.
+			for(int tries = 0; tries < 8; tries++)
+			{
+				auto row = r.rows[random::get<size_t>(0, r.rows.size() - 1)];
+				if((*r.flags)[row] & r.skip)
+					continue;
+
+				auto cur = MessageDB::Cursor(db.messageData);
+				return cur.get((*r.contents)[row]).str();
+			}
+
+			return { };
+		});
+	}
+
+	static bool has_phrase(const std::vector<std::string>& words, const std::vector<std::string>& phrase)
+	{
+		return std::search(words.begin(), words.end(), phrase.begin(), phrase.end()) != words.end();
+	}
+
+	static void intersect(std::vector<uint32_t>& xs, const uint32_t* begin, const uint32_t* end)
+	{
+		std::vector<uint32_t> out;
+		std::set_intersection(xs.begin(), xs.end(), begin, end, std::back_inserter(out));
+		xs = std::move(out);
+	}
+
+	// the newest rows in `r` that have all of `words` and `phrases`.
+	static std::vector<uint32_t> search_log(const Database& db, const Rows& r, const std::vector<std::string>& words,
+		const std::vector<std::vector<std::string>>& phrases, size_t limit)
+	{
+		if(r.words == nullptr || words.empty() || (!r.everything && r.rows.empty()))
+			return { };
+
+		std::vector<const SearchIndex::Postings*> postings;
+		for(auto& w : words)
+		{
+			auto p = r.words->find(w);
+			if(p == nullptr)
+				return { };
+
+			postings.push_back(p);
+		}
+
+		// start with the rarest word, so there's less to go through for the others.
+		std::sort(postings.begin(), postings.end(), [](auto a, auto b) { return a->count < b->count; });
+
+		auto rows = postings[0]->rows();
+		for(size_t i = 1; i < postings.size() && !rows.empty(); i++)
+		{
+			auto other = postings[i]->rows();
+			intersect(rows, other.data(), other.data() + other.size());
+		}
+
+		if(!r.everything)
+			intersect(rows, r.rows.begin(), r.rows.end());
+
+		std::vector<uint32_t> ret;
+		auto cur = MessageDB::Cursor(db.messageData);
+
+		for(auto it = rows.rbegin(); it != rows.rend() && ret.size() < limit; ++it)
+		{
+			auto row = *it;
+			if(row >= r.contents->size() || ((*r.flags)[row] & r.skip))
+				continue;
+
+			// the words are all there, but they might not be in the right order.
+			if(!phrases.empty())
+			{
+				auto msg_words = SearchIndex::getWords(cur.get((*r.contents)[row]));
+				if(!std::all_of(phrases.begin(), phrases.end(), [&](auto& p) { return has_phrase(msg_words, p); }))
+					continue;
+			}
+
+			ret.push_back(row);
+		}
+
+		return ret;
+	}
+
+	std::vector<SearchResult> search(const Channel* chan, ikura::str_view query, size_t limit)
+	{
+		// the parts in quotes are phrases; the rest are just words that need to be there somewhere.
+		std::vector<std::string> words;
+		std::vector<std::vector<std::string>> phrases;
+
+		for(bool quoted = false; !query.empty(); quoted = !quoted)
+		{
+			auto k = query.find('"');
+			auto part = SearchIndex::getWords(query.take(k));
+
+			if(quoted && part.size() > 1)
+				phrases.push_back(part);
+
+			for(auto& w : part)
+			{
+				if(std::find(words.begin(), words.end(), w) == words.end())
+					words.push_back(w);
+			}
+
+			if(k == std::string::npos)
+				break;
+
+			query.remove_prefix(k + 1);
+		}
+
+		auto find = [&](const Database& db, const Rows& r, std::vector<SearchResult>& results) {
+			auto cur = MessageDB::Cursor(db.messageData);
+			for(auto row : search_log(db, r, words, phrases, limit))
+			{
+				auto [ user, where ] = describe(db, r.backend, row);
+				results.push_back(SearchResult { (*r.timestamps)[row], std::move(user), std::move(where),
+					cur.get((*r.contents)[row]).str() });
+			}
+		};
+
+		if(chan != nullptr)
+		{
+			return db::read({ section_for(chan), Section::Messages, Section::Search }, [&](auto& db) {
+				std::vector<SearchResult> ret;
+				find(db, find_rows(db, chan, ""), ret);
+
+				return ret;
+			});
+		}
+
+		auto ret = db::read({ Section::Twitch, Section::Discord, Section::Irc, Section::Messages, Section::Search },
+			[&](auto& db) {
+
+			std::vector<SearchResult> ret;
+			for(auto b : { Backend::Twitch, Backend::Discord, Backend::IRC })
+				find(db, all_rows(db, b), ret);
+
+			return ret;
+		});
+
+		std::sort(ret.begin(), ret.end(), [](auto& a, auto& b) { return a.timestamp > b.timestamp; });
+		if(ret.size() > limit)
+			ret.resize(limit);
+
+		return ret;
+	}
+}
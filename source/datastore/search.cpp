@@ -0,0 +1,214 @@
+// search.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "db.h"
+#include "timer.h"
+#include "markov.h"
+#include "serialise.h"
+
+namespace ikura::db
+{
+	// anything longer is probably a link (or spam), which nobody is going to search for.
+	constexpr size_t MAX_WORD_LENGTH = 48;
+
+	static void put_varint(std::vector<uint8_t>& out, uint32_t x)
+	{
+		while(x >= 0x80)
+		{
+			out.push_back((uint8_t) (x | 0x80));
+			x >>= 7;
+		}
+
+		out.push_back((uint8_t) x);
+	}
+
+	void SearchIndex::Postings::add(uint32_t row)
+	{
+		// a word can be in a message more than once, but we only want the message once.
+		if(this->count > 0 && row <= this->last)
+			return;
+
+		put_varint(this->data, this->count == 0 ? row : row - this->last);
+
+		this->last = row;
+		this->count++;
+	}
+
+	std::vector<uint32_t> SearchIndex::Postings::rows() const
+	{
+		std::vector<uint32_t> ret;
+		ret.reserve(this->count);
+
+		uint32_t row = 0;
+		uint32_t x = 0;
+		int shift = 0;
+
+		for(auto b : this->data)
+		{
+			x |= (uint32_t) (b & 0x7F) << shift;
+			shift += 7;
+
+			if(b & 0x80)
+				continue;
+
+			row += x;
+			ret.push_back(row);
+
+			x = 0;
+			shift = 0;
+		}
+
+		return ret;
+	}
+
+	std::vector<std::string> SearchIndex::getWords(ikura::str_view text)
+	{
+		std::vector<std::string> ret;
+		for(auto word : markov::splitWords(text))
+		{
+			if(word.empty() || word.size() > MAX_WORD_LENGTH)
+				continue;
+
+			// the punctuation that the splitter separates out is useless on its own.
+			if(std::all_of(word.begin(), word.end(), [](char c) { return c == '.' || c == ',' || c == '!' || c == '?'; }))
+				continue;
+
+			ret.push_back(util::lowercase(word));
+		}
+
+		return ret;
+	}
+
+	void SearchIndex::Log::add(uint32_t row, ikura::str_view contents)
+	{
+		for(auto& word : getWords(contents))
+			this->words[word].add(row);
+
+		this->size = std::max(this->size, row + 1);
+	}
+
+	const SearchIndex::Postings* SearchIndex::Log::find(ikura::str_view word) const
+	{
+		if(auto it = this->words.find(word); it != this->words.end())
+			return &it->second;
+
+		return nullptr;
+	}
+
+	void SearchIndex::catchUp(const Database& db)
+	{
+		auto t = timer();
+		size_t count = 0;
+
+		auto cur = MessageDB::Cursor(db.messageData);
+		auto update = [&](Log& idx, const std::vector<ikura::relative_str>& contents, const char* name) {
+			if(idx.size > contents.size())
+			{
+				lg::warn("db", "{} search index is ahead of the message log ({} > {}), rebuilding it", name,
+					idx.size, contents.size());
+				idx = Log();
+			}
+
+			for(auto i = idx.size; i < contents.size(); i++, count++)
+				idx.add(i, cur.get(contents[i]));
+		};
+
+		update(this->twitch, db.twitchData.messageLog.contents, "twitch");
+		update(this->discord, db.discordData.messageLog.contents, "discord");
+		update(this->irc, db.ircData.messageLog.contents, "irc");
+
+		if(count > 0)
+			lg::log("db", "indexed {} message{} for searching in {.2f} ms", count, count == 1 ? "" : "s", t.measure());
+	}
+
+	void SearchIndex::serialise(Buffer& buf) const
+	{
+		auto wr = serialise::Writer(buf);
+		wr.tag(TYPE_TAG);
+
+		// the postings of every word are written together at the end, since most of them are tiny.
+		for(auto log : { &this->twitch, &this->discord, &this->irc })
+		{
+			std::vector<uint8_t> all;
+
+			wr.write((uint64_t) log->size);
+			wr.write((uint64_t) log->words.size());
+			for(auto& [ word, p ] : log->words)
+			{
+				wr.write(word);
+				wr.write((uint64_t) p.count);
+				wr.write((uint64_t) p.last);
+				wr.write((uint64_t) p.data.size());
+
+				all.insert(all.end(), p.data.begin(), p.data.end());
+			}
+
+			wr.writeArray(all);
+		}
+	}
+
+	std::optional<SearchIndex> SearchIndex::deserialise(Span& buf)
+	{
+		auto rd = serialise::Reader(buf);
+		if(auto t = rd.tag(); t != TYPE_TAG)
+			return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, TYPE_TAG);
+
+		SearchIndex ret;
+		for(auto log : { &ret.twitch, &ret.discord, &ret.irc })
+		{
+			auto size = rd.read<uint64_t>();
+			auto count = rd.read<uint64_t>();
+			if(!size || !count)
+				return { };
+
+			log->size = (uint32_t) size.value();
+
+			// the words only need to live until they're put in the map, so they can point into the file.
+			struct Entry
+			{
+				ikura::str_view word;
+				uint64_t count;
+				uint64_t last;
+				uint64_t length;
+			};
+
+			std::vector<Entry> entries;
+			entries.reserve(count.value());
+
+			for(size_t i = 0; i < count.value(); i++)
+			{
+				Entry e;
+				if(!rd.read(&e.word) || !rd.read(&e.count) || !rd.read(&e.last) || !rd.read(&e.length))
+					return { };
+
+				entries.push_back(std::move(e));
+			}
+
+			std::vector<uint8_t> all;
+			if(!rd.readArray(&all))
+				return { };
+
+			size_t offset = 0;
+			log->words.reserve(entries.size());
+
+			for(auto& e : entries)
+			{
+				if(e.length > all.size() - offset || e.last >= log->size || e.count > e.length)
+					return lg::error_o("db", "search index is inconsistent");
+
+				auto& p = log->words[e.word];
+				p.count = (uint32_t) e.count;
+				p.last = (uint32_t) e.last;
+				p.data.assign(all.begin() + offset, all.begin() + offset + e.length);
+
+				offset += e.length;
+			}
+
+			if(offset != all.size())
+				return lg::error_o("db", "search index is inconsistent");
+		}
+
+		return ret;
+	}
+}
@@ -0,0 +1,63 @@
+// strtab.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "defs.h"
+#include "serialise.h"
+
+namespace ikura
+{
+	uint32_t StringTable::add(str_view s)
+	{
+		if(auto it = this->ids.find(s); it != this->ids.end())
+			return it->second;
+
+		auto id = (uint32_t) this->strings.size();
+		this->strings.emplace_back(s.str());
+		this->ids.try_emplace(s.str(), id);
+
+		return id;
+	}
+
+	std::optional<uint32_t> StringTable::find(str_view s) const
+	{
+		if(auto it = this->ids.find(s); it != this->ids.end())
+			return it->second;
+
+		return { };
+	}
+
+	void StringTable::serialise(Buffer& buf) const
+	{
+		auto wr = serialise::Writer(buf);
+		wr.tag(serialise::TAG_STRING_TABLE);
+
+		wr.write((uint64_t) this->strings.size());
+		for(auto& s : this->strings)
+			wr.write(s);
+	}
+
+	std::optional<StringTable> StringTable::deserialise(Span& buf)
+	{
+		auto rd = serialise::Reader(buf);
+		if(auto t = rd.tag(); t != serialise::TAG_STRING_TABLE)
+			return lg::error_o("db", "type tag mismatch (found '{02x}', expected '{02x}')", t, serialise::TAG_STRING_TABLE);
+
+		auto count = rd.read<uint64_t>();
+		if(!count)
+			return { };
+
+		StringTable ret;
+		for(size_t i = 0; i < count.value(); i++)
+		{
+			auto s = rd.read<std::string>();
+			if(!s)
+				return { };
+
+			ret.ids.try_emplace(s.value(), (uint32_t) i);
+			ret.strings.push_back(std::move(s.value()));
+		}
+
+		return ret;
+	}
+}
@@ -31,13 +31,13 @@ namespace ikura::twitch::bttv
 	{
 		return dispatcher().run([](bool force) {
 			auto now = util::getMillisecondTimestamp();
-			auto last = database().rlock()->twitchData.globalBttvEmotes.lastUpdatedTimestamp;
+			auto last = db::read({ db::Section::Twitch }, [](auto& db) { return db.twitchData.globalBttvEmotes.lastUpdatedTimestamp; });
 			auto interval = config::twitch::getEmoteAutoUpdateInterval();
 
 			if(!force && (interval == 0 || (now - last < interval)))
 				return;
 
-			database().wlock()->twitchData.globalBttvEmotes.lastUpdatedTimestamp = now;
+			db::write({ db::Section::Twitch }, [&](auto& db) { db.twitchData.globalBttvEmotes.lastUpdatedTimestamp = now; });
 
 			auto [ hdr, body ] = request::get(URL(zpr::sprint("{}/cached/emotes/global", BTTV_API_URL)));
 			if(auto st = hdr.statusCode(); st != 200 || body.empty())
@@ -59,7 +59,7 @@ namespace ikura::twitch::bttv
 			}
 
 			lg::log("bttv", "fetched {} global emotes", list.size());
-			database().wlock()->twitchData.globalBttvEmotes.emotes = std::move(list);
+			db::write({ db::Section::Twitch }, [&](auto& db) { db.twitchData.globalBttvEmotes.emotes = std::move(list); });
 
 		}, force);
 	}
@@ -68,7 +68,9 @@ namespace ikura::twitch::bttv
 	{
 		return dispatcher().run([](bool force, std::string chan_id, std::string chan_name) {
 			auto now = util::getMillisecondTimestamp();
-			auto last = database().rlock()->twitchData.channels.at(chan_name).bttvEmotes.lastUpdatedTimestamp;
+			auto last = db::read({ db::Section::Twitch }, [&chan_name](auto& db) {
+				return db.twitchData.channels.at(chan_name).bttvEmotes.lastUpdatedTimestamp;
+			});
 			auto interval = config::twitch::getEmoteAutoUpdateInterval();
 
 			// zpr::println("chan: {} - {}", now, last);
@@ -101,7 +103,9 @@ namespace ikura::twitch::bttv
 			}
 
 			lg::log("bttv", "fetched {} emotes for #{}", list.size(), chan_name);
-			database().wlock()->twitchData.channels[chan_name].bttvEmotes.update(std::move(list));
+			db::write({ db::Section::Twitch }, [&](auto& db) {
+				db.twitchData.channels[chan_name].bttvEmotes.update(std::move(list));
+			});
 
 		}, force, channelId, channelName);
 	}
@@ -20,7 +20,7 @@ namespace ikura::twitch
 				auto t = timer();
 
 				std::vector<std::pair<std::string, std::string>> channels;
-				database().perform_read([&](auto& db) {
+				db::read({ db::Section::Twitch }, [&](auto& db) {
 					for(const auto& [ n, ch ] : db.twitchData.channels)
 						if(!ch.id.empty())
 							channels.emplace_back(ch.id, ch.name);
@@ -64,29 +64,26 @@ namespace ikura::twitch
 		ikura::str_view x;
 		ikura::str_view xs = msg;
 
-		while(xs.size() > 0)
-		{
-			// this is very crude, but it's because
-			// (a) the emote lists are hashtables
-			// (b) we're splitting by words, not looking for character sequences
-			std::tie(x, xs) = util::bisect(xs, ' ');
-
-			bool found = database().map_read([&x, &channel](auto& db) -> bool {
-				if(db.twitchData.globalBttvEmotes.contains(x))
-					return true;
-
-				auto chan = db.twitchData.getChannel(channel);
-				assert(chan);
+		// take the lock once for the whole message, not once per word; markov retraining
+		// calls this for every logged message.
+		db::read({ db::Section::Twitch }, [&](auto& db) {
+			auto chan = db.twitchData.getChannel(channel);
+			assert(chan);
 
-				if(chan->bttvEmotes.contains(x) || chan->ffzEmotes.contains(x))
-					return true;
-
-				return false;
-			});
+			while(xs.size() > 0)
+			{
+				// this is very crude, but it's because
+				// (a) the emote lists are hashtables
+				// (b) we're splitting by words, not looking for character sequences
+				std::tie(x, xs) = util::bisect(xs, ' ');
 
-			if(found)
-				ret.push_back(x);
-		}
+				if(db.twitchData.globalBttvEmotes.contains(x)
+					|| chan->bttvEmotes.contains(x) || chan->ffzEmotes.contains(x))
+				{
+					ret.push_back(x);
+				}
+			}
+		});
 
 		return ret;
 	}
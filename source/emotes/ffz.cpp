@@ -19,7 +19,9 @@ namespace ikura::twitch::ffz
 	{
 		return dispatcher().run([](bool force, std::string chan_id, std::string chan_name) {
 			auto now = util::getMillisecondTimestamp();
-			auto last = database().rlock()->twitchData.channels.at(chan_name).ffzEmotes.lastUpdatedTimestamp;
+			auto last = db::read({ db::Section::Twitch }, [&chan_name](auto& db) {
+				return db.twitchData.channels.at(chan_name).ffzEmotes.lastUpdatedTimestamp;
+			});
 			auto interval = config::twitch::getEmoteAutoUpdateInterval();
 
 			if(!force && (interval == 0 || (now - last < interval)))
@@ -63,7 +65,9 @@ namespace ikura::twitch::ffz
 			}
 
 			lg::log("ffz", "fetched {} emotes for #{}", list.size(), chan_name);
-			database().wlock()->twitchData.channels[chan_name].ffzEmotes.update(std::move(list));
+			db::write({ db::Section::Twitch }, [&](auto& db) {
+				db.twitchData.channels[chan_name].ffzEmotes.update(std::move(list));
+			});
 
 		}, force, channelId, channelName);
 	}
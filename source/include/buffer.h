@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/uio.h>
 
 #include "types.h"
 
@@ -13,6 +14,29 @@ namespace ikura
 {
 	struct Span;
 
+	// somewhere for a streaming buffer to put its contents, instead of growing (see Buffer::streaming).
+	struct Stream
+	{
+		virtual ~Stream() { }
+
+		// writes out all of `iov`, in order; returns false if it couldn't.
+		virtual bool write(const struct iovec* iov, int count) = 0;
+	};
+
+	// streams to a file descriptor (a file or a socket), from wherever it currently is.
+	struct FileStream : Stream
+	{
+		explicit FileStream(int fd) : fd(fd) { }
+
+		virtual bool write(const struct iovec* iov, int count) override;
+
+		int fd = -1;
+
+		// the errno of the first write that failed; after that, nothing else gets written.
+		int error = 0;
+		size_t written = 0;
+	};
+
 	struct Buffer
 	{
 		Buffer() : Buffer(64) { }
@@ -50,13 +74,24 @@ namespace ikura
 		void grow(size_t sz);   // expands only by the specified amount
 		void resize(size_t sz); // changes the size to be sz. (only expands, never contracts)
 
+		// for streaming buffers, writes out everything so far (then `extra`, which doesn't need to be copied in
+		// first), and starts again from empty. returns false if the stream failed.
+		bool flush(const void* extra = nullptr, size_t extraLen = 0);
+		bool streaming() const;
+
 		static Buffer empty();
 		static Buffer fromString(const std::string& s);
 
+		// a fixed-size buffer that gets flushed to `stream` when it fills up, instead of growing; size() is then
+		// only the part that hasn't been flushed yet. things that write to buffers directly need to check for this.
+		static Buffer streaming(Stream* stream, size_t cap);
+
 	private:
 		size_t len;
 		size_t cap;
 		uint8_t* ptr;
+
+		Stream* stream = nullptr;
 	};
 
 	struct Span
@@ -126,8 +126,24 @@ namespace ikura::config
 			bool stripPings;
 			int minLength;
 			int maxRetries;
+
+			// pruning (see markov/prune.cpp). the interval is in seconds, and 0 means never (unless
+			// the model is over the memory limit, which is in megabytes; 0 means no limit).
+			uint64_t pruneInterval;
+			uint64_t decayPercent;
+			uint64_t minFrequency;
+			uint64_t maxMemory;
+
+			// repeated messages (see markov/filter.cpp). once something was seen this many times within the
+			// window (in seconds), further copies aren't trained on. 0 means no limit.
+			uint64_t duplicateWindow;
+			uint64_t duplicateThreshold;
 		};
 
 		MarkovConfig getConfig();
+
+		// the threshold for the given channel, which can be set per channel (by name); if it isn't, this is
+		// the same as duplicateThreshold.
+		uint64_t getDuplicateThreshold(ikura::str_view channel);
 	}
 }
@@ -18,24 +18,101 @@ namespace ikura
 
 	namespace db
 	{
+		// the parts of the database. they're stored as separate sections (see database.cpp), and sync only
+		// rewrites the ones that changed. these are also the ids of the sections in the file, so don't renumber them.
+		enum class Section : uint32_t
+		{
+			Twitch      = 1,
+			Interp      = 2,
+			Markov      = 3,
+			Shared      = 4,
+			Discord     = 5,
+			Irc         = 6,
+			Messages    = 7,
+			Search      = 8,
+		};
+
+		constexpr uint32_t sectionBit(Section s) { return 1u << (uint32_t) s; }
+
 		struct DbInterpState : Serialisable
 		{
 			virtual void serialise(Buffer& buf) const override;
 			static std::optional<DbInterpState> deserialise(Span& buf);
 		};
 
+		// the contents of every logged message, which the logs refer to with relative_strs (offsets into all of it).
+		// it's kept as a list of blocks that never move, so logging a message never copies the old ones; when the
+		// last block is full, a new one is started, and the full one is compressed (see msglog.cpp). to read
+		// messages, use a Cursor.
 		struct MessageDB : Serialisable
 		{
-			const std::string& data() const { return this->rawData; }
+		private:
+			struct Block;
+
+		public:
+			MessageDB() { }
+			MessageDB(MessageDB&&) = default;
+			MessageDB& operator = (MessageDB&&) = default;
+
+			// this decompresses things as needed, and keeps the last part it decompressed around, so reading
+			// messages in order (mostly) only decompresses everything once. what get returns is only valid until
+			// the next call, and the MessageDB has to stay locked while the cursor is used.
+			struct Cursor
+			{
+				Cursor(const MessageDB& db) : db(db) { }
+				ikura::str_view get(ikura::relative_str str);
+
+			private:
+				const MessageDB& db;
+				const Block* block = nullptr;
+				size_t firstFrame = 0;
+				size_t lastFrame = 0;
+				std::string buffer;
+			};
+
+			size_t size() const { return this->totalSize; }
+			size_t packedSize() const;
+
+			// how many blocks have been compressed so far; the ones before the last never change after that.
+			size_t compactions() const { return this->numCompactions; }
+
 			ikura::relative_str logMessageContents(ikura::str_view contents);
 
 			virtual void serialise(Buffer& buf) const override;
-			static std::optional<MessageDB> deserialise(Span& buf);
+
+			// if `backing` is given, `buf` must point into it; the blocks keep it alive instead of copying.
+			static std::optional<MessageDB> deserialise(Span& buf, std::shared_ptr<const void> backing = nullptr);
 
 			static constexpr uint8_t TYPE_TAG = serialise::TAG_MESSAGE_DB;
+			static constexpr size_t BLOCK_SIZE = 1024 * 1024;
+			static constexpr size_t FRAME_SIZE = 64 * 1024;
 
 		private:
-			std::string rawData;
+			struct Block
+			{
+				size_t start = 0;
+				size_t size = 0;
+				size_t capacity = 0;    // 0 if we can't append to it (it's compressed, or it came from disk)
+
+				// if the block isn't compressed, this is its contents.
+				const char* data = nullptr;
+
+				// otherwise, it's compressed in frames of FRAME_SIZE (the last one can be shorter), so one message
+				// can be read without decompressing all of it. `frames` has where each one starts in `packed`, plus
+				// the end. a frame that didn't get smaller is stored as-is.
+				const uint8_t* packed = nullptr;
+				std::vector<uint64_t> frames;
+
+				std::unique_ptr<uint8_t[]> owned;
+			};
+
+			const Block* findBlock(size_t offset) const;
+			static void compress(Block& blk);
+
+			std::vector<Block> blocks;
+			std::shared_ptr<const void> backing;
+			size_t totalSize = 0;
+			size_t numCompactions = 0;
 		};
 
 		struct GenericUser : Serialisable
@@ -91,6 +168,52 @@ namespace ikura
 			tsl::robin_map<uint64_t, std::string> groupIds;
 		};
 
+		struct Database;
+
+		// a full-text index of the message logs. words are split the same way as the markov model does it (see
+		// markov::splitWords) and lowercased; each one has the rows of the messages it appears in, oldest first,
+		// stored as varint-encoded differences (they're mostly close together, so that's usually one byte each).
+		// there's one Log for each message log. it's updated as messages are logged (so Section::Search has to be
+		// locked for that as well), and anything that's missing is indexed when the database is loaded.
+		struct SearchIndex : Serialisable
+		{
+			struct Postings
+			{
+				void add(uint32_t row);
+				std::vector<uint32_t> rows() const;
+
+				uint32_t count = 0;
+				uint32_t last = 0;
+				std::vector<uint8_t> data;
+			};
+
+			struct Log
+			{
+				void add(uint32_t row, ikura::str_view contents);
+				const Postings* find(ikura::str_view word) const;
+
+				// the rows before this (in the message log) are indexed.
+				uint32_t size = 0;
+				ikura::string_map<Postings> words;
+			};
+
+			Log twitch;
+			Log discord;
+			Log irc;
+
+			// indexes the messages that the logs have but we don't (eg. when upgrading from a database without
+			// an index, or the ones that came from the journal, since the index is only written every so often).
+			// `db` needs the message logs loaded.
+			void catchUp(const Database& db);
+
+			static std::vector<std::string> getWords(ikura::str_view text);
+
+			virtual void serialise(Buffer& buf) const override;
+			static std::optional<SearchIndex> deserialise(Span& buf);
+
+			static constexpr uint8_t TYPE_TAG = serialise::TAG_SEARCH_INDEX;
+		};
+
 		struct Database : Serialisable
 		{
 			DbInterpState interpState;
@@ -100,8 +223,7 @@ namespace ikura
 			irc::db::IrcDB ircData;
 			SharedDB sharedData;
 			MessageDB messageData;
-
-			void sync() const;
+			SearchIndex searchData;
 
 			virtual void serialise(Buffer& buf) const override;
 			static std::optional<Database> deserialise(Span& buf);
@@ -110,6 +232,9 @@ namespace ikura
 
 			uint32_t version() const { return this->_version; }
 
+			// when this was written to disk; the journal uses this to know which database it belongs to.
+			uint64_t timestamp() const { return this->_timestamp; }
+
 		private:
 			char _magic[8];
 			uint32_t _version;
@@ -119,7 +244,135 @@ namespace ikura
 
 		uint32_t getVersion();
 		bool load(ikura::str_view path, bool create, bool readonly);
+
+		// writes the database to disk. this only locks the database for a moment (see database.cpp), but it
+		// does need all of it, so don't call it from inside db::read or db::write.
+		void sync();
+
+		// marks parts of the database as changed, so the next sync rewrites them. db::write does this already.
+		void markDirty(std::initializer_list<Section> sections);
+
+		// things that change all the time (the message logs, and users as they talk) don't make the database
+		// dirty; instead, they're appended to a journal next to it, which is replayed when the database is loaded.
+		// the database is only rewritten (checkpointed) when something else changes, or when the journal gets too
+		// big. these make the change to `db` as well, so they must be called with the sections they change locked
+		// for writing -- the backend's section, plus Section::Messages and Section::Search for messages. use
+		// db::write_quiet, since the point is to not make them dirty. see journal.cpp.
+		namespace journal
+		{
+			void logMessage(Database& db, twitch::TwitchMessage msg, ikura::str_view contents);
+			void logMessage(Database& db, discord::DiscordMessage msg, ikura::str_view contents);
+			void logMessage(Database& db, irc::db::IRCMessage msg, ikura::str_view contents);
+
+			void updateUser(Database& db, ikura::str_view channel, const twitch::TwitchUser& user);
+			void updateUser(Database& db, discord::Snowflake guild, const discord::DiscordUser& user);
+			void updateUser(Database& db, ikura::str_view server, ikura::str_view channel, const irc::db::IRCUser& user);
+
+			// replays the journal on top of `db` (if it belongs to it), then opens it for appending (if !readonly).
+			bool open(const std::string& path, Database& db, bool readonly);
+
+			// how many bytes of records are in the journal (including the ones that haven't been written yet), not
+			// counting the message contents that were carried over from the last one.
+			size_t size();
+
+			// a checkpoint starts with the database locked; everything that was journalled so far is part of it,
+			// and anything after goes into the next journal as well. finishCheckpoint is called without the lock;
+			// if the checkpoint was written, it makes the next journal, then calls `install` to put the new database
+			// in place, and then replaces the journal. if any of that fails, it returns false, and we keep appending
+			// to the old one. beginCheckpoint returns the sections that the journal changed (as sectionBits), since
+			// those need to be rewritten; `written` is the ones that actually were. if that doesn't include the
+			// message log, the contents of the messages it's missing go into the next journal too.
+			uint32_t beginCheckpoint(const Database& db);
+			bool finishCheckpoint(bool success, uint64_t timestamp, uint32_t written, const std::function<bool ()>& install);
+		}
+
+		// questions about who said what, for the console and the interpreter. these use the message logs' indexes
+		// (see MessageIndex), so they don't need to walk the logs. `user` is looked up in the channel `chan` -- by
+		// username for twitch and discord (not the nickname), and by nick for irc. timestamps are in milliseconds.
+		// they lock the database themselves.
+		namespace query
+		{
+			size_t messageCount(const Channel* chan, ikura::str_view user);
+			size_t messagesSince(const Channel* chan, uint64_t timestamp);
+
+			std::optional<uint64_t> lastSeen(const Channel* chan, ikura::str_view user);
+			std::optional<std::string> randomMessage(const Channel* chan, ikura::str_view user);
+
+			struct SearchResult
+			{
+				uint64_t timestamp;
+				std::string user;
+				std::string channel;
+				std::string message;
+			};
+
+			// the newest messages (at most `limit`) that have all the words in `query` (using SearchIndex); the
+			// parts in quotes have to be there as-is. if `chan` is null, this looks in every channel.
+			std::vector<SearchResult> search(const Channel* chan, ikura::str_view query, size_t limit);
+		}
 	}
 
-	Synchronised<db::Database>& database();
+	namespace db
+	{
+		namespace __detail
+		{
+			Database& get();
+			uint32_t sectionBits(std::initializer_list<Section> sections);
+
+			void lock(uint32_t sections, bool exclusive);
+			void unlock(uint32_t sections, bool exclusive);
+
+			struct SectionLock
+			{
+				SectionLock(uint32_t sections, bool exclusive) : sections(sections), exclusive(exclusive)
+				{
+					lock(sections, exclusive);
+				}
+
+				~SectionLock() { unlock(this->sections, this->exclusive); }
+
+				SectionLock(const SectionLock&) = delete;
+				SectionLock& operator = (const SectionLock&) = delete;
+
+				uint32_t sections;
+				bool exclusive;
+			};
+		}
+
+		// each section of the database has its own lock, so that (for example) logging a discord message doesn't
+		// have to wait for a twitch emote refresh. to use the database, say which sections you need; `fn` gets
+		// the whole thing, but it must only touch those. when more than one is needed, they're always locked in
+		// the order of Section (and unlocked in the reverse), so two of these can't deadlock each other -- but
+		// don't call one from inside another, since that breaks the order.
+		template <typename Functor>
+		auto read(std::initializer_list<Section> sections, Functor&& fn) -> decltype(fn(std::declval<const Database&>()))
+		{
+			auto lk = __detail::SectionLock(__detail::sectionBits(sections), /* exclusive: */ false);
+			return fn(static_cast<const Database&>(__detail::get()));
+		}
+
+		// same as write, but doesn't mark the sections as changed -- for writes that are accounted
+		// for some other way (ie. the journal).
+		template <typename Functor>
+		auto write_quiet(std::initializer_list<Section> sections, Functor&& fn) -> decltype(fn(std::declval<Database&>()))
+		{
+			auto lk = __detail::SectionLock(__detail::sectionBits(sections), /* exclusive: */ true);
+			return fn(__detail::get());
+		}
+
+		// the sections are marked as changed after they're unlocked, so that a sync that starts in between
+		// can't miss the change.
+		template <typename Functor>
+		auto write(std::initializer_list<Section> sections, Functor&& fn) -> decltype(fn(std::declval<Database&>()))
+		{
+			struct Marker
+			{
+				std::initializer_list<Section> sections;
+				~Marker() { markDirty(this->sections); }
+			};
+
+			auto marker = Marker { sections };
+			return write_quiet(sections, std::forward<Functor>(fn));
+		}
+	}
 }
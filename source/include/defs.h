@@ -223,6 +223,14 @@ namespace ikura
 		void sha256(uint8_t out[32], const void* input, size_t length);
 	}
 
+	// a small lz4-style compressor (see lz.cpp). compress returns the compressed size, or 0 if it
+	// didn't fit in `cap` bytes; decompress needs to know exactly how big the output is.
+	namespace lz
+	{
+		size_t compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+		bool decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t outlen);
+	}
+
 	struct Emote
 	{
 		Emote() : name("") { }
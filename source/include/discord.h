@@ -304,13 +304,42 @@ namespace ikura::discord
 		static constexpr uint8_t TYPE_TAG = serialise::TAG_DISCORD_LOG_MSG;
 	};
 
+	// stored in columns, like twitch::TwitchMessageLog.
 	struct DiscordMessageLog : Serialisable
 	{
-		std::vector<DiscordMessage> messages;
+		size_t size() const { return this->timestamps.size(); }
+
+		void add(const DiscordMessage& msg);
+		DiscordMessage get(size_t i) const;
+
+		ikura::span<ikura::relative_str> getEmotePositions(size_t i) const;
+		bool isEdit(size_t i) const { return this->flags[i] & FLAG_EDIT; }
+		bool isCommand(size_t i) const { return this->flags[i] & FLAG_COMMAND; }
+
+		std::vector<uint64_t> timestamps;
+		std::vector<uint64_t> messageIds;
+		std::vector<uint64_t> userIds;
+		std::vector<uint32_t> usernames;
+		std::vector<uint32_t> nicknames;
+		std::vector<uint64_t> guildIds;
+		std::vector<uint32_t> guildNames;
+		std::vector<uint64_t> channelIds;
+		std::vector<uint32_t> channelNames;
+		std::vector<ikura::relative_str> contents;
+		std::vector<uint32_t> emoteStarts;
+		std::vector<uint8_t> flags;
+
+		std::vector<ikura::relative_str> emotePositions;
+		StringTable strings;
+
+		// by channel id and username (as an id in `strings`).
+		MessageIndex index;
 
 		virtual void serialise(Buffer& buf) const override;
 		static std::optional<DiscordMessageLog> deserialise(Span& buf);
 
+		static constexpr uint8_t FLAG_EDIT = 0x1;
+		static constexpr uint8_t FLAG_COMMAND = 0x2;
 		static constexpr uint8_t TYPE_TAG = serialise::TAG_DISCORD_LOG;
 	};
 
@@ -154,13 +154,35 @@ namespace ikura::irc
 			static constexpr uint8_t TYPE_TAG = serialise::TAG_IRC_LOG_MSG;
 		};
 
+		// stored in columns, like twitch::TwitchMessageLog.
 		struct IRCMessageLog : Serialisable
 		{
-			std::vector<IRCMessage> messages;
+			size_t size() const { return this->timestamps.size(); }
+
+			void add(const IRCMessage& msg);
+			IRCMessage get(size_t i) const;
+
+			bool isCommand(size_t i) const { return this->flags[i] & FLAG_COMMAND; }
+
+			std::vector<uint64_t> timestamps;
+			std::vector<uint32_t> nicknames;
+			std::vector<uint32_t> usernames;
+			std::vector<uint32_t> channels;
+			std::vector<uint32_t> servers;
+			std::vector<ikura::relative_str> contents;
+			std::vector<uint8_t> flags;
+
+			StringTable strings;
+
+			// by server+channel (see channelKey) and nickname.
+			MessageIndex index;
+
+			static uint64_t channelKey(uint32_t server, uint32_t channel) { return ((uint64_t) server << 32) | channel; }
 
 			virtual void serialise(Buffer& buf) const override;
 			static std::optional<IRCMessageLog> deserialise(Span& buf);
 
+			static constexpr uint8_t FLAG_COMMAND = 0x1;
 			static constexpr uint8_t TYPE_TAG = serialise::TAG_IRC_LOG;
 		};
 
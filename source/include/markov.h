@@ -24,6 +24,62 @@ namespace ikura::markov
 	void retrain();
 	double retrainingProgress();
 
-	void process(ikura::str_view input, const std::vector<ikura::relative_str>& emote_idxs);
+	// runs a pruning pass now, instead of waiting for the next one (see config::markov).
+	void prune();
+
+	// the model is stored in its own file (next to the database), which is mapped when loading. saveSnapshot
+	// only writes it if the model changed since the last time.
+	void setSnapshotPath(const std::string& path);
+	void saveSnapshot();
+
+	// for writing the snapshot in the sync process instead (see db::sync). beginSnapshot returns false if there's
+	// nothing to write; otherwise, the child calls writeSnapshot (which returns errno, since it can't log), and the
+	// parent calls releaseSnapshot as soon as it has forked (the model can't be trained while we're holding on to it),
+	// then finishSnapshot once the child is gone.
+	bool beginSnapshot();
+	int writeSnapshot();
+	void releaseSnapshot();
+	void finishSnapshot(bool exited);
+
+	// the channel is only used to look for repeated messages (see config::markov), and can be empty. the backends
+	// call this when they log a message, with the log locked (see retrain).
+	void process(ikura::str_view input, const std::vector<ikura::relative_str>& emote_idxs, ikura::str_view channel = "");
+
+	// splits a message into words the same way the model does; punctuation at the end of a word is a separate
+	// word. the search index (see db::SearchIndex) uses this too.
+	std::vector<ikura::str_view> splitWords(ikura::str_view input);
+
+	// waits until everything that was passed to process() so far has been trained (and published).
+	void flush();
 	Message generateMessage(const std::vector<std::string>& seed = { });
+
+	// same as generateMessage, but takes a message out of the pre-generated pool if there is one.
+	Message getMessage(const std::vector<std::string>& seed = { });
+
+	struct PoolStats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t refills;
+		double refillTime;      // average, in milliseconds
+
+		size_t pooled;
+		size_t classes;
+	};
+
+	PoolStats getPoolStats();
+
+	struct FilterStats
+	{
+		uint64_t checked;
+		uint64_t dropped;
+
+		// what we didn't have to train on.
+		uint64_t droppedWords;
+		uint64_t droppedBytes;
+
+		size_t channels;
+	};
+
+	FilterStats getFilterStats();
 }
@@ -0,0 +1,398 @@
+// markovmodel.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include <memory>
+
+#include "defs.h"
+#include "synchro.h"
+#include "serialise.h"
+
+// the insides of the markov model; this is only for the markov module itself, everything else
+// should be using markov.h.
+namespace ikura::markov
+{
+	constexpr size_t MAX_PREFIX_LENGTH          = 3;
+
+	constexpr size_t IDX_START_MARKER           = 0;
+	constexpr size_t IDX_END_MARKER             = 1;
+
+	constexpr uint64_t WORD_FLAG_EMOTE          = 0x1;
+	constexpr uint64_t WORD_FLAG_SENTENCE_START = 0x2;
+	constexpr uint64_t WORD_FLAG_SENTENCE_END   = 0x4;
+
+	struct Word : Serialisable
+	{
+		Word() { }
+		Word(uint64_t w, uint64_t freq) : index(w), frequency(freq) { }
+
+		uint64_t index = 0;
+		uint64_t frequency = 0;
+
+		virtual void serialise(Buffer& buf) const override;
+		static std::optional<Word> deserialise(Span& buf);
+
+		static constexpr uint8_t TYPE_TAG = serialise::TAG_MARKOV_WORD;
+	};
+
+	struct WordList : Serialisable
+	{
+		WordList() { }
+
+		uint64_t totalFrequency = 0;
+		std::vector<Word> words;
+
+		// map from the global wordlist index, to the index in the words array.
+		tsl::robin_map<uint64_t, uint64_t> globalIndexMap;
+
+		// a fenwick tree over the frequencies in `words`, so that picking a word is O(log n) instead of
+		// a linear scan (some prefixes, like the start marker, have tens of thousands of words). it's
+		// updated in place when training, so it never needs to be rebuilt -- except after loading, since
+		// it's not stored on disk.
+		std::vector<uint64_t> cumulative;
+
+		void add(uint64_t word, uint64_t freq);
+		const Word& select(uint64_t selection) const;
+		void rebuildCumulative();
+
+		virtual void serialise(Buffer& buf) const override;
+		static std::optional<WordList> deserialise(Span& buf);
+
+		static constexpr uint8_t TYPE_TAG = serialise::TAG_MARKOV_WORD_LIST;
+	};
+
+	// a snapshot file that's mapped into memory (see snapshot.cpp). the parts of the model that point
+	// into it hold one of these, so it stays mapped until the last of them goes away.
+	struct Snapshot
+	{
+		Snapshot(int fd, uint8_t* buf, size_t len) : fd(fd), buf(buf), len(len) { }
+		~Snapshot();
+
+		Snapshot(Snapshot&&) = delete;
+		Snapshot(const Snapshot&) = delete;
+		Snapshot& operator = (Snapshot&&) = delete;
+		Snapshot& operator = (const Snapshot&) = delete;
+
+		int fd;
+		uint8_t* buf;
+		size_t len;
+	};
+
+	// an array that either owns its elements, or points into a mapped snapshot (in which case whoever
+	// holds the array also needs to hold the snapshot). the elements are never modified, so copies just
+	// share the same buffer.
+	template <typename T>
+	struct FlatArray
+	{
+		using value_type = T;
+
+		FlatArray() { }
+		FlatArray(std::vector<T> xs) : owned(std::make_shared<const std::vector<T>>(std::move(xs))),
+			ptr(owned->data()), count(owned->size()) { }
+
+		FlatArray(const T* p, size_t n) : ptr(p), count(n) { }
+
+		FlatArray(const FlatArray&) = default;
+		FlatArray& operator = (const FlatArray&) = default;
+
+		FlatArray(FlatArray&& x) : owned(std::move(x.owned)), ptr(x.ptr), count(x.count) { x.ptr = nullptr; x.count = 0; }
+		FlatArray& operator = (FlatArray&& x)
+		{
+			if(this != &x)
+			{
+				this->owned = std::move(x.owned);
+				this->ptr = x.ptr;      x.ptr = nullptr;
+				this->count = x.count;  x.count = 0;
+			}
+
+			return *this;
+		}
+
+		const T& operator [] (size_t i) const { return this->ptr[i]; }
+
+		const T* data() const   { return this->ptr; }
+		size_t size() const     { return this->count; }
+		bool empty() const      { return this->count == 0; }
+
+		const T* begin() const  { return this->ptr; }
+		const T* end() const    { return this->ptr + this->count; }
+
+	private:
+		std::shared_ptr<const std::vector<T>> owned;
+		const T* ptr = nullptr;
+		size_t count = 0;
+	};
+
+	// the text of the word lives in the vocabulary's arena. this isn't Serialisable by itself, since it
+	// needs the arena; see write_vocab and read_vocab.
+	struct DBWord
+	{
+		DBWord() { }
+		DBWord(ikura::relative_str w, uint64_t f) : word(w), flags(f) { }
+
+		ikura::relative_str word;
+		uint64_t flags = 0;
+
+		static constexpr uint8_t TYPE_TAG = serialise::TAG_MARKOV_STORED_WORD;
+	};
+
+	struct Vocabulary
+	{
+		static constexpr uint32_t EMPTY_SLOT = (uint32_t) -1;
+
+		// what we look words up by. emotes and normal words are separate, even if the text is the same.
+		struct Key
+		{
+			ikura::str_view word;
+			bool emote;
+		};
+
+		// the index only stores word indices, and these look into the arena for the actual text. since
+		// they also take a Key directly, lookups don't need to make a string. the hash needs to be stable,
+		// since the snapshot has an index built with it.
+		struct KeyHash
+		{
+			using is_transparent = void;
+			const Vocabulary* vocab;
+
+			size_t operator () (const Key& k) const;
+			size_t operator () (uint32_t idx) const { return (*this)(vocab->key(idx)); }
+		};
+
+		struct KeyEqual
+		{
+			using is_transparent = void;
+			const Vocabulary* vocab;
+
+			bool operator () (uint32_t a, uint32_t b) const     { return a == b; }
+			bool operator () (const Key& a, uint32_t b) const   { return (*this)(b, a); }
+			bool operator () (uint32_t a, const Key& b) const;
+		};
+
+		Vocabulary() : wordIndices(0, KeyHash { this }, KeyEqual { this }) { }
+
+		// the index has pointers back to us, so we can't move.
+		Vocabulary(Vocabulary&&) = delete;
+		Vocabulary(const Vocabulary&) = delete;
+		Vocabulary& operator = (Vocabulary&&) = delete;
+		Vocabulary& operator = (const Vocabulary&) = delete;
+
+		// the words from the snapshot, if we loaded one. these always come first (ie. they have the lowest
+		// indices), and the index is open-addressed with linear probing, same as the frozen tables.
+		std::shared_ptr<Snapshot> snapshot;
+		FlatArray<char> baseArena;
+		FlatArray<DBWord> baseWords;
+		FlatArray<uint32_t> baseIndex;
+
+		// every word that we learnt since then, back to back (without separators).
+		std::string arena;
+
+		// we need to go from index -> word (the list) and word -> index (the set).
+		std::vector<DBWord> wordList;
+		tsl::robin_set<uint32_t, KeyHash, KeyEqual> wordIndices;
+
+		size_t size() const { return this->baseWords.size() + this->wordList.size(); }
+
+		const DBWord& get(uint64_t idx) const;
+		ikura::str_view text(uint64_t idx) const;
+		Key key(uint64_t idx) const;
+
+		std::optional<uint64_t> find(ikura::str_view word, bool emote) const;
+
+		// adds the word to the arena and the list, and to the index unless `indexed` is false.
+		uint64_t add(ikura::str_view word, uint64_t flags, bool indexed = true);
+
+		void clear();
+	};
+
+	// the bulk of the model lives here: every context in a shard, laid out flat. the successors of entry i
+	// are words[offsets[i] .. offsets[i + 1]), and `cumulative` holds the running total of their frequencies,
+	// so picking a word is just a binary search. the context index is open-addressed (linear probing) and
+	// points into the entry arrays. this is never modified in place; new training goes into the delta layer,
+	// which is folded in by compacting the shard (ie. building a new one).
+	struct FrozenTable
+	{
+		static constexpr uint32_t EMPTY_SLOT = (uint32_t) -1;
+
+		// set if the arrays point into a snapshot.
+		std::shared_ptr<Snapshot> snapshot;
+
+		// capacity is always a power of two; slotShift turns a (multiplied) hash into a slot index.
+		FlatArray<uint64_t> slotKeys;
+		FlatArray<uint32_t> slotEntries;
+		uint32_t slotShift = 64;
+
+		FlatArray<uint64_t> contexts;
+		FlatArray<uint32_t> offsets;        // one extra at the end, so entry i is always [offsets[i], offsets[i + 1])
+
+		FlatArray<uint32_t> words;
+		FlatArray<uint32_t> cumulative;
+
+		size_t size() const { return this->contexts.size(); }
+
+		std::optional<uint32_t> find(uint64_t context) const;
+		uint64_t total(uint32_t entry) const;
+
+		// returns (word, frequency) of the word at `selection`, which is in [0, total(entry)).
+		std::pair<uint32_t, uint32_t> select(uint32_t entry, uint64_t selection) const;
+	};
+
+	// for making new frozen tables; add the contexts one at a time, then call finish().
+	struct FrozenBuilder
+	{
+		std::vector<uint64_t> contexts;
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> words;
+		std::vector<uint32_t> cumulative;
+
+		// the successors are (word, frequency) pairs; note that the frequencies might get scaled down.
+		void add(uint64_t context, std::vector<std::pair<uint64_t, uint64_t>>& successors);
+		FrozenTable finish();
+	};
+
+	struct Shard
+	{
+		FrozenTable frozen;
+
+		// new training goes here, as a plain context -> wordlist mapping. a context can be in both the
+		// frozen table and the delta, in which case its successors are the union of the two.
+		tsl::robin_map<uint64_t, WordList> delta;
+
+		// number of additions to the delta since the last compaction.
+		size_t deltaSize = 0;
+
+		// how many times the shard was compacted. two copies of a shard that were trained the same way
+		// compact at the same points, so this tells us if their frozen tables are interchangeable.
+		uint64_t compactions = 0;
+	};
+
+	// the contexts (ie. the last few words) are stored as a trie of their words in reverse order, most recent
+	// word first -- so the node for (a b c) is a child of (b c), which is a child of (c). contexts that share
+	// a history share nodes, and backing off to a shorter context is just following the parent pointer.
+	// node 0 is the root (the empty context), which never has any successors.
+	struct ContextTrie
+	{
+		static constexpr uint32_t ROOT = 0;
+		static constexpr uint32_t EMPTY_SLOT = (uint32_t) -1;
+
+		ContextTrie() : parents({ ROOT }), words({ 0 }) { }
+
+		// std::hash is the identity for integers, which is terrible here (all the children of a node would
+		// have the same high bits, and all the nodes for the same word the same low bits), so mix it up.
+		struct KeyHash
+		{
+			size_t operator () (uint64_t k) const
+			{
+				k ^= k >> 33; k *= 0xFF51AFD7ED558CCDULL;
+				k ^= k >> 33; k *= 0xC4CEB9FE1A85EC53ULL;
+				return k ^ (k >> 33);
+			}
+		};
+
+		// the nodes from the snapshot, if we loaded one (including the root). the child index is a
+		// (key -> node) open-addressed table, using the same keys and hash as `children`.
+		std::shared_ptr<Snapshot> snapshot;
+		FlatArray<uint32_t> baseParents;
+		FlatArray<uint32_t> baseWords;
+		FlatArray<uint64_t> baseSlotKeys;
+		FlatArray<uint32_t> baseSlotNodes;
+
+		// (parent << 32) | word -> child. both halves are 32 bits, so the key is exact and unrelated
+		// contexts can never collide.
+		tsl::robin_map<uint64_t, uint32_t, KeyHash> children;
+
+		// indexed by node (minus the number of nodes in the snapshot).
+		std::vector<uint32_t> parents;
+		std::vector<uint32_t> words;
+
+		size_t size() const { return this->baseParents.size() + this->parents.size(); }
+
+		uint32_t parent(uint32_t node) const;
+		uint32_t word(uint32_t node) const;
+
+		std::optional<uint32_t> find(uint32_t parent, uint64_t word) const;
+		uint32_t insert(uint32_t parent, uint64_t word);
+
+		static uint64_t key(uint32_t parent, uint64_t word) { return ((uint64_t) parent << 32) | word; }
+	};
+
+	struct MarkovModel
+	{
+		static constexpr size_t NUM_SHARDS = 64;
+
+		// map from context node to list of possible output words. this is split into shards by the
+		// node id, each with its own lock. the model that generation uses is never trained directly (see
+		// markovModel), so these locks are only contended while building a model.
+		Synchronised<Shard> shards[NUM_SHARDS];
+
+		// the vocabulary and the trie are locked separately. to avoid deadlocks, never take one of these
+		// locks while holding another; when all of them are needed (eg. serialise), take the vocabulary
+		// first, then the trie, then the shards in ascending order.
+		Synchronised<Vocabulary> vocab;
+		Synchronised<ContextTrie> trie;
+
+		// set whenever the model changes, and cleared when a snapshot is written.
+		std::atomic<bool> dirty = false;
+
+		// every reset (or retrain) makes a new model with a new generation; copies of a model (see
+		// markovModel) keep the same one, since they have the same contents.
+		uint64_t generation = 0;
+
+		Synchronised<Shard>& shard(uint64_t context)
+		{
+			return this->shards[context % NUM_SHARDS];
+		}
+
+		const Synchronised<Shard>& shard(uint64_t context) const
+		{
+			return this->shards[context % NUM_SHARDS];
+		}
+	};
+
+	// the model that's currently published. training never touches it; instead, it goes into a second
+	// copy, which is swapped in when the training queue is empty (so the published one becomes the copy,
+	// and catches up on what it missed). resets and retrains build an entirely new model, and publish that
+	// once it's complete. so, hold on to the pointer for as long as you're using the model, and you'll
+	// always see the same one; the old one goes away when the last reader lets go of it.
+	std::shared_ptr<MarkovModel> markovModel();
+
+	// an empty model (with just the markers), with a new generation.
+	std::shared_ptr<MarkovModel> new_model();
+
+	// publishes `model`, which must not be used by anything else, and throws away the current one.
+	void install_model(std::shared_ptr<MarkovModel> model);
+
+	// for replacing the published model with a modified copy of itself. begin_rebuild returns the model
+	// to start from (or null, if we're retraining or another rebuild is going on), and stops publishing
+	// until finish_rebuild, which trains the new model with whatever came in since, then installs it. if
+	// the model was replaced in the meantime, the new one is thrown away. pass null to give up.
+	std::shared_ptr<MarkovModel> begin_rebuild();
+	void finish_rebuild(std::shared_ptr<MarkovModel> model);
+
+	void initialise_vocab(Vocabulary* vocab);
+
+	// merges the frozen table and the delta into a new table. the caller needs (at least) the shard's read lock.
+	FrozenTable merge_shard(const Shard& shard);
+
+	// folds the delta into the frozen table, and empties the delta. the caller needs the shard's write lock.
+	void compact_shard(Shard& shard);
+
+	// true if there's a backlog of training, or we're retraining; background work should wait.
+	bool is_busy();
+
+	// defined in pool.cpp
+	void start_pool();
+	void stop_pool();
+
+	// defined in prune.cpp
+	void start_pruner();
+	void stop_pruner();
+
+	// defined in filter.cpp; returns false if the message is a (near-)repeat that shouldn't be trained on.
+	bool filter_message(ikura::str_view input, ikura::str_view channel);
+
+	// defined in snapshot.cpp; maps the snapshot (see setSnapshotPath), and installs it as the model.
+	bool load_snapshot();
+}
@@ -49,6 +49,14 @@ namespace ikura::serialise
 	template<typename V>
 	struct is_tsl_hashmap<ikura::string_map<V>> : std::true_type { };
 
+	// vectors of these are written in one go (see Writer::writeArray), instead of one element at a time. vector<bool>
+	// doesn't count, since it's not really an array.
+	template<typename T>
+	constexpr bool is_packable_v = std::is_arithmetic_v<T> && !std::is_same_v<T, bool>;
+
+	// the layout of packed arrays (after the tag), in case it needs to change:
+	// 1: the version (as a raw byte), the count, the element size, then the elements.
+	constexpr uint8_t PACKED_ARRAY_VERSION = 1;
 
 	struct Writer
 	{
@@ -109,10 +117,9 @@ namespace ikura::serialise
 
 		void write(ikura::str_view sv)
 		{
-			ensure(8 + sv.size()); tag(TAG_STRING);
-			auto sz = sv.size(); write((uint64_t) sz);
-			for(size_t i = 0; i < sz; i++)
-				buffer.write(&sv[i], 1);
+			ensure(9); tag(TAG_STRING);
+			write((uint64_t) sv.size());
+			bytes(sv.data(), sv.size());
 		}
 
 		void write(ikura::relative_str rs)
@@ -125,10 +132,17 @@ namespace ikura::serialise
 		template <typename T>
 		void write(const std::vector<T>& vec)
 		{
-			ensure(9); tag(TAG_STL_VECTOR);
-			auto sz = vec.size(); write((uint64_t) sz);
-			for(const auto& x : vec)
-				write(x);
+			if constexpr (is_packable_v<T>)
+			{
+				writeArray(vec);
+			}
+			else
+			{
+				ensure(9); tag(TAG_STL_VECTOR);
+				auto sz = vec.size(); write((uint64_t) sz);
+				for(const auto& x : vec)
+					write(x);
+			}
 		}
 
 		template <typename K, typename V>
@@ -167,6 +181,40 @@ namespace ikura::serialise
 				write(k), write(v);
 		}
 
+		// for big arrays of plain things (eg. the columns of the message logs), which are written as-is,
+		// instead of one element at a time.
+		template <typename T>
+		void writeArray(const std::vector<T>& vec)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+
+			ensure(20); tag(TAG_PACKED_ARRAY);
+			buffer.write(&PACKED_ARRAY_VERSION, 1);
+			write((uint64_t) vec.size());
+			write((uint64_t) sizeof(T));
+
+			this->bytes(vec.data(), vec.size() * sizeof(T));
+		}
+
+		// raw bytes, without a tag (or a length); the reader needs to know how many there are.
+		void bytes(const void* data, size_t len)
+		{
+			if(this->buffer.remaining() >= len)
+			{
+				buffer.write(data, len);
+			}
+			else if(this->buffer.streaming())
+			{
+				// don't bother copying big things into the buffer, just send them along with it.
+				buffer.flush(data, len);
+			}
+			else
+			{
+				this->buffer.grow(len - this->buffer.remaining());
+				buffer.write(data, len);
+			}
+		}
+
 		template <typename T, typename = std::enable_if_t<std::is_pointer_v<T>>>
 		void write(const T x) { x->serialise(buffer); }
 
@@ -177,6 +225,10 @@ namespace ikura::serialise
 		void ensure(size_t x)
 		{
 			// account implicitly for the tag byte
+			if(this->buffer.remaining() < x + 1 && this->buffer.streaming())
+				this->buffer.flush();
+
+			// streaming buffers only get here for things that are bigger than the whole buffer.
 			while(this->buffer.remaining() < x + 1)
 				this->buffer.grow();
 		}
@@ -230,7 +282,25 @@ namespace ikura::serialise
 			else if constexpr (is_same_v<T, float>)         { if(the_tag = tag(), the_tag != TAG_F32) return { }; }
 			else if constexpr (is_same_v<T, double>)        { if(the_tag = tag(), the_tag != TAG_F64) return { }; }
 			else if constexpr (is_same_v<T, std::string>)   { if(the_tag = tag(), the_tag != TAG_STRING) return { }; }
-			else if constexpr (is_vector<T>::value)         { if(the_tag = tag(), the_tag != TAG_STL_VECTOR) return { }; }
+			else if constexpr (is_same_v<T, ikura::str_view>) { if(the_tag = tag(), the_tag != TAG_STRING) return { }; }
+			else if constexpr (is_vector<T>::value)
+			{
+				// before version 37, these were written one element at a time, so it could be either.
+				if constexpr (is_packable_v<typename T::value_type>)
+				{
+					if(auto t = span.peek(); t == TAG_PACKED_ARRAY || t == TAG_RAW_ARRAY)
+					{
+						T ret;
+						if(!readArray(&ret))
+							return { };
+
+						return ret;
+					}
+				}
+
+				if(the_tag = tag(), the_tag != TAG_STL_VECTOR)
+					return { };
+			}
 			else if constexpr (is_unordered_map<T>::value)  { if(the_tag = tag(), the_tag != TAG_STL_UNORD_MAP) return { }; }
 			else if constexpr (is_tsl_hashmap<T>::value)    { if(the_tag = tag(), the_tag != TAG_TSL_HASHMAP) return { }; }
 			else if constexpr (is_std_map<T>::value)        { if(the_tag = tag(), the_tag != TAG_STL_ORD_MAP) return { }; }
@@ -290,15 +360,17 @@ namespace ikura::serialise
 
 				return ikura::relative_str((size_t) start.value(), (size_t) size.value());
 			}
-			else if constexpr (is_same_v<T, std::string>)
+			else if constexpr (is_same_v<T, std::string> || is_same_v<T, ikura::str_view>)
 			{
+				// views point straight into the buffer (so they're only good for as long as it is), and
+				// don't need to allocate anything.
 				auto sz = read<uint64_t>();
 				if(!sz) return { };
 
 				if(!ensure(sz.value()))
 					return { };
 
-				auto ret = std::string((const char*) span.data(), sz.value());
+				auto ret = T((const char*) span.data(), sz.value());
 				span.remove_prefix(sz.value());
 
 				return ret;
@@ -394,6 +466,42 @@ namespace ikura::serialise
 			}
 		}
 
+		// see Writer::writeArray.
+		template <typename T>
+		bool readArray(std::vector<T>* out)
+		{
+			static_assert(std::is_trivially_copyable_v<T>);
+
+			if(!ensure(1))
+				return false;
+
+			if(auto t = tag(); t == TAG_PACKED_ARRAY)
+			{
+				if(!ensure(1) || span.peek() > PACKED_ARRAY_VERSION)
+					return false;
+
+				span.remove_prefix(1);
+			}
+			else if(t != TAG_RAW_ARRAY)
+			{
+				return false;
+			}
+
+			auto count = read<uint64_t>();
+			auto size = read<uint64_t>();
+			if(!count || !size || size.value() != sizeof(T))
+				return false;
+
+			if(count.value() > span.size() / sizeof(T))
+				return false;
+
+			out->resize(count.value());
+			memcpy(out->data(), span.data(), count.value() * sizeof(T));
+			span.remove_prefix(count.value() * sizeof(T));
+
+			return true;
+		}
+
 		uint8_t tag()
 		{
 			auto t = span.peek();
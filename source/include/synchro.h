@@ -203,6 +203,14 @@ namespace ikura
 		mutable Lk lk;
 		std::function<void ()> write_lock_callback = { };
 
+		// the callback runs after the lock is released, so that anyone who sees what it did (eg. set a dirty
+		// flag) and then takes the lock is guaranteed to see the write too.
+		struct UnlockCallback
+		{
+			const std::function<void ()>& fn;
+			~UnlockCallback() { if(this->fn) this->fn(); }
+		};
+
 	public:
 		Synchronised() { }
 		~Synchronised() { }
@@ -234,13 +242,21 @@ namespace ikura
 		template <typename Functor>
 		void perform_write(Functor&& fn)
 		{
-			if(this->write_lock_callback)
-				this->write_lock_callback();
+			auto cb = UnlockCallback { this->write_lock_callback };
 
 			std::unique_lock lk(this->lk);
 			fn(this->value);
 		}
 
+		// same as perform_write, but without calling the write lock callback -- for writes that
+		// are accounted for in some other way.
+		template <typename Functor>
+		void perform_write_quiet(Functor&& fn)
+		{
+			std::unique_lock lk(this->lk);
+			fn(this->value);
+		}
+
 		template <typename Functor>
 		auto map_read(Functor&& fn) const -> decltype(fn(this->value))
 		{
@@ -251,13 +267,19 @@ namespace ikura
 		template <typename Functor>
 		auto map_write(Functor&& fn) -> decltype(fn(this->value))
 		{
-			if(this->write_lock_callback)
-				this->write_lock_callback();
+			auto cb = UnlockCallback { this->write_lock_callback };
 
 			std::unique_lock lk(this->lk);
 			return fn(this->value);
 		}
 
+		template <typename Functor>
+		auto map_write_quiet(Functor&& fn) -> decltype(fn(this->value))
+		{
+			std::unique_lock lk(this->lk);
+			return fn(this->value);
+		}
+
 
 		Lk& getLock()
 		{
@@ -271,9 +293,6 @@ namespace ikura
 
 		WriteLockedInstance wlock()
 		{
-			if(this->write_lock_callback)
-				this->write_lock_callback();
-
 			return WriteLockedInstance(*this);
 		}
 
@@ -305,7 +324,12 @@ namespace ikura
 		{
 			T* operator -> () { return &this->sync.value; }
 			T* get() { return &this->sync.value; }
-			~WriteLockedInstance() { this->sync.lk.unlock(); }
+			~WriteLockedInstance()
+			{
+				this->sync.lk.unlock();
+				if(this->sync.write_lock_callback)
+					this->sync.write_lock_callback();
+			}
 
 		private:
 			WriteLockedInstance(Synchronised& sync) : sync(sync) { this->sync.lk.lock(); }
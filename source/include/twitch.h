@@ -140,13 +140,38 @@ namespace ikura::twitch
 		static constexpr uint8_t TYPE_TAG = serialise::TAG_TWITCH_LOG_MSG;
 	};
 
+	// the log is stored in columns (one entry per message in each), since there are a lot of messages, and most
+	// of the strings in them are the same few names over and over; those are interned in `strings`. the emote
+	// positions of message i are emotePositions[emoteStarts[i]] up to the next message's.
 	struct TwitchMessageLog : Serialisable
 	{
-		std::vector<TwitchMessage> messages;
+		size_t size() const { return this->timestamps.size(); }
+
+		void add(const TwitchMessage& msg);
+		TwitchMessage get(size_t i) const;
+
+		ikura::span<ikura::relative_str> getEmotePositions(size_t i) const;
+		bool isCommand(size_t i) const { return this->flags[i] & FLAG_COMMAND; }
+
+		std::vector<uint64_t> timestamps;
+		std::vector<uint32_t> userids;
+		std::vector<uint32_t> usernames;
+		std::vector<uint32_t> displaynames;
+		std::vector<uint32_t> channels;
+		std::vector<ikura::relative_str> contents;
+		std::vector<uint32_t> emoteStarts;
+		std::vector<uint8_t> flags;
+
+		std::vector<ikura::relative_str> emotePositions;
+		StringTable strings;
+
+		// by channel and username (both as ids in `strings`).
+		MessageIndex index;
 
 		virtual void serialise(Buffer& buf) const override;
 		static std::optional<TwitchMessageLog> deserialise(Span& buf);
 
+		static constexpr uint8_t FLAG_COMMAND = 0x1;
 		static constexpr uint8_t TYPE_TAG = serialise::TAG_TWITCH_LOG;
 	};
 
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <deque>
 #include <vector>
 #include <optional>
 
@@ -409,6 +410,59 @@ namespace ikura
 		size_t _size;
 	};
 
+	// for strings that repeat a lot (like usernames in the message logs); each distinct one is only stored
+	// once, and referred to by its index. they're never removed, so the indices (and str_views) stay valid.
+	struct StringTable : Serialisable
+	{
+		uint32_t add(str_view s);
+		str_view get(uint32_t id) const { return this->strings[id]; }
+		std::optional<uint32_t> find(str_view s) const;
+
+		size_t size() const { return this->strings.size(); }
+
+		virtual void serialise(Buffer& buf) const override;
+		static std::optional<StringTable> deserialise(Span& buf);
+
+	private:
+		// a deque, so the strings don't move when it grows.
+		std::deque<std::string> strings;
+		string_map<uint32_t> ids;
+	};
+
+	// secondary indexes over one of the message logs, so we can find someone's messages (or the ones after some
+	// time) without walking the whole thing. they're not saved anywhere -- the logs are append-only, so they
+	// just rebuild it when they're loaded, and add to it when a message comes in.
+	struct MessageIndex
+	{
+		void add(uint64_t channel, uint64_t user, uint64_t timestamp);
+
+		// the rows (oldest first) of the messages in a channel, or by someone in a channel.
+		ikura::span<uint32_t> byChannel(uint64_t channel) const;
+		ikura::span<uint32_t> byUser(uint64_t channel, uint64_t user) const;
+
+		// the first row whose timestamp could be >= `ts`. messages are logged in (roughly) the order they
+		// were sent, so everything before it is definitely older, but things after it might not be newer.
+		size_t firstSince(const std::vector<uint64_t>& timestamps, uint64_t ts) const;
+
+		size_t size() const { return this->count; }
+
+	private:
+		struct Postings
+		{
+			std::vector<uint32_t> rows;
+			tsl::robin_map<uint64_t, std::vector<uint32_t>> users;
+		};
+
+		size_t count = 0;
+		tsl::robin_map<uint64_t, Postings> channels;
+
+		// the newest timestamp in the first (i + 1) * CHECKPOINT rows.
+		uint64_t newest = 0;
+		std::vector<uint64_t> checkpoints;
+
+		static constexpr size_t CHECKPOINT = 1024;
+	};
+
 	struct move_only
 	{
 		move_only() = default;
@@ -514,6 +568,8 @@ namespace ikura
 		constexpr uint8_t TAG_SMALL_U64             = 0x12;
 		constexpr uint8_t TAG_STL_PAIR              = 0x13;
 		constexpr uint8_t TAG_REL_STRING            = 0x14;
+		constexpr uint8_t TAG_RAW_ARRAY             = 0x15; // only in versions 35-36; see TAG_PACKED_ARRAY
+		constexpr uint8_t TAG_PACKED_ARRAY          = 0x16;
 
 		// interp part 1
 		constexpr uint8_t TAG_AST_LIT_CHAR          = 0x30;
@@ -570,6 +626,8 @@ namespace ikura
 		constexpr uint8_t TAG_IRC_SERVER            = 0x61;
 		constexpr uint8_t TAG_IRC_CHANNEL           = 0x62;
 		constexpr uint8_t TAG_IRC_DB                = 0x63;
+		constexpr uint8_t TAG_STRING_TABLE          = 0x64;
+		constexpr uint8_t TAG_SEARCH_INDEX          = 0x65;
 
 		// interp part 2
 		constexpr uint8_t TAG_AST_FUNCTION_DEFN     = 0x68;
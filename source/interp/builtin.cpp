@@ -199,7 +199,7 @@ namespace ikura::interp
 	static void command_listgroups(CmdContext& cs, const Channel* chan, ikura::str_view arg_str)
 	{
 		// syntax: groups
-		auto grps = database().map_read([](auto& db) -> auto {
+		auto grps = db::read({ db::Section::Shared }, [](auto& db) -> auto {
 			auto& grps = db.sharedData.getGroups();
 
 			std::vector<const db::Group*> groups;
@@ -224,7 +224,7 @@ namespace ikura::interp
 		if(grp.empty())
 			return chan->sendMessage(Message("not enough arguments to groupadd"));
 
-		database().perform_write([&](auto& db) {
+		db::write({ db::Section::Shared }, [&](auto& db) {
 			auto& s = db.sharedData;
 
 			if(s.addGroup(grp))
@@ -242,7 +242,7 @@ namespace ikura::interp
 		if(grp.empty())
 			return chan->sendMessage(Message("not enough arguments to groupdel"));
 
-		database().perform_write([&](auto& db) {
+		db::write({ db::Section::Shared }, [&](auto& db) {
 			auto& s = db.sharedData;
 
 			if(s.removeGroup(grp))
@@ -540,6 +540,12 @@ namespace ikura::interp
 	static Result<interp::Value> fn_markov(InterpState* fs, CmdContext& cs);
 	static Result<interp::Value> fn_dismantle(InterpState* fs, CmdContext& cs);
 
+	static Result<interp::Value> fn_last_seen(InterpState* fs, CmdContext& cs);
+	static Result<interp::Value> fn_random_quote(InterpState* fs, CmdContext& cs);
+	static Result<interp::Value> fn_message_count(InterpState* fs, CmdContext& cs);
+	static Result<interp::Value> fn_messages_since(InterpState* fs, CmdContext& cs);
+	static Result<interp::Value> fn_search(InterpState* fs, CmdContext& cs);
+
 	static Result<interp::Value> fn_random_int(InterpState* fs, CmdContext& cs);
 	static Result<interp::Value> fn_random_float(InterpState* fs, CmdContext& cs);
 	static Result<interp::Value> fn_random_int_range(InterpState* fs, CmdContext& cs);
@@ -631,7 +637,13 @@ namespace ikura::interp
 		{ "random_float", BuiltinFunction("random_float", t_fn(t_num(), { }), &fn_random_float) },
 		{ "random_int_range", BuiltinFunction("random_int_range", t_fn(t_num(), { t_num(), t_num() }), &fn_random_int_range) },
 		{ "random_float_range", BuiltinFunction("random_float_range", t_fn(t_num(), { t_num(), t_num() }), &fn_random_float_range) },
-		{ "random_float_normal", BuiltinFunction("random_float_normal", t_fn(t_num(), { }), &fn_random_float_normal) }
+		{ "random_float_normal", BuiltinFunction("random_float_normal", t_fn(t_num(), { }), &fn_random_float_normal) },
+
+		{ "last_seen", BuiltinFunction("last_seen", t_fn(t_num(), { t_str() }), &fn_last_seen) },
+		{ "random_quote", BuiltinFunction("random_quote", t_fn(t_str(), { t_str() }), &fn_random_quote) },
+		{ "message_count", BuiltinFunction("message_count", t_fn(t_num(), { t_str() }), &fn_message_count) },
+		{ "messages_since", BuiltinFunction("messages_since", t_fn(t_num(), { t_num() }), &fn_messages_since) },
+		{ "search", BuiltinFunction("search", t_fn(t_list(t_str()), { t_str() }), &fn_search) },
 	};
 
 
@@ -699,7 +711,7 @@ namespace ikura::interp
 				seeds.push_back(v.raw_str());
 		}
 
-		return cmd::message_to_value(markov::generateMessage(seeds));
+		return cmd::message_to_value(markov::getMessage(seeds));
 	}
 
 	static Result<Value> fn_dismantle(InterpState* fs, CmdContext& cs)
@@ -715,6 +727,67 @@ namespace ikura::interp
 		return ret;
 	}
 
+	// these look at the channel the command is running in; see db::query.
+	static constexpr size_t MAX_SEARCH_RESULTS = 5;
+
+	static Result<interp::Value> fn_last_seen(InterpState* fs, CmdContext& cs)
+	{
+		if(cs.arguments.empty() || !cs.arguments[0].is_string())
+			return zpr::sprint("invalid argument");
+
+		// in seconds ago, or -1 if they've never said anything.
+		auto ts = db::query::lastSeen(cs.channel, cs.arguments[0].raw_str());
+		if(!ts.has_value())
+			return Value::of_number(-1.0);
+
+		auto now = util::getMillisecondTimestamp();
+		return Value::of_number((double) (now - std::min(now, ts.value())) / 1000.0);
+	}
+
+	static Result<interp::Value> fn_random_quote(InterpState* fs, CmdContext& cs)
+	{
+		if(cs.arguments.empty() || !cs.arguments[0].is_string())
+			return zpr::sprint("invalid argument");
+
+		return Value::of_string(db::query::randomMessage(cs.channel, cs.arguments[0].raw_str()).value_or(""));
+	}
+
+	static Result<interp::Value> fn_message_count(InterpState* fs, CmdContext& cs)
+	{
+		if(cs.arguments.empty() || !cs.arguments[0].is_string())
+			return zpr::sprint("invalid argument");
+
+		return Value::of_number((double) db::query::messageCount(cs.channel, cs.arguments[0].raw_str()));
+	}
+
+	static Result<interp::Value> fn_messages_since(InterpState* fs, CmdContext& cs)
+	{
+		if(cs.arguments.empty() || !cs.arguments[0].is_number() || cs.arguments[0].get_number().is_complex())
+			return zpr::sprint("invalid argument");
+
+		// the argument is in seconds ago.
+		auto ago = (uint64_t) std::max(0.0, 1000.0 * cs.arguments[0].get_number().real());
+		auto now = util::getMillisecondTimestamp();
+
+		return Value::of_number((double) db::query::messagesSince(cs.channel, now - std::min(now, ago)));
+	}
+
+	static Result<interp::Value> fn_search(InterpState* fs, CmdContext& cs)
+	{
+		if(cs.arguments.empty() || !cs.arguments[0].is_string())
+			return zpr::sprint("invalid argument");
+
+		// the newest few, as "<user> message". this only looks in the current channel, even if there isn't one.
+		std::vector<Value> ret;
+		if(cs.channel == nullptr)
+			return Value::of_list(t_str(), std::move(ret));
+
+		for(auto& res : db::query::search(cs.channel, cs.arguments[0].raw_str(), MAX_SEARCH_RESULTS))
+			ret.push_back(Value::of_string(zpr::sprint("<{}> {}", res.user, res.message)));
+
+		return Value::of_list(t_str(), std::move(ret));
+	}
+
 
 
 
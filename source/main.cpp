@@ -116,7 +116,7 @@ int main(int argc, char** argv)
 	ikura::markov::shutdown();
 	ikura::irc::shutdown();
 
-	ikura::database().rlock()->sync();
+	ikura::db::sync();
 	return 0;
 }
 
@@ -0,0 +1,200 @@
+// filter.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "config.h"
+#include "markov.h"
+#include "synchro.h"
+
+// during hype (or copypasta spam), the same message -- give or take a few words -- shows up hundreds of times
+// in a row. training on all of them is a waste of time, and it skews the model towards them anyway. so before
+// a message is queued, we take a small minhash sketch of it (over pairs of adjacent words), and count how many
+// times each part of the sketch was seen recently, in a counting bloom filter (one per channel). if most of the
+// sketch was already seen enough times, the message is dropped. none of this is exact, but the worst that can
+// happen is that we skip (or train on) the odd message that we shouldn't have.
+namespace ikura::markov
+{
+	// how many values the sketch has. two messages with jaccard similarity j (over their word pairs) are
+	// expected to share j of these. they're counted in bands (of consecutive values), since a single value
+	// often comes from a common pair of words (eg. "i think") that a lot of unrelated messages have.
+	constexpr size_t NUM_MINHASHES      = 8;
+	constexpr size_t BAND_SIZE          = 2;
+	constexpr size_t NUM_BANDS          = NUM_MINHASHES / BAND_SIZE;
+
+	// how many counters each band touches, and how many counters each half of the window
+	// has (per channel). this is enough for ~1000 messages per half-window before false positives show up.
+	constexpr size_t NUM_PROBES         = 3;
+	constexpr size_t NUM_COUNTERS       = 16384;
+
+	struct ChannelFilter
+	{
+		// the window slides by having two halves; the counts are the sum of both. when the current half gets
+		// too old, the other one is cleared and becomes the current one.
+		uint8_t counters[2][NUM_COUNTERS] = { };
+		size_t current = 0;
+
+		uint64_t rotated = 0;
+	};
+
+	static struct {
+		Synchronised<ikura::string_map<std::unique_ptr<ChannelFilter>>> channels;
+
+		std::atomic<uint64_t> checked = 0;
+		std::atomic<uint64_t> dropped = 0;
+		std::atomic<uint64_t> droppedWords = 0;
+		std::atomic<uint64_t> droppedBytes = 0;
+	} Filter;
+
+	static uint64_t mix(uint64_t x)
+	{
+		// splitmix64's finaliser.
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		return x ^ (x >> 31);
+	}
+
+	// words are compared without case, and without punctuation at the end, so "hello!!" and "Hello" are
+	// the same word. returns the number of words.
+	static size_t make_sketch(ikura::str_view input, uint64_t (&sketch)[NUM_MINHASHES])
+	{
+		for(auto& s : sketch)
+			s = UINT64_MAX;
+
+		auto add_shingle = [&sketch](uint64_t sh) {
+			for(size_t i = 0; i < NUM_MINHASHES; i++)
+				sketch[i] = std::min(sketch[i], mix(sh + i * 0x9E3779B97F4A7C15ULL));
+		};
+
+		size_t words = 0;
+		uint64_t prev = 0;
+
+		while(true)
+		{
+			input = input.trim_front();
+			if(input.empty())
+				break;
+
+			auto len = std::min(input.find_first_of(" \t"), input.size());
+			auto word = input.take(len);
+			input.remove_prefix(len);
+
+			while(!word.empty() && (word.back() == '.' || word.back() == ',' || word.back() == '!' || word.back() == '?'))
+				word.remove_suffix(1);
+
+			if(word.empty())
+				continue;
+
+			// fnv-1a, lowercasing as we go.
+			uint64_t h = 0xCBF29CE484222325ULL;
+			for(char c : word)
+				h = (h ^ (uint8_t) (('A' <= c && c <= 'Z') ? c - 'A' + 'a' : c)) * 0x100000001B3ULL;
+
+			if(words > 0)
+				add_shingle(mix(prev) ^ h);
+
+			prev = h;
+			words++;
+		}
+
+		// a single word has no pairs, so just use the word.
+		if(words == 1)
+			add_shingle(prev);
+
+		return words;
+	}
+
+	// returns true if the message should be trained on.
+	static bool check_message(ChannelFilter& filter, const uint64_t (&sketch)[NUM_MINHASHES], uint64_t threshold,
+		uint64_t window)
+	{
+		auto now = util::getMillisecondTimestamp();
+		auto half = std::max(window, (uint64_t) 1) * 1000 / 2;
+
+		if(now >= filter.rotated + 2 * half)
+		{
+			// it's been quiet for a whole window, so everything is stale.
+			memset(filter.counters, 0, sizeof(filter.counters));
+			filter.rotated = now;
+		}
+		else if(now >= filter.rotated + half)
+		{
+			filter.current ^= 1;
+			memset(filter.counters[filter.current], 0, sizeof(filter.counters[filter.current]));
+			filter.rotated = now;
+		}
+
+		auto& cur = filter.counters[filter.current];
+		auto& old = filter.counters[filter.current ^ 1];
+
+		size_t repeated = 0;
+		for(size_t i = 0; i < NUM_BANDS; i++)
+		{
+			uint64_t key = i + 1;
+			for(size_t k = 0; k < BAND_SIZE; k++)
+				key = mix(key ^ sketch[i * BAND_SIZE + k]);
+
+			// double hashing to get the probes; the second half is odd, so the probes don't repeat.
+			auto a = (uint32_t) key;
+			auto b = (uint32_t) (key >> 32) | 1;
+
+			uint64_t count = UINT64_MAX;
+			for(uint32_t k = 0; k < NUM_PROBES; k++)
+			{
+				auto p = (a + k * b) % NUM_COUNTERS;
+				count = std::min(count, (uint64_t) cur[p] + (uint64_t) old[p]);
+
+				if(cur[p] < UINT8_MAX)
+					cur[p]++;
+			}
+
+			if(count >= threshold)
+				repeated++;
+		}
+
+		// near-duplicates only share most of their sketch, not all of it.
+		return 2 * repeated < NUM_BANDS;
+	}
+
+	bool filter_message(ikura::str_view input, ikura::str_view channel)
+	{
+		auto threshold = config::markov::getDuplicateThreshold(channel);
+		if(threshold == 0)
+			return true;
+
+		uint64_t sketch[NUM_MINHASHES];
+		auto words = make_sketch(input, sketch);
+		if(words == 0)
+			return true;
+
+		auto window = config::markov::getConfig().duplicateWindow;
+		auto keep = Filter.channels.map_write([&](auto& channels) -> bool {
+			auto& filter = channels[channel.sv()];
+			if(!filter)
+				filter = std::make_unique<ChannelFilter>();
+
+			return check_message(*filter, sketch, threshold, window);
+		});
+
+		Filter.checked++;
+		if(!keep)
+		{
+			Filter.dropped++;
+			Filter.droppedWords += words;
+			Filter.droppedBytes += input.size();
+		}
+
+		return keep;
+	}
+
+	FilterStats getFilterStats()
+	{
+		FilterStats ret;
+		ret.checked = Filter.checked;
+		ret.dropped = Filter.dropped;
+		ret.droppedWords = Filter.droppedWords;
+		ret.droppedBytes = Filter.droppedBytes;
+		ret.channels = Filter.channels.rlock()->size();
+
+		return ret;
+	}
+}
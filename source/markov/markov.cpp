@@ -13,86 +13,106 @@
 #include "markov.h"
 #include "synchro.h"
 #include "serialise.h"
+#include "markovmodel.h"
 
 #include "utf8proc/utf8proc.h"
 
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
 namespace ikura::markov
 {
-	struct Word : Serialisable
-	{
-		Word() { }
-		Word(uint64_t w, uint64_t freq) : index(w), frequency(freq) { }
-
-		uint64_t index = 0;
-		uint64_t frequency = 0;
-
-		virtual void serialise(Buffer& buf) const override;
-		static std::optional<Word> deserialise(Span& buf);
-
-		static constexpr uint8_t TYPE_TAG = serialise::TAG_MARKOV_WORD;
-	};
+	static constexpr size_t MIN_INPUT_LENGTH        = 2;
+	static constexpr size_t GOOD_INPUT_LENGTH       = 6;
+	static constexpr size_t DISCARD_CHANCE_PERCENT  = 80;
 
-	struct WordList : Serialisable
+	void initialise_vocab(Vocabulary* vocab)
 	{
-		WordList() { }
-
-		uint64_t totalFrequency = 0;
-		std::vector<Word> words;
-
-		// map from the global wordlist index, to the index in the words array.
-		tsl::robin_map<uint64_t, uint64_t> globalIndexMap;
+		// the markers aren't real words, so they don't go in the index.
+		vocab->add("", WORD_FLAG_SENTENCE_START, /* indexed: */ false);
+		vocab->add("", WORD_FLAG_SENTENCE_END, /* indexed: */ false);
+	}
 
-		virtual void serialise(Buffer& buf) const override;
-		static std::optional<WordList> deserialise(Span& buf);
+	size_t Vocabulary::KeyHash::operator () (const Key& k) const
+	{
+		// fnv-1a. the snapshot has an index that was built with this, so it can't be std::hash (which is
+		// allowed to change between builds).
+		uint64_t h = 0xCBF29CE484222325ULL;
+		for(size_t i = 0; i < k.word.size(); i++)
+			h = (h ^ (uint8_t) k.word[i]) * 0x100000001B3ULL;
 
-		static constexpr uint8_t TYPE_TAG = serialise::TAG_MARKOV_WORD_LIST;
-	};
+		return k.emote ? ~h : h;
+	}
 
-	struct DBWord : Serialisable
+	bool Vocabulary::KeyEqual::operator () (uint32_t a, const Key& b) const
 	{
-		DBWord() { }
-		DBWord(ikura::str_view sv) : word(sv.str()) { }
-		DBWord(ikura::str_view sv, uint64_t f) : word(sv.str()), flags(f) { }
+		auto k = vocab->key(a);
+		return k.emote == b.emote && k.word == b.word;
+	}
 
-		std::string word;   // TODO: find some way to make this a relative_str
-		uint64_t flags = 0;
+	const DBWord& Vocabulary::get(uint64_t idx) const
+	{
+		auto n = this->baseWords.size();
+		return idx < n ? this->baseWords[idx] : this->wordList[idx - n];
+	}
 
-		virtual void serialise(Buffer& buf) const override;
-		static std::optional<DBWord> deserialise(Span& buf);
+	ikura::str_view Vocabulary::text(uint64_t idx) const
+	{
+		auto n = this->baseWords.size();
+		return idx < n
+			? this->baseWords[idx].word.get(this->baseArena.data())
+			: this->wordList[idx - n].word.get(this->arena);
+	}
 
-		static constexpr uint8_t TYPE_TAG = serialise::TAG_MARKOV_STORED_WORD;
-	};
+	Vocabulary::Key Vocabulary::key(uint64_t idx) const
+	{
+		return Key { this->text(idx), (this->get(idx).flags & WORD_FLAG_EMOTE) != 0 };
+	}
 
-	struct MarkovModel
+	std::optional<uint64_t> Vocabulary::find(ikura::str_view word, bool emote) const
 	{
-		// map from list of words (current state) to list of possible output words.
-		std::map<uint64_t, WordList> table;
+		auto key = Key { word, emote };
+		if(!this->baseIndex.empty())
+		{
+			auto mask = this->baseIndex.size() - 1;
+			for(size_t i = KeyHash { this }(key) & mask; this->baseIndex[i] != EMPTY_SLOT; i = (i + 1) & mask)
+			{
+				if(KeyEqual { this }(this->baseIndex[i], key))
+					return this->baseIndex[i];
+			}
+		}
 
-		// the map from words to indices in the word list.
-		ikura::string_map<uint64_t> wordIndices;
+		if(auto it = this->wordIndices.find(key); it != this->wordIndices.end())
+			return *it;
 
-		// the list of words. either way we'll need two sets, because we need to go from
-		// index -> word and word -> index.
-		std::vector<DBWord> wordList;
-	};
+		return { };
+	}
 
-	static constexpr size_t MIN_INPUT_LENGTH        = 2;
-	static constexpr size_t GOOD_INPUT_LENGTH       = 6;
-	static constexpr size_t DISCARD_CHANCE_PERCENT  = 80;
+	uint64_t Vocabulary::add(ikura::str_view word, uint64_t flags, bool indexed)
+	{
+		assert(this->size() < UINT32_MAX);
 
-	static constexpr size_t MAX_PREFIX_LENGTH       = 3;
+		auto idx = (uint32_t) this->size();
+		this->wordList.emplace_back(ikura::relative_str(this->arena.size(), word.size()), flags);
+		this->arena.append(word.data(), word.size());
 
-	static constexpr size_t IDX_START_MARKER        = 0;
-	static constexpr size_t IDX_END_MARKER          = 1;
+		if(indexed)
+			this->wordIndices.insert(idx);
 
-	static constexpr uint64_t WORD_FLAG_EMOTE           = 0x1;
-	static constexpr uint64_t WORD_FLAG_SENTENCE_START  = 0x2;
-	static constexpr uint64_t WORD_FLAG_SENTENCE_END    = 0x4;
+		return idx;
+	}
 
-	static void initialise_model(MarkovModel* model)
+	void Vocabulary::clear()
 	{
-		model->wordList.emplace_back("", WORD_FLAG_SENTENCE_START);
-		model->wordList.emplace_back("", WORD_FLAG_SENTENCE_END);
+		this->baseArena = { };
+		this->baseWords = { };
+		this->baseIndex = { };
+		this->snapshot.reset();
+
+		this->arena.clear();
+		this->wordList.clear();
+		this->wordIndices.clear();
 	}
 }
 
@@ -105,15 +125,13 @@ namespace ikura::markov
 		std::string msg;
 		std::vector<ikura::relative_str> emotes;
 
+		// the order that process() saw it in (see retrain).
+		uint64_t seq = 0;
+
 		bool shouldStop = false;
-		bool retraining = false;
 
-		static QueuedMsg retrain(std::string m, std::vector<ikura::relative_str> e)
-		{
-			auto ret = QueuedMsg(std::move(m), std::move(e));
-			ret.retraining = true;
-			return ret;
-		}
+		// if set, this isn't a message; just set it when we get here (see flush).
+		condvar<bool>* flushed = nullptr;
 
 		static QueuedMsg stop()
 		{
@@ -121,354 +139,1401 @@ namespace ikura::markov
 			ret.shouldStop = true;
 			return ret;
 		}
+
+		static QueuedMsg flush(condvar<bool>* cv)
+		{
+			auto ret = QueuedMsg("__flush__", { });
+			ret.flushed = cv;
+			return ret;
+		}
 	};
 
 	static struct {
 		std::thread worker;
 		wait_queue<QueuedMsg> queue;
 
-		size_t retrainingTotalSize = 0;
+		// handed out by process(); the backends call it right after logging the message, with the log still
+		// locked, so these are in the same order as the log.
+		std::atomic<uint64_t> nextSeq = 0;
+
+		std::thread retrainer;
+		std::atomic<size_t> retrainingTotalSize = 0;
 		std::atomic<size_t> retrainingCompleted = 0;
+
+		// set when we load a model that can't be used as-is (see MarkovDB::deserialise).
+		bool retrainOnInit = false;
 	} State;
 
-	static Synchronised<MarkovModel> theMarkovModel;
-	Synchronised<MarkovModel>& markovModel() { return theMarkovModel; }
+	// a sentence that was trained into the spare model, but not the published one (or vice versa), as word
+	// indices (including the markers). the two models always add words and contexts in the same order, so
+	// the indices mean the same thing in both.
+	using TrainOp = std::vector<uint64_t>;
+
+	static uint64_t next_generation()
+	{
+		static std::atomic<uint64_t> counter = 0;
+		return ++counter;
+	}
+
+	std::shared_ptr<MarkovModel> new_model()
+	{
+		auto ret = std::make_shared<MarkovModel>();
+		ret->generation = next_generation();
+		ret->vocab.perform_write([](auto& vocab) {
+			initialise_vocab(&vocab);
+		});
+
+		return ret;
+	}
 
-	static uint64_t hash_prefix(ikura::span<uint64_t> pref)
+	static struct {
+
+		// only ever accessed with std::atomic_load and std::atomic_store. this is a separate handle for the
+		// model (see make_handle), so we know when everyone that got it is done with it.
+		std::shared_ptr<MarkovModel> live = new_model();
+
+		// everything below is protected by `lock`. `current` is the model that `live` is for, and `spare` is
+		// the model that we train; `pending` is what went into it since it was last published, and `lagging` is
+		// what the published one has, but the spare doesn't (ie. what it has to catch up on before we can
+		// train it).
+		std::mutex lock;
+		std::shared_ptr<MarkovModel> current;
+		std::shared_ptr<MarkovModel> spare;
+		std::vector<TrainOp> pending;
+		std::vector<TrainOp> lagging;
+
+		// the handle that the spare was published with, until the last one is let go of (which sets `released`).
+		std::weak_ptr<MarkovModel> retired;
+		condvar<bool> released;
+
+		// while retraining, this is the model being built, and new training goes straight into it -- but only
+		// for messages from `retrainingFrom` onwards, since the ones before that are in the log already (see
+		// retrain).
+		std::shared_ptr<MarkovModel> retraining;
+		uint64_t retrainingFrom = 0;
+
+		// while the published model is being rebuilt (see begin_rebuild), this is the model we started from,
+		// and nothing gets published.
+		std::shared_ptr<MarkovModel> rebuilding;
+	} Models;
+
+	std::shared_ptr<MarkovModel> markovModel()
 	{
-		return std::hash<decltype(pref)>()(pref);
+		return std::atomic_load(&Models.live);
 	}
 
-	static void process_one(ikura::str_view input, std::vector<ikura::relative_str> emote_idxs);
+	// makes a copy of the model for double-buffering. the frozen tables and anything from the snapshot
+	// are immutable, so those are shared; only the newer parts (the deltas, and the vocabulary and trie
+	// overlays) are actually copied. nothing else can be training `src` while this happens.
+	static std::shared_ptr<MarkovModel> clone_model(const MarkovModel& src)
+	{
+		auto ret = std::make_shared<MarkovModel>();
+		ret->generation = src.generation;
+		ret->dirty = src.dirty.load();
+
+		ret->vocab.perform_write([&src](auto& dst) {
+			src.vocab.perform_read([&dst](auto& vocab) {
+				dst.snapshot = vocab.snapshot;
+				dst.baseArena = vocab.baseArena;
+				dst.baseWords = vocab.baseWords;
+				dst.baseIndex = vocab.baseIndex;
+
+				dst.arena = vocab.arena;
+				dst.wordList = vocab.wordList;
+
+				// the index refers back to its vocabulary, so it can't be copied; the markers don't get indexed.
+				dst.wordIndices.reserve(vocab.wordIndices.size());
+				for(auto i = std::max(vocab.baseWords.size(), IDX_END_MARKER + 1); i < vocab.size(); i++)
+					dst.wordIndices.insert((uint32_t) i);
+			});
+		});
+
+		*ret->trie.wlock().get() = *src.trie.rlock().get();
+
+		for(size_t i = 0; i < MarkovModel::NUM_SHARDS; i++)
+			*ret->shards[i].wlock().get() = *src.shards[i].rlock().get();
+
+		return ret;
+	}
+
+	// the handle shares the model's lifetime, but has its own count, so that the spare (which is the same model)
+	// doesn't keep it alive.
+	static std::shared_ptr<MarkovModel> make_handle(std::shared_ptr<MarkovModel> model)
+	{
+		auto ptr = model.get();
+		return std::shared_ptr<MarkovModel>(ptr, [model = std::move(model)](MarkovModel*) {
+			Models.released.set(true);
+		});
+	}
+
+	// the caller needs Models.lock.
+	static void install_locked(std::shared_ptr<MarkovModel> model)
+	{
+		Models.spare = clone_model(*model);
+		Models.pending.clear();
+		Models.lagging.clear();
+		Models.retired.reset();
+
+		Models.current = model;
+		std::atomic_store(&Models.live, make_handle(std::move(model)));
+	}
+
+	void install_model(std::shared_ptr<MarkovModel> model)
+	{
+		std::lock_guard lk(Models.lock);
+		install_locked(std::move(model));
+	}
+
+	static std::vector<uint64_t> resolve_sentence(MarkovModel& markov, const std::vector<std::pair<ikura::str_view, bool>>& word_arr);
+	static void train_sentence(MarkovModel& markov, const MarkovModel* sibling, ikura::span<uint64_t> word_indices);
+
+	// publish when we've caught up with the queue, but don't let the published model fall too far behind
+	// if messages keep coming in.
+	static constexpr size_t MAX_PENDING_TRAINING = 256;
+
+	// swaps the spare model in, if it learnt enough since the last time.
+	static void publish(bool idle)
+	{
+		std::lock_guard lk(Models.lock);
+		if(Models.rebuilding || Models.pending.empty() || (!idle && Models.pending.size() < MAX_PENDING_TRAINING))
+			return;
+
+		auto old = std::move(Models.current);
+		Models.current = std::move(Models.spare);
+		Models.retired = std::atomic_load(&Models.live);
+		std::atomic_store(&Models.live, make_handle(Models.current));
+
+		Models.spare = std::move(old);
+		Models.lagging = std::move(Models.pending);
+		Models.pending.clear();
+	}
+
+	// brings the spare model up to date with the published one. the caller needs Models.lock, and has to make sure
+	// that nobody is still using the spare (see process_one).
+	static void catch_up()
+	{
+		if(Models.lagging.empty())
+			return;
+
+		auto live = std::atomic_load(&Models.live);
+		auto& spare = *Models.spare;
+
+		// everything the published model learnt since the swap is at the end of its vocabulary and trie,
+		// so we can just copy those over, instead of looking up every word again.
+		spare.vocab.perform_write([&live](auto& vocab) {
+			live->vocab.perform_read([&vocab](auto& src) {
+				for(auto i = vocab.size(); i < src.size(); i++)
+					vocab.add(src.text(i), src.get(i).flags, /* indexed: */ i > IDX_END_MARKER);
+			});
+		});
+
+		spare.trie.perform_write([&live](auto& trie) {
+			live->trie.perform_read([&trie](auto& src) {
+				for(auto n = (uint32_t) trie.size(); n < src.size(); n++)
+					trie.insert(src.parent(n), src.word(n));
+			});
+		});
+
+		for(const auto& op : Models.lagging)
+			train_sentence(spare, live.get(), op);
+
+		Models.lagging.clear();
+	}
+
+	std::shared_ptr<MarkovModel> begin_rebuild()
+	{
+		std::lock_guard lk(Models.lock);
+		if(Models.retraining || Models.rebuilding)
+			return nullptr;
+
+		Models.rebuilding = std::atomic_load(&Models.live);
+		return Models.rebuilding;
+	}
+
+	void finish_rebuild(std::shared_ptr<MarkovModel> model)
+	{
+		std::lock_guard lk(Models.lock);
+
+		// if something else got installed in the meantime, then what we made is out of date.
+		auto base = std::move(Models.rebuilding);
+		if(!model || Models.retraining || base != std::atomic_load(&Models.live))
+			return;
+
+		// nothing was published since we started, so everything that's pending is exactly what the new
+		// model is missing. its words are numbered differently, so this needs to go through the text.
+		Models.spare->vocab.perform_read([&model](auto& vocab) {
+			std::vector<std::pair<ikura::str_view, bool>> words;
+			for(const auto& op : Models.pending)
+			{
+				words.clear();
+				for(size_t i = 1; i + 1 < op.size(); i++)
+					words.emplace_back(vocab.text(op[i]), (vocab.get(op[i]).flags & WORD_FLAG_EMOTE) != 0);
+
+				auto indices = resolve_sentence(*model, words);
+				train_sentence(*model, nullptr, indices);
+			}
+		});
+
+		install_locked(std::move(model));
+	}
+
+	static void process_one(ikura::str_view input, std::vector<ikura::relative_str> emote_idxs, uint64_t seq);
 	static void worker_thread()
 	{
 		while(true)
 		{
-			auto input = State.queue.pop();
-			if(input.shouldStop)  break;
-			if(input.msg.empty()) continue;
-
-			process_one(ikura::str_view(input.msg), std::move(input.emotes));
-			if(input.retraining)
+			auto input = State.queue.pop();
+			if(input.shouldStop)  break;
+			if(input.msg.empty()) continue;
+
+			if(input.flushed)
+			{
+				publish(/* idle: */ true);
+				input.flushed->set(true);
+				continue;
+			}
+
+			process_one(ikura::str_view(input.msg), std::move(input.emotes), input.seq);
+			publish(/* idle: */ State.queue.size() == 0);
+		}
+
+		lg::log("markov", "worker thread exited");
+	}
+
+	void init()
+	{
+		State.worker = std::thread(worker_thread);
+
+		if(State.retrainOnInit)
+		{
+			State.retrainOnInit = false;
+			retrain();
+		}
+
+		start_pool();
+		start_pruner();
+	}
+
+	// a few messages in the queue is normal; more than this means we're falling behind.
+	static constexpr size_t BUSY_QUEUE_LENGTH = 16;
+
+	bool is_busy()
+	{
+		return State.retrainingTotalSize > 0 || State.queue.size() > BUSY_QUEUE_LENGTH;
+	}
+
+	void reset()
+	{
+		lg::log("markov", "resetting model");
+
+		auto model = new_model();
+		model->dirty = true;
+
+		install_model(std::move(model));
+	}
+
+	double retrainingProgress()
+	{
+		if(State.retrainingTotalSize == 0)
+			return 1.0;
+
+		return (double) State.retrainingCompleted / (double) State.retrainingTotalSize;
+	}
+
+	void shutdown()
+	{
+		stop_pruner();
+		stop_pool();
+
+		// push an empty string to terminate.
+		State.queue.push(QueuedMsg::stop());
+
+		// wait for it to stop.
+		if(State.worker.joinable())
+			State.worker.join();
+
+		if(State.retrainer.joinable())
+			State.retrainer.join();
+	}
+
+	void process(ikura::str_view input, const std::vector<ikura::relative_str>& emote_idxs, ikura::str_view channel)
+	{
+		if(!filter_message(input, channel))
+			return;
+
+		auto msg = QueuedMsg(input.str(), emote_idxs);
+		msg.seq = State.nextSeq++;
+
+		State.queue.push(std::move(msg));
+	}
+
+	void flush()
+	{
+		condvar<bool> cv(false);
+		State.queue.push(QueuedMsg::flush(&cv));
+		cv.wait(true);
+	}
+
+	static bool should_split(char c)
+	{
+		return c == '.' || c == ',' || c == '!' || c == '?';
+	}
+
+	static std::optional<uint64_t> find_word_index(const Vocabulary* markov, ikura::str_view sv, bool is_emote)
+	{
+		return markov->find(sv, is_emote);
+	}
+
+	static uint64_t get_word_index(Vocabulary* markov, ikura::str_view sv, bool is_emote)
+	{
+		if(auto idx = find_word_index(markov, sv, is_emote); idx.has_value())
+			return *idx;
+
+		return markov->add(sv, is_emote ? WORD_FLAG_EMOTE : 0);
+	}
+
+	static size_t is_ignored_sequence(ikura::str_view str)
+	{
+		// the only ascii characters in those categories are the control characters, so most of
+		// the time we don't need to ask utf8proc.
+		if(auto c = (uint8_t) str[0]; c < 0x80)
+			return (c < 0x20 || c == 0x7F) ? 1 : 0;
+
+		return unicode::is_category(str, {
+			UTF8PROC_CATEGORY_CN, UTF8PROC_CATEGORY_MN, UTF8PROC_CATEGORY_MC, UTF8PROC_CATEGORY_ME, UTF8PROC_CATEGORY_ZL,
+			UTF8PROC_CATEGORY_ZP, UTF8PROC_CATEGORY_CC, UTF8PROC_CATEGORY_CF, UTF8PROC_CATEGORY_CS, UTF8PROC_CATEGORY_CO,
+			UTF8PROC_CATEGORY_SO
+		});
+	}
+
+	// returns how many bytes at the start of `str` can't possibly end a word -- ie. anything that isn't a
+	// space, a tab, or something that should_split. most words are entirely made of these, so we look at
+	// them a block at a time instead of going through the loop below for every byte.
+	static size_t plain_prefix(ikura::str_view str)
+	{
+		auto ptr = (const uint8_t*) str.data();
+		size_t len = str.size();
+		size_t i = 0;
+
+	#if defined(__SSE2__)
+		auto space  = _mm_set1_epi8(' ');
+		auto tab    = _mm_set1_epi8('\t');
+		auto dot    = _mm_set1_epi8('.');
+		auto comma  = _mm_set1_epi8(',');
+		auto bang   = _mm_set1_epi8('!');
+		auto qmark  = _mm_set1_epi8('?');
+
+		for(; i + 16 <= len; i += 16)
+		{
+			auto x = _mm_loadu_si128((const __m128i*) (ptr + i));
+			auto m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(x, space), _mm_cmpeq_epi8(x, tab)),
+				_mm_or_si128(
+					_mm_or_si128(_mm_cmpeq_epi8(x, dot), _mm_cmpeq_epi8(x, comma)),
+					_mm_or_si128(_mm_cmpeq_epi8(x, bang), _mm_cmpeq_epi8(x, qmark))
+				)
+			);
+
+			if(auto mask = (uint32_t) _mm_movemask_epi8(m); mask != 0)
+				return i + (size_t) __builtin_ctz(mask);
+		}
+	#else
+		// no vectors, so do 8 bytes at a time instead. a byte of (x ^ c) is zero iff that byte of x was c, and
+		// (v - 0x01..) & ~v & 0x80.. has the high bit set in the first zero byte of v (and maybe some after it,
+		// which doesn't matter since we only want the first one).
+		constexpr uint64_t ONES = 0x0101010101010101ULL;
+		constexpr uint64_t HIGH = 0x8080808080808080ULL;
+
+		auto has_zero = [](uint64_t v) -> uint64_t { return (v - ONES) & ~v & HIGH; };
+
+		for(; i + 8 <= len; i += 8)
+		{
+			uint64_t x = 0;
+			memcpy(&x, ptr + i, sizeof(x));
+
+			auto m = has_zero(x ^ (ONES * ' ')) | has_zero(x ^ (ONES * '\t'))
+				| has_zero(x ^ (ONES * '.')) | has_zero(x ^ (ONES * ','))
+				| has_zero(x ^ (ONES * '!')) | has_zero(x ^ (ONES * '?'));
+
+			// the mask is in memory order, so this only works on little-endian machines.
+			if(m != 0)
+				return i + (size_t) (__builtin_ctzll(m) / 8);
+		}
+	#endif
+
+		for(; i < len; i++)
+		{
+			if(auto c = ptr[i]; c == ' ' || c == '\t' || should_split((char) c))
+				return i;
+		}
+
+		return len;
+	}
+
+	// split the input by words and punctuation. consecutive puncutation is lumped together.
+	static std::vector<std::pair<ikura::str_view, bool>> split_words(ikura::str_view input, ikura::span<ikura::relative_str> emote_idxs)
+	{
+		std::vector<std::pair<ikura::str_view, bool>> word_arr;
+
+		input = input.trim();
+		if(input.empty())
+			return word_arr;
+
+		assert(input[0] != ' ' && input[0] != '\t');
+
+		size_t end = 0;
+		size_t cur_idx = 0;
+		bool is_emote = false;
+
+		auto advance = [&]() {
+			input.remove_prefix(end);
+
+			auto tmp = input;
+			input = input.trim_front();
+			cur_idx += (tmp.size() - input.size());
+			end = 0;
+		};
+
+		while(end < input.size())
+		{
+			if(auto c = input[end]; !is_emote && (c == ' ' || c == '\t'))
+			{
+				word_arr.emplace_back(input.take(end), false);
+				advance();
+			}
+			// this weird condition is to not split constructs like "a?b" and "a.b.c", to handle URLs properly.
+			else if(should_split(c) && (end + 1 == input.size() || input[end + 1] == ' '))
+			{
+				word_arr.emplace_back(input.take(end), false);
+				advance();
+
+				while(end < input.size() && should_split(input[end]))
+					end++, cur_idx++;
+
+				word_arr.emplace_back(input.take(end), false);
+				advance();
+			}
+			// note that only the first character of a word can be ignored; once we've gone past it, the
+			// sequence is kept as-is.
+			else if(auto k = (end == 0 ? is_ignored_sequence(input) : 0); k > 0)
+			{
+				input.remove_prefix(k);
+				cur_idx += k;
+			}
+			else
+			{
+				if(emote_idxs.size() > 0)
+				{
+					if(is_emote && emote_idxs[0].end_excl() == cur_idx)
+					{
+						emote_idxs.remove_prefix(1);
+
+						// forcefully add a word
+						word_arr.emplace_back(input.take(end), true);
+						advance();
+
+						is_emote = false;
+						continue;
+					}
+					else
+					{
+						if(emote_idxs[0].start() == cur_idx)
+							is_emote = true;
+
+						else if(!is_emote && emote_idxs[0].start() < cur_idx)
+							emote_idxs.remove_prefix(1);
+					}
+				}
+
+				end++;
+				cur_idx++;
+
+				// skip over the rest of the word in one go, stopping short of the next emote boundary (if any),
+				// since that needs to be handled above.
+				auto skip = plain_prefix(input.drop(end));
+				if(emote_idxs.size() > 0)
+				{
+					auto boundary = is_emote ? emote_idxs[0].end_excl() : emote_idxs[0].start();
+					skip = (boundary > cur_idx ? std::min(skip, boundary - cur_idx) : 0);
+				}
+
+				end += skip;
+				cur_idx += skip;
+			}
+		}
+
+		if(end > 0)
+		{
+			word_arr.emplace_back(input.take(end), is_emote);
+		}
+
+		return word_arr;
+	}
+
+	std::vector<ikura::str_view> splitWords(ikura::str_view input)
+	{
+		std::vector<ikura::str_view> ret;
+		for(auto& [ word, _ ] : split_words(input, { }))
+			ret.push_back(word);
+
+		return ret;
+	}
+
+	// filter out most of the shorter responses.
+	static bool should_discard(size_t num_words)
+	{
+		if(num_words < MIN_INPUT_LENGTH)
+			return true;
+
+		else if(num_words < GOOD_INPUT_LENGTH)
+		{
+			auto x = random::get<uint64_t>(0, 100);
+			if(x <= DISCARD_CHANCE_PERCENT)
+				return true;
+		}
+
+		return false;
+	}
+
+	// note: the fenwick tree is 1-indexed, so node i lives in cumulative[i - 1].
+	static constexpr size_t lowest_bit(size_t x) { return x & -x; }
+
+	void WordList::add(uint64_t the_word, uint64_t freq)
+	{
+		this->totalFrequency += freq;
+		if(auto it = this->globalIndexMap.find(the_word); it != this->globalIndexMap.end())
+		{
+			this->words[it->second].frequency += freq;
+
+			for(size_t i = it->second + 1; i <= this->cumulative.size(); i += lowest_bit(i))
+				this->cumulative[i - 1] += freq;
+		}
+		else
+		{
+			auto idx = this->words.size();
+			this->words.emplace_back(the_word, freq);
+			this->globalIndexMap.emplace(the_word, idx);
+
+			// the new node covers (n - lowbit(n), n]; everything except the new word itself
+			// can be picked up from the nodes that are already there.
+			auto n = idx + 1;
+			auto sum = freq;
+			for(size_t i = n - 1; i > n - lowest_bit(n); i -= lowest_bit(i))
+				sum += this->cumulative[i - 1];
+
+			this->cumulative.push_back(sum);
+		}
+	}
+
+	// finds the word at `selection` (in [0, totalFrequency)), as if the frequencies were laid end to end.
+	const Word& WordList::select(uint64_t selection) const
+	{
+		assert(!this->words.empty() && selection < this->totalFrequency);
+
+		size_t step = 1;
+		while(step * 2 <= this->cumulative.size())
+			step *= 2;
+
+		size_t pos = 0;
+		for(; step > 0; step /= 2)
+		{
+			if(pos + step <= this->cumulative.size() && this->cumulative[pos + step - 1] <= selection)
+			{
+				pos += step;
+				selection -= this->cumulative[pos - 1];
+			}
+		}
+
+		return this->words[pos];
+	}
+
+	void WordList::rebuildCumulative()
+	{
+		this->cumulative.resize(this->words.size());
+		for(size_t i = 0; i < this->words.size(); i++)
+			this->cumulative[i] = this->words[i].frequency;
+
+		for(size_t i = 1; i <= this->cumulative.size(); i++)
+		{
+			if(auto parent = i + lowest_bit(i); parent <= this->cumulative.size())
+				this->cumulative[parent - 1] += this->cumulative[i - 1];
+		}
+	}
+
+	// fibonacci hashing; the contexts in a shard all have the same low bits (that's how they got
+	// into the shard in the first place), so we need to use the top bits instead.
+	static size_t slot_for(uint64_t context, uint32_t shift)
+	{
+		return (size_t) ((context * 0x9E3779B97F4A7C15ULL) >> shift);
+	}
+
+	std::optional<uint32_t> FrozenTable::find(uint64_t context) const
+	{
+		if(this->slotEntries.empty())
+			return { };
+
+		auto mask = this->slotEntries.size() - 1;
+		for(size_t i = slot_for(context, this->slotShift); ; i = (i + 1) & mask)
+		{
+			if(this->slotEntries[i] == EMPTY_SLOT)
+				return { };
+
+			if(this->slotKeys[i] == context)
+				return this->slotEntries[i];
+		}
+	}
+
+	uint64_t FrozenTable::total(uint32_t entry) const
+	{
+		auto begin = this->offsets[entry];
+		auto end = this->offsets[entry + 1];
+
+		return begin == end ? 0 : this->cumulative[end - 1];
+	}
+
+	std::pair<uint32_t, uint32_t> FrozenTable::select(uint32_t entry, uint64_t selection) const
+	{
+		auto begin = this->cumulative.begin() + this->offsets[entry];
+		auto end = this->cumulative.begin() + this->offsets[entry + 1];
+
+		assert(begin != end && selection < *(end - 1));
+
+		auto it = std::upper_bound(begin, end, (uint32_t) selection);
+		auto freq = *it - (it == begin ? 0 : *(it - 1));
+
+		return { this->words[it - this->cumulative.begin()], freq };
+	}
+
+	// gets the (word, frequency) successors of a prefix, combining the frozen entry and the delta wordlist
+	// (either of which might not exist). `out` is cleared first.
+	static void collect_successors(const FrozenTable& frozen, std::optional<uint32_t> entry, const WordList* wl,
+		std::vector<std::pair<uint64_t, uint64_t>>& out, std::vector<bool>& seen)
+	{
+		out.clear();
+
+		if(wl) seen.assign(wl->words.size(), false);
+		else   seen.clear();
+
+		if(entry.has_value())
+		{
+			uint64_t prev = 0;
+			for(auto i = frozen.offsets[*entry]; i < frozen.offsets[*entry + 1]; i++)
+			{
+				uint64_t word = frozen.words[i];
+				uint64_t freq = frozen.cumulative[i] - prev;
+				prev = frozen.cumulative[i];
+
+				if(wl)
+				{
+					if(auto it = wl->globalIndexMap.find(word); it != wl->globalIndexMap.end())
+					{
+						freq += wl->words[it->second].frequency;
+						seen[it->second] = true;
+					}
+				}
+
+				out.emplace_back(word, freq);
+			}
+		}
+
+		if(wl)
+		{
+			for(size_t i = 0; i < wl->words.size(); i++)
+			{
+				if(!seen[i])
+					out.emplace_back(wl->words[i].index, wl->words[i].frequency);
+			}
+		}
+	}
+
+	void FrozenBuilder::add(uint64_t context, std::vector<std::pair<uint64_t, uint64_t>>& successors)
+	{
+		if(successors.empty())
+			return;
+
+		// the frequencies need to fit in 32 bits (the total, since we store the running sum). if some
+		// prefix has been seen four billion times, just halve everything -- the ratios are what matter.
+		auto sum = [&successors]() -> uint64_t {
+			uint64_t ret = 0;
+			for(auto& s : successors)
+				ret += s.second;
+			return ret;
+		};
+
+		while(sum() > UINT32_MAX)
+		{
+			for(auto& s : successors)
+				s.second = std::max((uint64_t) 1, s.second / 2);
+		}
+
+		assert(this->words.size() + successors.size() <= UINT32_MAX);
+
+		this->contexts.push_back(context);
+		this->offsets.push_back((uint32_t) this->words.size());
+
+		uint64_t cum = 0;
+		for(auto& [ word, freq ] : successors)
+		{
+			assert(word <= UINT32_MAX);
+
+			cum += freq;
+			this->words.push_back((uint32_t) word);
+			this->cumulative.push_back((uint32_t) cum);
+		}
+	}
+
+	FrozenTable FrozenBuilder::finish()
+	{
+		this->offsets.push_back((uint32_t) this->words.size());
+
+		FrozenTable table;
+		if(!this->contexts.empty())
+		{
+			// keep the load factor under 0.5
+			size_t cap = 16;
+			while(cap < 2 * this->contexts.size())
+				cap *= 2;
+
+			std::vector<uint64_t> keys(cap);
+			std::vector<uint32_t> entries(cap, FrozenTable::EMPTY_SLOT);
+
+			table.slotShift = 64 - __builtin_ctzll(cap);
+			for(uint32_t e = 0; e < this->contexts.size(); e++)
+			{
+				auto i = slot_for(this->contexts[e], table.slotShift);
+				while(entries[i] != FrozenTable::EMPTY_SLOT)
+					i = (i + 1) & (cap - 1);
+
+				keys[i] = this->contexts[e];
+				entries[i] = e;
+			}
+
+			table.slotKeys = std::move(keys);
+			table.slotEntries = std::move(entries);
+		}
+
+		table.contexts = std::move(this->contexts);
+		table.offsets = std::move(this->offsets);
+		table.words = std::move(this->words);
+		table.cumulative = std::move(this->cumulative);
+
+		return table;
+	}
+
+	FrozenTable merge_shard(const Shard& shard)
+	{
+		auto& old = shard.frozen;
+
+		FrozenBuilder builder;
+		builder.contexts.reserve(old.size() + shard.delta.size());
+		builder.offsets.reserve(old.size() + shard.delta.size() + 1);
+		builder.words.reserve(old.words.size() + shard.deltaSize);
+		builder.cumulative.reserve(old.words.size() + shard.deltaSize);
+
+		std::vector<std::pair<uint64_t, uint64_t>> successors;
+		std::vector<bool> seen;
+
+		for(uint32_t e = 0; e < old.size(); e++)
+		{
+			auto it = shard.delta.find(old.contexts[e]);
+			collect_successors(old, e, it == shard.delta.end() ? nullptr : &it->second, successors, seen);
+			builder.add(old.contexts[e], successors);
+		}
+
+		for(const auto& [ context, wl ] : shard.delta)
+		{
+			if(old.find(context).has_value())
+				continue;
+
+			collect_successors(old, { }, &wl, successors, seen);
+			builder.add(context, successors);
+		}
+
+		return builder.finish();
+	}
+
+	void compact_shard(Shard& shard)
+	{
+		shard.frozen = merge_shard(shard);
+		shard.delta = { };
+		shard.deltaSize = 0;
+		shard.compactions++;
+	}
+
+	// compact when the delta gets to be an eighth of the frozen table; the rebuild is linear in the size
+	// of the shard, so this keeps the cost per training message constant (amortised).
+	static constexpr size_t MIN_COMPACTION_SIZE     = 4096;
+	static constexpr size_t COMPACTION_RATIO        = 8;
+
+	static bool should_compact(const Shard& shard)
+	{
+		return shard.deltaSize >= std::max(MIN_COMPACTION_SIZE, shard.frozen.words.size() / COMPACTION_RATIO);
+	}
+
+	uint32_t ContextTrie::parent(uint32_t node) const
+	{
+		auto n = this->baseParents.size();
+		return node < n ? this->baseParents[node] : this->parents[node - n];
+	}
+
+	uint32_t ContextTrie::word(uint32_t node) const
+	{
+		auto n = this->baseWords.size();
+		return node < n ? this->baseWords[node] : this->words[node - n];
+	}
+
+	std::optional<uint32_t> ContextTrie::find(uint32_t parent, uint64_t word) const
+	{
+		auto k = key(parent, word);
+		if(!this->baseSlotNodes.empty())
+		{
+			auto mask = this->baseSlotNodes.size() - 1;
+			for(size_t i = KeyHash()(k) & mask; this->baseSlotNodes[i] != EMPTY_SLOT; i = (i + 1) & mask)
+			{
+				if(this->baseSlotKeys[i] == k)
+					return this->baseSlotNodes[i];
+			}
+		}
+
+		if(auto it = this->children.find(k); it != this->children.end())
+			return it->second;
+
+		return { };
+	}
+
+	uint32_t ContextTrie::insert(uint32_t parent, uint64_t word)
+	{
+		if(auto node = this->find(parent, word); node.has_value())
+			return *node;
+
+		assert(word <= UINT32_MAX && this->size() < UINT32_MAX);
+
+		auto node = (uint32_t) this->size();
+		this->parents.push_back(parent);
+		this->words.push_back((uint32_t) word);
+		this->children.emplace(key(parent, word), node);
+
+		return node;
+	}
+
+	// calls fn(context, word) for every context (of up to MAX_PREFIX_LENGTH words) in the (already indexed)
+	// sentence, where `word` is the word that followed it. `get_child(parent, word)` returns the trie node
+	// of the child, or nothing; if it returns nothing, we stop and return false.
+	template <typename ChildFn, typename Fn>
+	static bool for_each_context(ikura::span<uint64_t> words, ChildFn&& get_child, Fn&& fn)
+	{
+		for(size_t i = 0; i + 1 < words.size(); i++)
+		{
+			// the context ending at word i is (words[i - k + 1] ... words[i]); walk down the trie from the most
+			// recent word, so each longer context is a child of the shorter one.
+			uint32_t node = ContextTrie::ROOT;
+			for(size_t k = 1; k <= MAX_PREFIX_LENGTH && k <= i + 1; k++)
+			{
+				// TODO: might want to make this case insensitive?
+				auto child = get_child(node, words[i + 1 - k]);
+				if(!child.has_value())
+					return false;
+
+				node = *child;
+				fn(node, words[i + 1]);
+			}
+		}
+
+		return true;
+	}
+
+	static std::vector<uint64_t> resolve_sentence(MarkovModel& markov, const std::vector<std::pair<ikura::str_view, bool>>& word_arr)
+	{
+		std::vector<uint64_t> word_indices;
+		word_indices.reserve(word_arr.size() + 2);
+
+		// most of the time every word is already known, so try with just a read lock first; only
+		// take the write lock if we actually need to add a new word.
+		bool all_known = markov.vocab.map_read([&](auto& vocab) -> bool {
+			word_indices.push_back(IDX_START_MARKER);
+			for(const auto& [ w, e ] : word_arr)
+			{
+				if(auto idx = find_word_index(&vocab, w, e); idx.has_value())
+					word_indices.push_back(*idx);
+
+				else
+					return false;
+			}
+
+			word_indices.push_back(IDX_END_MARKER);
+			return true;
+		});
+
+		if(!all_known)
+		{
+			word_indices.clear();
+			markov.vocab.perform_write([&](auto& vocab) {
+				word_indices.push_back(IDX_START_MARKER);
+				for(const auto& [ w, e ] : word_arr)
+					word_indices.push_back(get_word_index(&vocab, w, e));
+
+				word_indices.push_back(IDX_END_MARKER);
+			});
+		}
+
+		return word_indices;
+	}
+
+	static void train_sentence(MarkovModel& markov, const MarkovModel* sibling, ikura::span<uint64_t> word_indices)
+	{
+		// like the words, most contexts are already in the trie, so try with a read lock first.
+		std::vector<std::pair<uint32_t, uint64_t>> contexts;
+		bool all_found = markov.trie.map_read([&](auto& trie) -> bool {
+			return for_each_context(word_indices, [&trie](uint32_t parent, uint64_t word) {
+				return trie.find(parent, word);
+			}, [&contexts](uint32_t node, uint64_t word) {
+				contexts.emplace_back(node, word);
+			});
+		});
+
+		if(!all_found)
+		{
+			contexts.clear();
+			markov.trie.perform_write([&](auto& trie) {
+				for_each_context(word_indices, [&trie](uint32_t parent, uint64_t word) -> std::optional<uint32_t> {
+					return trie.insert(parent, word);
+				}, [&contexts](uint32_t node, uint64_t word) {
+					contexts.emplace_back(node, word);
+				});
+			});
+		}
+
+		for(const auto& ctx : contexts)
+		{
+			auto context = ctx.first;
+			auto the_word = ctx.second;
+
+			// only lock the shard that this context lives in.
+			markov.shard(context).perform_write([&](auto& shard) {
+				shard.delta[context].add(the_word, 1);
+				shard.deltaSize += 1;
+
+				if(!should_compact(shard))
+					return;
+
+				// if we're catching up to the sibling, it did exactly this compaction at exactly this point,
+				// so we can just share its table instead of building the same one again.
+				bool adopted = sibling && sibling->shard(context).map_read([&shard](auto& other) -> bool {
+					if(other.compactions != shard.compactions + 1)
+						return false;
+
+					shard.frozen = other.frozen;
+					shard.delta = { };
+					shard.deltaSize = 0;
+					shard.compactions++;
+					return true;
+				});
+
+				if(!adopted)
+					compact_shard(shard);
+			});
+		}
+
+		markov.dirty = true;
+	}
+
+	static void process_one(ikura::str_view input, std::vector<ikura::relative_str> emote_idxs, uint64_t seq)
+	{
+		auto word_arr = split_words(input, emote_idxs);
+		if(should_discard(word_arr.size()))
+			return;
+
+		auto lk = std::unique_lock(Models.lock);
+		while(true)
+		{
+			if(Models.retraining && seq >= Models.retrainingFrom)
 			{
-				State.retrainingCompleted++;
-				if(State.retrainingCompleted == State.retrainingTotalSize)
-				{
-					lg::log("markov", "retraining complete");
-					State.retrainingTotalSize = 0;
-					State.retrainingCompleted = 0;
-				}
+				auto indices = resolve_sentence(*Models.retraining, word_arr);
+				train_sentence(*Models.retraining, nullptr, indices);
+				return;
 			}
-		}
 
-		lg::log("markov", "worker thread exited");
-	}
+			// the spare was published up until just now, so wait for everyone that was using it to finish. nobody
+			// new can get it, so once the handle is gone, it's ours. this can take a while (eg. if the snapshot is
+			// being written), so don't hold the lock, since other things (like retrain) need it.
+			if(Models.lagging.empty() || Models.retired.expired())
+				break;
 
-	void init()
-	{
-		State.worker = std::thread(worker_thread);
-	}
+			Models.released.set_quiet(false);
+			if(Models.retired.expired())
+				break;
 
-	void reset()
-	{
-		lg::log("markov", "resetting model");
-		markovModel().perform_write([](auto& markov) {
-			markov.table.clear();
-			markov.wordList.clear();
-			markov.wordIndices.clear();
+			lk.unlock();
+			Models.released.wait(true);
+			lk.lock();
+		}
 
-			initialise_model(&markov);
-		});
-	}
+		catch_up();
 
-	double retrainingProgress()
-	{
-		if(State.retrainingTotalSize == 0)
-			return 1.0;
+		auto indices = resolve_sentence(*Models.spare, word_arr);
+		train_sentence(*Models.spare, nullptr, indices);
 
-		return (double) State.retrainingCompleted / (double) State.retrainingTotalSize;
+		Models.pending.push_back(std::move(indices));
 	}
 
-	void retrain()
-	{
-		lg::log("markov", "retraining model ({})...", State.retrainingTotalSize);
 
-		reset();
 
-		// copy out the thing, so we don't do a lot of processing while
-		// holding the lock. besides these are string_views, so they're lightweight.
-		std::vector<std::tuple<ikura::str_view, std::vector<ikura::relative_str>, ikura::str_view>> twitchInputs;
-		std::vector<std::pair<ikura::str_view, std::vector<ikura::relative_str>>> discordInputs;
 
-		database().perform_read([&twitchInputs, &discordInputs](auto& db) {
-			auto& tmsgs = db.twitchData.messageLog.messages;
-			auto& dmsgs = db.discordData.messageLog.messages;
 
-			for(auto& msg : tmsgs)
-			{
-				// ignore commands
-				if(msg.isCommand)
-					continue;
 
-				// also, forcibly ignore messages starting with $ or !
-				// to ignore commands directed at other bots.
-				auto txt = msg.message.get(db.messageData.data());
-				if(txt.find('!') == 0 || txt.find('$') == 0)
-					continue;
 
-				twitchInputs.emplace_back(txt, msg.emotePositions, msg.channel);
-			}
+	// retraining is done in two phases. first, every thread pulls batches of messages out of the log, splits
+	// them, and counts the n-grams into its own partial tables (one per shard) -- the only shared state here
+	// is the vocabulary, and only when we see a word for the first time. then, the partial tables are merged
+	// into the model, one shard at a time (so the shards can be merged in parallel as well).
+	static constexpr size_t RETRAIN_BATCH_SIZE = 2048;
 
-			for(auto& msg : dmsgs)
-			{
-				if(msg.isCommand)
-					continue;
+	using PartialTable = tsl::robin_map<uint64_t, tsl::robin_map<uint64_t, uint64_t>>;
 
-				auto txt = msg.message.get(db.messageData.data());
-				if(txt.find('!') == 0 || txt.find('$') == 0)
-					continue;
+	struct RetrainWorker
+	{
+		RetrainWorker(MarkovModel* model, size_t numTwitch) : model(model), numTwitch(numTwitch) { }
 
-				discordInputs.emplace_back(txt, msg.emotePositions);
-			}
-		});
+		// the (unpublished) model that we're building.
+		MarkovModel* model;
 
-		for(auto& [ msg, existing_emotes, chan ] : twitchInputs)
-		{
-			// get any new emotes
-			auto& tmp = msg;
-			auto emotes = zfu::map(twitch::getExternalEmotePositions(msg, chan), [&tmp](const auto& em) -> auto {
-				return ikura::relative_str(em.data() - tmp.data(), em.size());
-			}) + existing_emotes;
+		// the messages are numbered with the twitch ones first, then the discord ones. the logs keep growing while
+		// we retrain, so where one ends has to be remembered.
+		size_t numTwitch;
 
-			std::sort(emotes.begin(), emotes.end(), [](auto& a, auto& b) -> bool {
-				return a.start() < b.start();
-			});
+		// the partial counts, split by shard.
+		PartialTable tables[MarkovModel::NUM_SHARDS];
 
-			emotes.erase(std::unique(emotes.begin(), emotes.end(), [](auto& a, auto& b) -> bool {
-				return a.start() == b.start() && a.size() == b.size();
-			}), emotes.end());
+		// thread-local cache of word -> index, so we don't need to touch the vocabulary lock for
+		// every word. emotes and normal words are kept separately, just like the vocabulary.
+		ikura::string_map<uint64_t> wordCache;
+		ikura::string_map<uint64_t> emoteCache;
 
-			State.retrainingTotalSize++;
-			State.queue.push_quiet(QueuedMsg::retrain(msg.str(), emotes));
-		}
+		// same thing for the trie; nodes never move once they're created, so this is always valid.
+		tsl::robin_map<uint64_t, uint32_t, ContextTrie::KeyHash> nodeCache;
 
-		for(auto& [ msg, emotes ] : discordInputs)
+		// we can't hold the database lock while processing (backends need the write lock to log
+		// messages), so each batch of messages is copied out into this (reused) buffer. it's one
+		// memcpy per message, instead of a fresh std::string and a trip through the queue.
+		struct Input
 		{
-			State.retrainingTotalSize++;
-			State.queue.push_quiet(QueuedMsg::retrain(msg.str(), emotes));
-		}
+			ikura::relative_str text;
+			ikura::relative_str channel;    // empty if not twitch
+			size_t firstEmote;
+			size_t numEmotes;
+		};
 
-		State.queue.notify_pending();
-	}
+		std::string text;
+		std::vector<Input> inputs;
+		std::vector<ikura::relative_str> emotes;
+	};
 
-	void shutdown()
+	static void resolve_words(RetrainWorker& wk, const std::vector<std::pair<ikura::str_view, bool>>& word_arr,
+		std::vector<uint64_t>& out)
 	{
-		// push an empty string to terminate.
-		State.queue.push(QueuedMsg::stop());
+		out.clear();
+		out.push_back(IDX_START_MARKER);
 
-		// wait for it to stop.
-		if(State.worker.joinable())
-			State.worker.join();
-	}
+		bool missing = false;
+		for(const auto& [ w, e ] : word_arr)
+		{
+			auto& cache = (e ? wk.emoteCache : wk.wordCache);
+			if(auto it = cache.find(w); it != cache.end())
+			{
+				out.push_back(it->second);
+			}
+			else
+			{
+				out.push_back(IDX_END_MARKER);
+				missing = true;
+			}
+		}
 
-	void process(ikura::str_view input, const std::vector<ikura::relative_str>& emote_idxs)
-	{
-		State.queue.emplace(input.str(), emote_idxs);
-	}
+		if(missing)
+		{
+			wk.model->vocab.perform_write([&](auto& vocab) {
+				for(size_t i = 0; i < word_arr.size(); i++)
+				{
+					if(out[i + 1] != IDX_END_MARKER)
+						continue;
 
-	static bool should_split(char c)
-	{
-		return c == '.' || c == ',' || c == '!' || c == '?';
+					auto& [ w, e ] = word_arr[i];
+					out[i + 1] = get_word_index(&vocab, w, e);
+					(e ? wk.emoteCache : wk.wordCache)[w] = out[i + 1];
+				}
+			});
+		}
+
+		out.push_back(IDX_END_MARKER);
 	}
 
-	static uint64_t get_word_index(MarkovModel* markov, ikura::str_view sv, bool is_emote)
+	static void resolve_contexts(RetrainWorker& wk, ikura::span<uint64_t> word_indices, std::vector<std::pair<uint32_t, uint64_t>>& out)
 	{
-		// this is a little hacky, but... we know that words cannot contain spaces (because we
-		// always strip them) -- so, we mark emotes by a leading space. this way, they won't
-		// show up in the wordIndices table like normal words.
-		auto word = sv.str();
-		if(is_emote)
-			word = " " + word;
+		out.clear();
 
-		if(auto it = markov->wordIndices.find(word); it != markov->wordIndices.end())
-			return it->second;
+		auto collect = [&out](uint32_t node, uint64_t word) {
+			out.emplace_back(node, word);
+		};
 
-		auto idx = (uint64_t) markov->wordList.size();
+		auto found = for_each_context(word_indices, [&wk](uint32_t parent, uint64_t word) -> std::optional<uint32_t> {
+			if(auto it = wk.nodeCache.find(ContextTrie::key(parent, word)); it != wk.nodeCache.end())
+				return it->second;
 
-		// use the original (without-space) thing here, and flag appropriately.
-		markov->wordList.emplace_back(sv.str(), is_emote ? WORD_FLAG_EMOTE : 0);
+			return { };
+		}, collect);
 
-		// but for the wordIndices, use the spaced one.
-		markov->wordIndices[word] = idx;
+		if(found)
+			return;
 
-		return idx;
-	}
+		out.clear();
+		wk.model->trie.perform_write([&](auto& trie) {
+			for_each_context(word_indices, [&wk, &trie](uint32_t parent, uint64_t word) -> std::optional<uint32_t> {
+				auto& node = wk.nodeCache[ContextTrie::key(parent, word)];
+				if(node == ContextTrie::ROOT)
+					node = trie.insert(parent, word);
 
-	static size_t is_ignored_sequence(ikura::str_view str)
-	{
-		return unicode::is_category(str, {
-			UTF8PROC_CATEGORY_CN, UTF8PROC_CATEGORY_MN, UTF8PROC_CATEGORY_MC, UTF8PROC_CATEGORY_ME, UTF8PROC_CATEGORY_ZL,
-			UTF8PROC_CATEGORY_ZP, UTF8PROC_CATEGORY_CC, UTF8PROC_CATEGORY_CF, UTF8PROC_CATEGORY_CS, UTF8PROC_CATEGORY_CO,
-			UTF8PROC_CATEGORY_SO
+				return node;
+			}, collect);
 		});
 	}
 
-	static void process_one(ikura::str_view input, std::vector<ikura::relative_str> _emote_idxs)
+	// copies the messages in [begin, end) out of the log into the worker's buffer.
+	static void fetch_batch(RetrainWorker& wk, size_t begin, size_t end)
 	{
-		input = input.trim();
-		if(input.empty())
-			return;
+		wk.text.clear();
+		wk.inputs.clear();
+		wk.emotes.clear();
 
-		auto emote_idxs = ikura::span(_emote_idxs);
+		auto add = [&wk](ikura::str_view txt, ikura::str_view chan, ikura::span<ikura::relative_str> emotes) {
 
-		// first split by words and punctuation. consecutive puncutation is lumped together.
-		std::vector<std::pair<ikura::str_view, bool>> word_arr;
-		{
-			assert(input[0] != ' ' && input[0] != '\t');
+			// also, forcibly ignore messages starting with $ or !
+			// to ignore commands directed at other bots.
+			if(txt.find('!') == 0 || txt.find('$') == 0)
+				return;
+
+			RetrainWorker::Input input;
+			input.text = ikura::relative_str(wk.text.size(), txt.size());
+			wk.text.append(txt.data(), txt.size());
 
-			size_t end = 0;
-			size_t cur_idx = 0;
-			bool is_emote = false;
+			input.channel = ikura::relative_str(wk.text.size(), chan.size());
+			wk.text.append(chan.data(), chan.size());
 
-			auto advance = [&]() {
-				input.remove_prefix(end);
+			input.firstEmote = wk.emotes.size();
+			input.numEmotes = emotes.size();
+			wk.emotes.insert(wk.emotes.end(), emotes.begin(), emotes.end());
+
+			wk.inputs.push_back(input);
+		};
 
-				auto tmp = input;
-				input = input.trim_front();
-				cur_idx += (tmp.size() - input.size());
-				end = 0;
-			};
+		db::read({ db::Section::Twitch, db::Section::Discord, db::Section::Messages }, [&](auto& db) {
+			auto& tlog = db.twitchData.messageLog;
+			auto& dlog = db.discordData.messageLog;
+			auto msgs = db::MessageDB::Cursor(db.messageData);
 
-			while(end < input.size())
+			for(size_t i = begin; i < end; i++)
 			{
-				if(auto c = input[end]; !is_emote && (c == ' ' || c == '\t'))
+				if(i < wk.numTwitch)
 				{
-					word_arr.emplace_back(input.take(end), false);
-					advance();
+					// ignore commands
+					if(!tlog.isCommand(i))
+						add(msgs.get(tlog.contents[i]), tlog.strings.get(tlog.channels[i]), tlog.getEmotePositions(i));
 				}
-				// this weird condition is to not split constructs like "a?b" and "a.b.c", to handle URLs properly.
-				else if(should_split(c) && (end + 1 == input.size() || input[end + 1] == ' '))
+				else if(auto k = i - wk.numTwitch; k < dlog.size())
 				{
-					word_arr.emplace_back(input.take(end), false);
-					advance();
+					if(!dlog.isCommand(k))
+						add(msgs.get(dlog.contents[k]), "", dlog.getEmotePositions(k));
+				}
+			}
+		});
+	}
 
-					while(end < input.size() && should_split(input[end]))
-						end++, cur_idx++;
+	static void process_batch(RetrainWorker& wk)
+	{
+		std::vector<uint64_t> word_indices;
+		std::vector<std::pair<uint32_t, uint64_t>> contexts;
+		std::vector<ikura::relative_str> emotes;
 
-					word_arr.emplace_back(input.take(end), false);
-					advance();
-				}
-				else if(auto k = is_ignored_sequence(input); k > 0)
-				{
-					input.remove_prefix(k);
-					cur_idx += k;
-				}
-				else
-				{
-					if(emote_idxs.size() > 0)
-					{
-						if(is_emote && emote_idxs[0].end_excl() == cur_idx)
-						{
-							emote_idxs.remove_prefix(1);
+		for(const auto& input : wk.inputs)
+		{
+			auto msg = input.text.get(wk.text);
+			auto chan = input.channel.get(wk.text);
 
-							// forcefully add a word
-							word_arr.emplace_back(input.take(end), true);
-							advance();
+			emotes.assign(wk.emotes.begin() + input.firstEmote, wk.emotes.begin() + input.firstEmote + input.numEmotes);
 
-							is_emote = false;
-							continue;
-						}
-						else
-						{
-							if(emote_idxs[0].start() == cur_idx)
-								is_emote = true;
+			// get any new emotes (only twitch has these)
+			if(!chan.empty())
+			{
+				for(auto em : twitch::getExternalEmotePositions(msg, chan))
+					emotes.emplace_back(em.data() - msg.data(), em.size());
 
-							else if(!is_emote && emote_idxs[0].start() < cur_idx)
-								emote_idxs.remove_prefix(1);
-						}
-					}
+				std::sort(emotes.begin(), emotes.end(), [](auto& a, auto& b) -> bool {
+					return a.start() < b.start();
+				});
 
-					end++;
-					cur_idx++;
-				}
+				emotes.erase(std::unique(emotes.begin(), emotes.end(), [](auto& a, auto& b) -> bool {
+					return a.start() == b.start() && a.size() == b.size();
+				}), emotes.end());
 			}
 
-			if(end > 0)
-			{
-				word_arr.emplace_back(input.take(end), is_emote);
-			}
+			auto word_arr = split_words(msg, emotes);
+			if(should_discard(word_arr.size()))
+				continue;
+
+			resolve_words(wk, word_arr, word_indices);
+			resolve_contexts(wk, word_indices, contexts);
+
+			for(const auto& [ context, the_word ] : contexts)
+				wk.tables[context % MarkovModel::NUM_SHARDS][context][the_word] += 1;
 		}
+	}
+
+	static void retrain_worker(RetrainWorker* wk, std::atomic<size_t>* next, size_t total)
+	{
+		while(true)
+		{
+			auto begin = next->fetch_add(RETRAIN_BATCH_SIZE);
+			if(begin >= total)
+				break;
 
+			auto end = std::min(begin + RETRAIN_BATCH_SIZE, total);
 
-		// filter out most of the shorter responses.
-		if(word_arr.size() < MIN_INPUT_LENGTH)
-			return;
+			fetch_batch(*wk, begin, end);
+			process_batch(*wk);
+
+			State.retrainingCompleted += (end - begin);
+		}
+	}
 
-		else if(word_arr.size() < GOOD_INPUT_LENGTH)
+	static void merge_worker(MarkovModel* model, std::vector<std::unique_ptr<RetrainWorker>>* workers, std::atomic<size_t>* next)
+	{
+		size_t s = 0;
+		while((s = next->fetch_add(1)) < MarkovModel::NUM_SHARDS)
 		{
-			auto x = random::get<uint64_t>(0, 100);
-			if(x <= DISCARD_CHANCE_PERCENT)
-				return;
+			model->shards[s].perform_write([&](auto& shard) {
+				for(auto& wk : *workers)
+				{
+					for(const auto& [ context, counts ] : wk->tables[s])
+					{
+						auto& wordlist = shard.delta[context];
+						for(const auto& [ word, freq ] : counts)
+							wordlist.add(word, freq);
+
+						shard.deltaSize += counts.size();
+					}
+
+					wk->tables[s].clear();
+				}
+
+				compact_shard(shard);
+			});
+
+			model->dirty = true;
+			State.retrainingCompleted++;
 		}
+	}
 
+	static void retrain_model(std::shared_ptr<MarkovModel> model, size_t num_twitch, size_t num_discord)
+	{
+		auto t = timer();
+		auto num_threads = std::max((size_t) 1, (size_t) std::thread::hardware_concurrency());
+		auto num_messages = num_twitch + num_discord;
 
+		std::vector<std::unique_ptr<RetrainWorker>> workers;
+		for(size_t i = 0; i < num_threads; i++)
+			workers.push_back(std::make_unique<RetrainWorker>(model.get(), num_twitch));
 
-		auto word_indices = markovModel().map_write([&](auto& markov) -> std::vector<uint64_t> {
-			std::vector<uint64_t> ret;
-			ret.push_back(IDX_START_MARKER);
+		std::vector<std::thread> threads;
 
-			for(const auto& [ w, e ] : word_arr)
-				ret.push_back(get_word_index(&markov, w, e));
+		// map...
+		std::atomic<size_t> next_msg = 0;
+		for(size_t i = 0; i < num_threads; i++)
+			threads.emplace_back(retrain_worker, workers[i].get(), &next_msg, num_messages);
 
-			ret.push_back(IDX_END_MARKER);
-			return ret;
-		});
+		for(auto& thr : threads)
+			thr.join();
 
-		// ok, words are now split.
-		auto words = ikura::span(word_indices);
-		for(size_t i = 0; i + 1 < words.size(); i++)
-		{
-			for(size_t k = 1; k <= MAX_PREFIX_LENGTH && i + k < words.size(); k++)
-			{
-				// TODO: might want to make this case insensitive?
-				auto the_word = words[i + k];
-				auto prefix = words.drop(i).take(k);
-				auto prefix_hash = hash_prefix(prefix);
+		threads.clear();
 
-				// just take a big lock...
-				markovModel().perform_write([&](auto& markov) -> decltype(auto) {
+		// ...reduce.
+		std::atomic<size_t> next_shard = 0;
+		for(size_t i = 0; i < num_threads; i++)
+			threads.emplace_back(merge_worker, model.get(), &workers, &next_shard);
 
-					WordList* wordlist = nullptr;
+		for(auto& thr : threads)
+			thr.join();
 
-					if(auto it = markov.table.find(prefix_hash); it == markov.table.end())
-						wordlist = &markov.table.emplace(prefix_hash, WordList()).first->second;
+		// anything that came in while we were retraining went into the new model as well, so it's
+		// completely up to date.
+		{
+			std::lock_guard lk(Models.lock);
+			Models.retraining = nullptr;
+			install_locked(std::move(model));
+		}
 
-					else
-						wordlist = &it->second;
+		lg::log("markov", "retraining complete ({} messages, {} threads, {.2f} ms)", num_messages, num_threads, t.measure());
 
-					wordlist->totalFrequency += 1;
-					if(auto it = wordlist->globalIndexMap.find(the_word); it != wordlist->globalIndexMap.end())
-					{
-						wordlist->words[it->second].frequency++;
-					}
-					else
-					{
-						auto idx = wordlist->words.size();
-						wordlist->words.emplace_back(the_word, 1);
-						wordlist->globalIndexMap.emplace(the_word, idx);
-					}
-				});
-			}
+		State.retrainingTotalSize = 0;
+		State.retrainingCompleted = 0;
+	}
+
+	void retrain()
+	{
+		// claim it first, so two of these can't both get past here. the shards count towards the progress as
+		// well (since merging takes a while), so this is never 0 while we're retraining.
+		size_t idle = 0;
+		if(!State.retrainingTotalSize.compare_exchange_strong(idle, MarkovModel::NUM_SHARDS))
+		{
+			lg::warn("markov", "retraining already in progress");
+			return;
 		}
+
+		State.retrainingCompleted = 0;
+
+		if(State.retrainer.joinable())
+			State.retrainer.join();
+
+		// the new model is built off to the side, and the current one stays in use until it's done. messages
+		// logged after this point will be trained into the new one by the worker thread, so we only need to
+		// look at the ones that are already here.
+		auto model = new_model();
+		model->dirty = true;
+
+		// the backends queue a message right after they log it, with the log still locked, so anything with a
+		// sequence number from here on isn't in the count; the worker trains those into the new model. the ones
+		// before it are in the count (even if they're still in the queue), so the worker leaves them out. the
+		// count and the sequence number have to be taken together, with the logs locked, so that nothing can be
+		// logged in between.
+		auto [ num_twitch, num_discord ] = db::read({ db::Section::Twitch, db::Section::Discord },
+			[&model](auto& db) -> std::pair<size_t, size_t> {
+				std::lock_guard lk(Models.lock);
+				Models.retraining = model;
+				Models.retrainingFrom = State.nextSeq;
+
+				return { db.twitchData.messageLog.size(), db.discordData.messageLog.size() };
+			});
+
+		lg::log("markov", "retraining model ({} messages)...", num_twitch + num_discord);
+
+		State.retrainingTotalSize = num_twitch + num_discord + MarkovModel::NUM_SHARDS;
+		State.retrainer = std::thread(retrain_model, std::move(model), num_twitch, num_discord);
 	}
 
 	struct rd_state_t { rd_state_t() : mersenne(std::random_device()()) { } std::mt19937 mersenne; };
 
 	static_assert(MAX_PREFIX_LENGTH == 3, "unsupported prefix length");
-	static auto rd_distr = std::discrete_distribution<>({ 0.55, 0.30, 0.15 });
-	static auto rd_state = rd_state_t();
 
-	static uint64_t generate_one(ikura::span<uint64_t> prefix)
+	// generation can now run on several threads at once, so these can't be shared.
+	static thread_local auto rd_distr = std::discrete_distribution<>({ 0.55, 0.30, 0.15 });
+	static thread_local auto rd_state = rd_state_t();
+
+	static std::string get_word_string(const MarkovModel& markov, uint64_t idx)
+	{
+		return markov.vocab.map_read([idx](auto& vocab) -> std::string {
+			return idx < vocab.size() ? vocab.text(idx).str() : "";
+		});
+	}
+
+	static uint64_t generate_one(const MarkovModel& markov, ikura::span<uint64_t> prefix)
 	{
 		if(prefix.empty())
 			return IDX_END_MARKER;
@@ -480,44 +1545,82 @@ namespace ikura::markov
 
 		// lg::log("markov", "prefix len = {.3f} / {}", prb, pfl);
 
-		return markovModel().map_read([&](auto& markov) -> uint64_t {
-			while(!prefix.empty())
+		// find the longest context that we know about, then collect its ancestors -- these are the
+		// shorter contexts that we back off to, longest first.
+		uint32_t contexts[MAX_PREFIX_LENGTH] = { };
+		size_t num_contexts = markov.trie.map_read([&prefix, &contexts](auto& trie) -> size_t {
+			auto node = ContextTrie::ROOT;
+			for(size_t i = prefix.size(); i-- > 0; )
 			{
-				auto prefix_hash = hash_prefix(prefix);
+				if(auto child = trie.find(node, prefix[i]); child.has_value())
+					node = *child;
 
-				// get the frequency
-				if(auto it = markov.table.find(prefix_hash); it != markov.table.end())
-				{
-					const WordList& wl = it->second;
-					auto selection = random::get<size_t>(0, wl.totalFrequency - 1);
+				else
+					break;
+			}
 
-					// find the word.
-					for(const auto& word : wl.words)
-					{
-						if(word.frequency > selection)
-						{
-							auto prf = zfu::listToString(prefix, [&](uint64_t w) {
-								return markov.wordList[w].word;
-							}, false);
+			size_t n = 0;
+			for(; node != ContextTrie::ROOT && n < MAX_PREFIX_LENGTH; node = trie.parent(node))
+				contexts[n++] = node;
+
+			return n;
+		});
 
-							lg::dbglog("markov", "{ {} } -> '{}'  --  ({}/{} [{.2f}%])",
-								prf, markov.wordList[word.index].word, word.frequency,
-								wl.totalFrequency, 100.0 * ((double) word.frequency / (double) wl.totalFrequency));
+		for(size_t i = 0; i < num_contexts; i++)
+		{
+			auto context = contexts[i];
 
-							return word.index;
-						}
+			uint64_t frequency = 0;
+			uint64_t totalFrequency = 0;
 
-						selection -= word.frequency;
-					}
+			auto found = markov.shard(context).map_read([&](auto& shard) -> std::optional<uint64_t> {
+
+				auto entry = shard.frozen.find(context);
+				auto it = shard.delta.find(context);
+
+				auto frozen_total = entry.has_value() ? shard.frozen.total(*entry) : 0;
+				auto delta_total = it != shard.delta.end() ? it->second.totalFrequency : 0;
+
+				totalFrequency = frozen_total + delta_total;
+				if(totalFrequency == 0)
+					return { };
+
+				// as if the delta's words were laid out after the frozen ones.
+				auto selection = random::get<uint64_t>(0, totalFrequency - 1);
+				if(selection < frozen_total)
+				{
+					auto [ word, freq ] = shard.frozen.select(*entry, selection);
+					frequency = freq;
+					return word;
+				}
+				else
+				{
+					auto& word = it->second.select(selection - frozen_total);
+					frequency = word.frequency;
+					return word.index;
+				}
+			});
+
+			if(found.has_value())
+			{
+				// don't bother touching the vocabulary lock unless we're actually going to print something.
+				if(lg::isDebugEnabled())
+				{
+					auto prf = zfu::listToString(prefix.take_last(num_contexts - i), [&markov](uint64_t w) {
+						return get_word_string(markov, w);
+					}, false);
+
+					lg::dbglog("markov", "{ {} } -> '{}'  --  ({}/{} [{.2f}%])",
+						prf, get_word_string(markov, *found), frequency,
+						totalFrequency, 100.0 * ((double) frequency / (double) totalFrequency));
 				}
 
-				// try a shorter prefix.
-				prefix.remove_prefix(1);
+				return *found;
 			}
+		}
 
-			// ran out.
-			return IDX_END_MARKER;
-		});
+		// ran out.
+		return IDX_END_MARKER;
 	}
 
 	Message generateMessage(const std::vector<std::string>& seed)
@@ -527,6 +1630,10 @@ namespace ikura::markov
 		size_t retries    = config::markov::getConfig().maxRetries;
 		size_t _retries   = retries;
 
+		// everything is generated from the same model, even if a new one gets published halfway.
+		auto model = markovModel();
+		auto& markov = *model;
+
 		std::vector<uint64_t> output;
 
 		do {
@@ -535,11 +1642,11 @@ namespace ikura::markov
 			if(!seed.empty())
 			{
 				// get the word
-				markovModel().perform_read([&](auto& markov) {
+				markov.vocab.perform_read([&](auto& vocab) {
 					for(const auto& s : seed)
 					{
-						if(auto it = markov.wordIndices.find(s); it != markov.wordIndices.end())
-							output.push_back(it->second);
+						if(auto idx = vocab.find(s, /* emote: */ false); idx.has_value())
+							output.push_back(*idx);
 
 						else
 							lg::warn("markov", "ignoring unseen seed word '{}'", s);
@@ -553,7 +1660,7 @@ namespace ikura::markov
 
 			while(output.size() < max_length)
 			{
-				auto word = generate_one(ikura::span(output));
+				auto word = generate_one(markov, ikura::span(output));
 				if(word == IDX_END_MARKER)
 					break;
 
@@ -570,11 +1677,12 @@ namespace ikura::markov
 			lg::warn("markov", "failed to generate {} markov words after {} attempts", min_length, _retries);
 
 
-		return markovModel().map_read([&output](auto& markov) -> Message {
+		return markov.vocab.map_read([&output](auto& vocab) -> Message {
 			Message msg;
 			for(size_t i = 0; i < output.size(); i++)
 			{
-				auto [ word, em ] = markov.wordList[output[i]];
+				auto word = vocab.text(output[i]).str();
+				auto em = vocab.get(output[i]).flags;
 				if(word.empty())
 					continue;
 
@@ -659,44 +1767,44 @@ namespace ikura::markov
 		if(!rd.read(&ret.globalIndexMap))
 			return { };
 
+		ret.rebuildCumulative();
+
 		monkaS += t.measure();
 		return ret;
 	}
 
-	void DBWord::serialise(Buffer& buf) const
+	static bool read_vocab(serialise::Reader& rd, Vocabulary& vocab)
 	{
-		auto wr = serialise::Writer(buf);
-		wr.tag(TYPE_TAG);
+		if(auto t = rd.tag(); t != serialise::TAG_STL_VECTOR)
+			return lg::error_b("db", "type tag mismatch (found '{}', expected '{}')", t, serialise::TAG_STL_VECTOR);
 
-		wr.write(this->word);
-		wr.write(this->flags);
-	}
+		auto count = rd.read<uint64_t>();
+		if(!count.has_value())
+			return false;
 
-	std::optional<DBWord> DBWord::deserialise(Span& buf)
-	{
-		auto rd = serialise::Reader(buf);
-		if(auto t = rd.tag(); t != TYPE_TAG)
-			return lg::error_o("db", "type tag mismatch (found '{}', expected '{}')", t, TYPE_TAG);
+		vocab.wordList.reserve(count.value());
+		for(size_t i = 0; i < count.value(); i++)
+		{
+			if(auto t = rd.tag(); t != DBWord::TYPE_TAG)
+				return lg::error_b("db", "type tag mismatch (found '{}', expected '{}')", t, DBWord::TYPE_TAG);
 
-		DBWord ret;
-		if(!rd.read(&ret.word))
-			return { };
+			auto word = rd.read<std::string>();
+			auto flags = rd.read<uint64_t>();
+			if(!word.has_value() || !flags.has_value())
+				return false;
 
-		if(!rd.read(&ret.flags))
-			return { };
+			// the markers are always the first two, and they don't get indexed.
+			vocab.add(word.value(), flags.value(), /* indexed: */ i > IDX_END_MARKER);
+		}
 
-		return ret;
+		return true;
 	}
 
 	void MarkovDB::serialise(Buffer& buf) const
 	{
+		// the model itself lives in the snapshot (see snapshot.cpp), which is written separately.
 		auto wr = serialise::Writer(buf);
 		wr.tag(TYPE_TAG);
-
-		markovModel().perform_read([&wr](auto& markov) {
-			wr.write(markov.table);
-			wr.write(markov.wordList);
-		});
 	}
 
 	// fucking nonsense.
@@ -725,40 +1833,127 @@ namespace ikura::markov
 		if(auto t = rd.tag(); t != TYPE_TAG)
 			return lg::error_o("db", "type tag mismatch (found '{}', expected '{}')", t, TYPE_TAG);
 
-		MarkovModel ret;
+		// since version 32, the model is stored in its own file, which we just map.
+		if(db::getVersion() >= 32)
+		{
+			if(!load_snapshot())
+			{
+				lg::warn("markov", "could not load the model snapshot, it will be retrained");
+				State.retrainOnInit = true;
+				reset();
+			}
+
+			return MarkovDB();
+		}
+
+		std::map<uint64_t, WordList> table;
+		ContextTrie trie;
 
-		if(db::getVersion() <= 25)
+		// before version 31, the table was keyed by a hash of the prefix instead of a trie node. there's no
+		// way to get the words back out of the hash, so read (and throw away) the old table, and retrain
+		// from the message log once everything is loaded. the vocabulary is still fine, so keep that.
+		bool legacy = db::getVersion() <= 30;
+		if(legacy)
 		{
-			tsl::robin_map<std::vector<uint64_t>, WordList, hash_span<uint64_t>, equal_span<uint64_t>> map;
-			if(!rd.read(&map))
-				return { };
+			if(db::getVersion() <= 25)
+			{
+				tsl::robin_map<std::vector<uint64_t>, WordList, hash_span<uint64_t>, equal_span<uint64_t>> map;
+				if(!rd.read(&map))
+					return { };
+			}
+			else
+			{
+				if(!rd.read(&table))
+					return { };
+			}
 
-			for(auto& [ pref, wl ] : map)
-				ret.table[hash_prefix(pref)] = std::move(wl);
+			table.clear();
 		}
 		else
 		{
-			auto t = timer();
-			if(!rd.read(&ret.table))
+			std::vector<uint32_t> parents;
+			std::vector<uint32_t> words;
+
+			if(!rd.read(&parents))
+				return { };
+
+			if(!rd.read(&words))
+				return { };
+
+			if(parents.empty() || parents.size() != words.size())
+				return lg::error_o("markov", "malformed context trie");
+
+			trie.parents = std::move(parents);
+			trie.words = std::move(words);
+
+			// parents always come before their children, so a bad parent is easy to spot.
+			for(uint32_t i = 1; i < trie.parents.size(); i++)
+			{
+				if(trie.parents[i] >= i)
+					return lg::error_o("markov", "malformed context trie (node {}, parent {})", i, trie.parents[i]);
+
+				trie.children.emplace(ContextTrie::key(trie.parents[i], trie.words[i]), i);
+			}
+
+			if(!rd.read(&table))
 				return { };
 		}
 
-		if(!rd.read(&ret.wordList))
-			return { };
+		// the vocabulary can't be moved (see above), so just read it in place. the index is rebuilt as
+		// we go, instead of reading it from disk, because that's dumb and we end up storing each word twice.
+		auto model = new_model();
+		auto& markov = *model;
 
-		// if we're empty, then set it up.
-		if(ret.wordList.empty())
-			initialise_model(&ret);
+		bool ok = markov.vocab.map_write([&rd](auto& vocab) -> bool {
+			vocab.clear();
+			if(!read_vocab(rd, vocab))
+				return false;
 
-		*markovModel().wlock().get() = std::move(ret);
+			// if we're empty, then set it up.
+			if(vocab.size() == 0)
+				initialise_vocab(&vocab);
 
-		// populate the wordIndices table, instead of reading from disk, because that's dumb
-		// and we end up storing each word twice.
-		markovModel().perform_write([](auto& markov) {
-			for(size_t i = IDX_END_MARKER + 1; i < markov.wordList.size(); i++)
-				markov.wordIndices[markov.wordList[i].word] = i;
+			return true;
 		});
 
+		if(!ok)
+			return { };
+
+		*markov.trie.wlock().get() = std::move(trie);
+
+		if(legacy)
+		{
+			lg::warn("markov", "model is from database version {}, it will be retrained", db::getVersion());
+			State.retrainOnInit = true;
+		}
+
+		// distribute the entries to their shards, then freeze them.
+		std::vector<std::pair<uint64_t, WordList>> loaded[MarkovModel::NUM_SHARDS];
+		while(!table.empty())
+		{
+			auto node = table.extract(table.begin());
+			loaded[node.key() % MarkovModel::NUM_SHARDS].emplace_back(node.key(), std::move(node.mapped()));
+		}
+
+		for(size_t i = 0; i < MarkovModel::NUM_SHARDS; i++)
+		{
+			markov.shards[i].perform_write([&](auto& shard) {
+				shard = Shard();
+				for(auto& [ k, wl ] : loaded[i])
+				{
+					shard.deltaSize += wl.words.size();
+					shard.delta.emplace(k, std::move(wl));
+				}
+
+				loaded[i].clear();
+				compact_shard(shard);
+			});
+		}
+
+		// there's no snapshot yet, so make sure one gets written.
+		markov.dirty = true;
+		install_model(std::move(model));
+
 		return MarkovDB();
 	}
 }
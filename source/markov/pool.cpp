@@ -0,0 +1,246 @@
+// pool.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "timer.h"
+#include "markov.h"
+#include "synchro.h"
+#include "markovmodel.h"
+
+// generating a message can take a while (especially if it has to retry to meet the minimum length), and
+// it happens on whatever thread received the command. so, keep a few messages generated ahead of time, and
+// hand those out instead. each seed gets its own pool (the unseeded one is the main one, for mentions),
+// which is topped up by a background thread whenever the model isn't busy.
+namespace ikura::markov
+{
+	constexpr size_t UNSEEDED_POOL_SIZE     = 32;
+	constexpr size_t SEEDED_POOL_SIZE       = 4;
+
+	// seeds are whatever people type, so only keep the most recently used ones.
+	constexpr size_t MAX_SEED_CLASSES       = 64;
+
+	struct SeedClass
+	{
+		std::vector<std::string> seed;
+		std::deque<Message> messages;
+
+		// when this was last asked for, so we know which ones to throw away.
+		uint64_t lastUsed = 0;
+
+		size_t capacity() const { return this->seed.empty() ? UNSEEDED_POOL_SIZE : SEEDED_POOL_SIZE; }
+	};
+
+	struct PoolState
+	{
+		// keyed by the seed words, joined with spaces. the unseeded class is just "".
+		ikura::string_map<SeedClass> classes;
+
+		// the model generation that the messages came from; if the model gets reset (eg. retraining),
+		// everything in here is stale.
+		uint64_t generation = 0;
+	};
+
+	static struct {
+		std::thread producer;
+		std::atomic<bool> stop = false;
+
+		// set when something was taken out of the pool (or we need to stop).
+		condvar<bool> wakeup;
+
+		Synchronised<PoolState> state;
+
+		std::atomic<uint64_t> hits = 0;
+		std::atomic<uint64_t> misses = 0;
+		std::atomic<uint64_t> refills = 0;
+		std::atomic<uint64_t> refillMicros = 0;
+	} Pool;
+
+	static std::string seed_key(const std::vector<std::string>& seed)
+	{
+		return util::join(seed, " ");
+	}
+
+	// the caller needs the write lock.
+	static void check_generation(PoolState& st)
+	{
+		auto gen = markovModel()->generation;
+		if(st.generation == gen)
+			return;
+
+		for(auto it = st.classes.begin(); it != st.classes.end(); ++it)
+			it.value().messages.clear();
+
+		st.generation = gen;
+	}
+
+	// finds the class that needs a message the most, returning its seed. unseeded always goes first.
+	static std::optional<std::vector<std::string>> next_refill()
+	{
+		return Pool.state.map_write([](auto& st) -> std::optional<std::vector<std::string>> {
+			check_generation(st);
+
+			const SeedClass* best = nullptr;
+			size_t deficit = 0;
+
+			for(const auto& [ k, cls ] : st.classes)
+			{
+				auto d = cls.capacity() - std::min(cls.capacity(), cls.messages.size());
+				if(d == 0)
+					continue;
+
+				if(cls.seed.empty())
+					return cls.seed;
+
+				if(d > deficit)
+					best = &cls, deficit = d;
+			}
+
+			if(best == nullptr)
+				return { };
+
+			return best->seed;
+		});
+	}
+
+	static void producer_thread()
+	{
+		while(!Pool.stop)
+		{
+			// don't compete with training (or retraining); we'll get woken up again when someone takes
+			// a message out, so this doesn't need to be very responsive.
+			if(is_busy())
+			{
+				Pool.wakeup.wait(true, std::chrono::milliseconds(500));
+				Pool.wakeup.set_quiet(false);
+				continue;
+			}
+
+			auto seed = next_refill();
+			if(!seed.has_value())
+			{
+				Pool.wakeup.wait(true, std::chrono::seconds(5));
+				Pool.wakeup.set_quiet(false);
+				continue;
+			}
+
+			auto gen = markovModel()->generation;
+
+			auto t = timer();
+			auto msg = generateMessage(*seed);
+			auto elapsed = t.measure();
+
+			Pool.state.perform_write([&](auto& st) {
+				// if the model got reset while we were generating, then the message is no good. also,
+				// the class might have been thrown out in the meantime.
+				check_generation(st);
+				if(st.generation != gen)
+					return;
+
+				if(auto it = st.classes.find(seed_key(*seed)); it != st.classes.end())
+				{
+					if(auto& cls = it.value(); cls.messages.size() < cls.capacity())
+						cls.messages.push_back(std::move(msg));
+				}
+			});
+
+			Pool.refills++;
+			Pool.refillMicros += (uint64_t) (elapsed * 1000.0);
+		}
+	}
+
+	void start_pool()
+	{
+		Pool.state.perform_write([](auto& st) {
+			st.classes[""] = SeedClass();
+			st.generation = markovModel()->generation;
+		});
+
+		Pool.stop = false;
+		Pool.producer = std::thread(producer_thread);
+	}
+
+	void stop_pool()
+	{
+		Pool.stop = true;
+		Pool.wakeup.set(true);
+
+		if(Pool.producer.joinable())
+			Pool.producer.join();
+	}
+
+	Message getMessage(const std::vector<std::string>& seed)
+	{
+		auto key = seed_key(seed);
+		auto now = util::getMillisecondTimestamp();
+
+		auto pooled = Pool.state.map_write([&](auto& st) -> std::optional<Message> {
+			check_generation(st);
+
+			auto it = st.classes.find(key);
+			if(it == st.classes.end())
+			{
+				// make room by throwing out whichever seed was used the longest time ago.
+				if(st.classes.size() >= MAX_SEED_CLASSES)
+				{
+					auto oldest = st.classes.end();
+					for(auto i = st.classes.begin(); i != st.classes.end(); ++i)
+					{
+						if(!i->second.seed.empty() && (oldest == st.classes.end() || i->second.lastUsed < oldest->second.lastUsed))
+							oldest = i;
+					}
+
+					if(oldest != st.classes.end())
+						st.classes.erase(oldest);
+				}
+
+				auto& cls = st.classes[key];
+				cls.seed = seed;
+				cls.lastUsed = now;
+
+				return { };
+			}
+
+			auto& cls = it.value();
+			cls.lastUsed = now;
+
+			if(cls.messages.empty())
+				return { };
+
+			auto ret = std::optional<Message>(std::move(cls.messages.front()));
+			cls.messages.pop_front();
+
+			return ret;
+		});
+
+		// either way, there's something to refill now.
+		Pool.wakeup.set(true);
+
+		if(pooled.has_value())
+		{
+			Pool.hits++;
+			return std::move(*pooled);
+		}
+
+		Pool.misses++;
+		return generateMessage(seed);
+	}
+
+	PoolStats getPoolStats()
+	{
+		PoolStats ret;
+		ret.hits = Pool.hits;
+		ret.misses = Pool.misses;
+		ret.refills = Pool.refills;
+		ret.refillTime = ret.refills == 0 ? 0 : (double) Pool.refillMicros / (1000.0 * (double) ret.refills);
+
+		Pool.state.perform_read([&ret](auto& st) {
+			ret.classes = st.classes.size();
+			ret.pooled = 0;
+
+			for(const auto& [ k, cls ] : st.classes)
+				ret.pooled += cls.messages.size();
+		});
+
+		return ret;
+	}
+}
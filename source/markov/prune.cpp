@@ -0,0 +1,310 @@
+// prune.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "timer.h"
+#include "config.h"
+#include "markov.h"
+#include "synchro.h"
+#include "markovmodel.h"
+
+// left alone, the model only ever grows -- every typo and one-off from years of chat stays in it forever. so
+// every now and then (or when it gets too big), we make a pruned copy of the published model: every frequency
+// is decayed, transitions that end up too rare are dropped, and then so are any words and contexts that are
+// no longer used. the survivors are renumbered, so the ids stay dense. the copy is built off to the side (see
+// begin_rebuild), one shard at a time, so generation and training carry on as usual in the meantime.
+namespace ikura::markov
+{
+	// how often to check if we're over the memory limit.
+	constexpr auto CHECK_INTERVAL       = std::chrono::seconds(60);
+
+	// if a pass doesn't get us under the limit, go again with a higher minimum frequency, up to this many times.
+	constexpr size_t MAX_PASSES         = 8;
+
+	static struct {
+		std::thread thread;
+		std::atomic<bool> stop = false;
+
+		// set to wake up the thread, either to stop or to prune right away.
+		condvar<bool> wakeup;
+		std::atomic<bool> requested = false;
+
+		uint64_t lastPruned = 0;
+	} Pruner;
+
+	// roughly how much memory the model takes up, in bytes. this counts the snapshot as well, since it
+	// ends up resident once it's been used enough.
+	static size_t model_size(const MarkovModel& markov)
+	{
+		size_t total = 0;
+
+		markov.vocab.perform_read([&total](auto& vocab) {
+			total += vocab.baseArena.size() + vocab.baseWords.size() * sizeof(DBWord) + vocab.baseIndex.size() * sizeof(uint32_t);
+			total += vocab.arena.capacity() + vocab.wordList.capacity() * sizeof(DBWord);
+			total += vocab.wordIndices.bucket_count() * (sizeof(uint32_t) + sizeof(uint32_t));
+		});
+
+		markov.trie.perform_read([&total](auto& trie) {
+			total += trie.baseParents.size() * 2 * sizeof(uint32_t);
+			total += trie.baseSlotKeys.size() * (sizeof(uint64_t) + sizeof(uint32_t));
+			total += (trie.parents.capacity() + trie.words.capacity()) * sizeof(uint32_t);
+			total += trie.children.bucket_count() * (sizeof(uint64_t) + 2 * sizeof(uint32_t));
+		});
+
+		for(auto& shard : markov.shards)
+		{
+			shard.perform_read([&total](auto& shard) {
+				auto& f = shard.frozen;
+				total += f.slotKeys.size() * sizeof(uint64_t) + f.slotEntries.size() * sizeof(uint32_t);
+				total += f.contexts.size() * sizeof(uint64_t) + f.offsets.size() * sizeof(uint32_t);
+				total += (f.words.size() + f.cumulative.size()) * sizeof(uint32_t);
+
+				// each word in a wordlist has the word itself, its slot in the index, and its node in the tree.
+				total += shard.delta.bucket_count() * (sizeof(uint64_t) + sizeof(WordList));
+				total += shard.deltaSize * (sizeof(Word) + 2 * sizeof(uint64_t) + sizeof(uint64_t));
+			});
+		}
+
+		return total;
+	}
+
+	static double to_mb(size_t bytes)
+	{
+		return (double) bytes / (1024.0 * 1024.0);
+	}
+
+	// don't compete with training; returns false if we should stop instead.
+	static bool wait_until_idle()
+	{
+		while(is_busy() && !Pruner.stop)
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+		return !Pruner.stop;
+	}
+
+	// makes a pruned copy of `base`, or returns null if we were told to stop halfway.
+	static std::shared_ptr<MarkovModel> prune_model(const MarkovModel& base, uint64_t keepPercent, uint64_t minFrequency)
+	{
+		// first, decay every transition, and keep the ones that are still frequent enough, in terms of the old ids.
+		std::vector<uint32_t> contexts;
+		std::vector<uint32_t> offsets;
+		std::vector<uint32_t> words;
+		std::vector<uint32_t> freqs;
+
+		for(auto& s : base.shards)
+		{
+			if(!wait_until_idle())
+				return nullptr;
+
+			// the frozen arrays are shared, so copying them out lets us work without holding the lock.
+			auto table = s.map_read([](auto& shard) -> FrozenTable {
+				return shard.delta.empty() ? shard.frozen : merge_shard(shard);
+			});
+
+			for(uint32_t e = 0; e < table.size(); e++)
+			{
+				auto start = words.size();
+
+				uint64_t prev = 0;
+				for(auto i = table.offsets[e]; i < table.offsets[e + 1]; i++)
+				{
+					uint64_t freq = table.cumulative[i] - prev;
+					prev = table.cumulative[i];
+
+					freq = (freq * keepPercent) / 100;
+					if(freq < minFrequency)
+						continue;
+
+					words.push_back(table.words[i]);
+					freqs.push_back((uint32_t) freq);
+				}
+
+				if(words.size() > start)
+				{
+					contexts.push_back((uint32_t) table.contexts[e]);
+					offsets.push_back((uint32_t) start);
+				}
+			}
+		}
+
+		offsets.push_back((uint32_t) words.size());
+
+		if(!wait_until_idle())
+			return nullptr;
+
+		// next, find out what's still used. a context needs all of its ancestors (and their words), and
+		// the markers always stay.
+		auto ret = std::make_shared<MarkovModel>();
+		ret->generation = base.generation;
+		ret->dirty = true;
+
+		std::vector<uint32_t> nodeMap;
+		base.trie.perform_read([&](auto& trie) {
+			nodeMap.assign(trie.size(), ContextTrie::EMPTY_SLOT);
+			nodeMap[ContextTrie::ROOT] = ContextTrie::ROOT;
+
+			for(auto ctx : contexts)
+			{
+				for(auto n = ctx; nodeMap[n] == ContextTrie::EMPTY_SLOT; n = trie.parent(n))
+					nodeMap[n] = 0;
+			}
+		});
+
+		std::vector<uint32_t> wordMap(base.vocab.rlock()->size(), Vocabulary::EMPTY_SLOT);
+		base.trie.perform_read([&](auto& trie) {
+			for(uint32_t n = 1; n < nodeMap.size(); n++)
+			{
+				if(nodeMap[n] != ContextTrie::EMPTY_SLOT)
+					wordMap[trie.word(n)] = 0;
+			}
+		});
+
+		for(auto w : words)
+			wordMap[w] = 0;
+
+		wordMap[IDX_START_MARKER] = IDX_START_MARKER;
+		wordMap[IDX_END_MARKER] = IDX_END_MARKER;
+
+		// now renumber everything, keeping the same order. this also keeps parents before their children.
+		ret->vocab.perform_write([&](auto& vocab) {
+			initialise_vocab(&vocab);
+			base.vocab.perform_read([&](auto& old) {
+				for(uint32_t w = IDX_END_MARKER + 1; w < wordMap.size(); w++)
+				{
+					if(wordMap[w] != Vocabulary::EMPTY_SLOT)
+						wordMap[w] = (uint32_t) vocab.add(old.text(w), old.get(w).flags);
+				}
+			});
+		});
+
+		ret->trie.perform_write([&](auto& trie) {
+			base.trie.perform_read([&](auto& old) {
+				for(uint32_t n = 1; n < nodeMap.size(); n++)
+				{
+					if(nodeMap[n] != ContextTrie::EMPTY_SLOT)
+						nodeMap[n] = trie.insert(nodeMap[old.parent(n)], wordMap[old.word(n)]);
+				}
+			});
+		});
+
+		if(!wait_until_idle())
+			return nullptr;
+
+		// finally, put the transitions back, in their new shards.
+		FrozenBuilder builders[MarkovModel::NUM_SHARDS];
+		std::vector<std::pair<uint64_t, uint64_t>> successors;
+
+		for(size_t i = 0; i < contexts.size(); i++)
+		{
+			successors.clear();
+			for(auto k = offsets[i]; k < offsets[i + 1]; k++)
+				successors.emplace_back(wordMap[words[k]], freqs[k]);
+
+			auto ctx = nodeMap[contexts[i]];
+			builders[ctx % MarkovModel::NUM_SHARDS].add(ctx, successors);
+		}
+
+		for(size_t s = 0; s < MarkovModel::NUM_SHARDS; s++)
+		{
+			auto table = builders[s].finish();
+			ret->shards[s].perform_write([&table](auto& shard) {
+				shard.frozen = std::move(table);
+			});
+		}
+
+		return ret;
+	}
+
+	static void prune_pass()
+	{
+		auto base = begin_rebuild();
+		if(!base)
+			return;
+
+		auto t = timer();
+		auto cfg = config::markov::getConfig();
+		auto limit = cfg.maxMemory * 1024 * 1024;
+
+		auto keep = 100 - std::min(cfg.decayPercent, (uint64_t) 99);
+		auto minFreq = std::max(cfg.minFrequency, (uint64_t) 1);
+
+		auto before = model_size(*base);
+		auto model = prune_model(*base, keep, minFreq);
+
+		// if we're still over the limit, keep going (without decaying again) until we aren't.
+		size_t passes = 1;
+		while(model && limit > 0 && model_size(*model) > limit && passes < MAX_PASSES)
+		{
+			minFreq *= 2;
+			model = prune_model(*model, 100, minFreq);
+			passes++;
+		}
+
+		if(!model)
+		{
+			finish_rebuild(nullptr);
+			return;
+		}
+
+		auto after = model_size(*model);
+		if(limit > 0 && after > limit)
+			lg::warn("markov", "model is still over the memory limit ({.1f} MB) after {} passes", to_mb(limit), passes);
+
+		auto words = std::make_pair(base->vocab.rlock()->size(), model->vocab.rlock()->size());
+		auto contexts = std::make_pair(base->trie.rlock()->size(), model->trie.rlock()->size());
+
+		finish_rebuild(std::move(model));
+
+		lg::log("markov", "pruned model ({} -> {} words, {} -> {} contexts, {.1f} -> {.1f} MB) in {.2f} ms",
+			words.first, words.second, contexts.first, contexts.second, to_mb(before), to_mb(after), t.measure());
+	}
+
+	static bool should_prune()
+	{
+		if(Pruner.requested.exchange(false))
+			return true;
+
+		auto cfg = config::markov::getConfig();
+		if(cfg.pruneInterval > 0 && util::getMillisecondTimestamp() >= Pruner.lastPruned + 1000 * cfg.pruneInterval)
+			return true;
+
+		return cfg.maxMemory > 0 && model_size(*markovModel()) > cfg.maxMemory * 1024 * 1024;
+	}
+
+	static void pruner_thread()
+	{
+		while(!Pruner.stop)
+		{
+			Pruner.wakeup.wait(true, CHECK_INTERVAL);
+			Pruner.wakeup.set_quiet(false);
+
+			if(Pruner.stop || !should_prune())
+				continue;
+
+			prune_pass();
+			Pruner.lastPruned = util::getMillisecondTimestamp();
+		}
+	}
+
+	void start_pruner()
+	{
+		Pruner.stop = false;
+		Pruner.lastPruned = util::getMillisecondTimestamp();
+		Pruner.thread = std::thread(pruner_thread);
+	}
+
+	void stop_pruner()
+	{
+		Pruner.stop = true;
+		Pruner.wakeup.set(true);
+
+		if(Pruner.thread.joinable())
+			Pruner.thread.join();
+	}
+
+	void prune()
+	{
+		Pruner.requested = true;
+		Pruner.wakeup.set(true);
+	}
+}
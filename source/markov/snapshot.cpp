@@ -0,0 +1,557 @@
+// snapshot.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include <mutex>
+#include <filesystem>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "timer.h"
+#include "markov.h"
+#include "markovmodel.h"
+
+namespace std { namespace fs = filesystem; }
+
+// the model is kept in its own file, instead of inside the database. everything in it is a flat array that
+// we use exactly as-is, so loading it is just an mmap -- no parsing, and nothing gets paged in until it's
+// actually used. the arrays become the "base" of the model, and anything learnt after that goes into the
+// normal in-memory structures on top (the vocabulary and trie overlays, and the shard deltas).
+//
+// the layout is a header, then a directory of (offset, count) for each array, then the arrays themselves
+// (each aligned to 8 bytes), in the order that they're written: for each shard, the slot keys, slot entries,
+// contexts, offsets, words, and cumulative frequencies; then the trie parents, words, slot keys and slot nodes;
+// then the vocab arena, words, and index.
+namespace ikura::markov
+{
+	struct SnapshotHeader
+	{
+		char magic[8];          // "ikura_mk"
+		uint32_t version;       // see SNAPSHOT_VERSION
+		uint32_t numShards;     // must be the same as MarkovModel::NUM_SHARDS
+		uint64_t timestamp;     // when the snapshot was written, in milliseconds
+		uint64_t numArrays;
+	};
+
+	struct ArrayDesc
+	{
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	static_assert(sizeof(SnapshotHeader) == 32);
+	static_assert(sizeof(ArrayDesc) == 16);
+	static_assert(std::is_trivially_copyable_v<DBWord>);
+
+	constexpr uint32_t SNAPSHOT_VERSION     = 1;
+	constexpr const char* SNAPSHOT_MAGIC    = "ikura_mk";
+
+	constexpr size_t ARRAYS_PER_SHARD       = 6;
+	constexpr size_t TRIE_ARRAYS            = ARRAYS_PER_SHARD * MarkovModel::NUM_SHARDS;
+	constexpr size_t VOCAB_ARRAYS           = TRIE_ARRAYS + 4;
+	constexpr size_t NUM_ARRAYS             = VOCAB_ARRAYS + 3;
+
+	static std::string snapshotPath;
+	static std::mutex snapshotLock;
+
+	Snapshot::~Snapshot()
+	{
+		util::munmapEntireFile(this->fd, this->buf, this->len);
+	}
+
+	namespace {
+
+		struct SnapshotWriter
+		{
+			SnapshotWriter(int fd) : fd(fd) { }
+
+			int fd;
+			int error = 0;
+			uint64_t offset = 0;
+			std::vector<ArrayDesc> arrays;
+
+			void write(const void* data, size_t len)
+			{
+				auto ptr = (const uint8_t*) data;
+				while(this->error == 0 && len > 0)
+				{
+					auto ret = ::write(this->fd, ptr, len);
+					if(ret <= 0)
+					{
+						this->error = (ret < 0 ? errno : EIO);
+						return;
+					}
+
+					ptr += ret;
+					len -= ret;
+					this->offset += ret;
+				}
+			}
+
+			void align()
+			{
+				static const uint8_t zeroes[8] = { };
+				if(auto rem = this->offset % 8; rem != 0)
+					this->write(zeroes, 8 - rem);
+			}
+
+			// the array can come in two parts (eg. the base and the overlay), which are written back to back.
+			template <typename T>
+			void array(const T* a, size_t n, const T* b = nullptr, size_t m = 0)
+			{
+				this->align();
+				this->arrays.push_back(ArrayDesc { this->offset, n + m });
+
+				this->write(a, n * sizeof(T));
+				this->write(b, m * sizeof(T));
+			}
+
+			template <typename T>
+			void array(const FlatArray<T>& a) { this->array(a.data(), a.size()); }
+		};
+	}
+
+	static size_t index_capacity(size_t count)
+	{
+		// same as the frozen tables; keep the load factor under 0.5
+		size_t cap = 16;
+		while(cap < 2 * count)
+			cap *= 2;
+
+		return cap;
+	}
+
+	static void write_shard(SnapshotWriter& wr, const FrozenTable& table)
+	{
+		wr.array(table.slotKeys);
+		wr.array(table.slotEntries);
+		wr.array(table.contexts);
+
+		// a shard that was never compacted doesn't even have the extra offset.
+		static const uint32_t zero = 0;
+		if(table.offsets.empty())   wr.array(&zero, 1);
+		else                        wr.array(table.offsets);
+
+		wr.array(table.words);
+		wr.array(table.cumulative);
+	}
+
+	static void write_trie(SnapshotWriter& wr, const ContextTrie& trie)
+	{
+		wr.array(trie.baseParents.data(), trie.baseParents.size(), trie.parents.data(), trie.parents.size());
+		wr.array(trie.baseWords.data(), trie.baseWords.size(), trie.words.data(), trie.words.size());
+
+		// the index covers every node except the root.
+		auto cap = index_capacity(trie.size());
+		std::vector<uint64_t> keys(cap);
+		std::vector<uint32_t> nodes(cap, ContextTrie::EMPTY_SLOT);
+
+		for(uint32_t n = 1; n < trie.size(); n++)
+		{
+			auto k = ContextTrie::key(trie.parent(n), trie.word(n));
+			auto i = ContextTrie::KeyHash()(k) & (cap - 1);
+			while(nodes[i] != ContextTrie::EMPTY_SLOT)
+				i = (i + 1) & (cap - 1);
+
+			keys[i] = k;
+			nodes[i] = n;
+		}
+
+		wr.array(keys.data(), keys.size());
+		wr.array(nodes.data(), nodes.size());
+	}
+
+	static void write_vocab(SnapshotWriter& wr, const Vocabulary& vocab)
+	{
+		wr.array(vocab.baseArena.data(), vocab.baseArena.size(), vocab.arena.data(), vocab.arena.size());
+
+		// the overlay's words are relative to its own arena, which comes after the base one.
+		std::vector<DBWord> words(vocab.baseWords.begin(), vocab.baseWords.end());
+		words.reserve(vocab.size());
+
+		for(const auto& w : vocab.wordList)
+			words.emplace_back(ikura::relative_str(vocab.baseArena.size() + w.word.start(), w.word.size()), w.flags);
+
+		wr.array(words.data(), words.size());
+
+		auto cap = index_capacity(vocab.size());
+		std::vector<uint32_t> index(cap, Vocabulary::EMPTY_SLOT);
+
+		// the markers don't get indexed.
+		auto hash = Vocabulary::KeyHash { &vocab };
+		for(uint32_t w = IDX_END_MARKER + 1; w < vocab.size(); w++)
+		{
+			auto i = hash(w) & (cap - 1);
+			while(index[i] != Vocabulary::EMPTY_SLOT)
+				i = (i + 1) & (cap - 1);
+
+			index[i] = w;
+		}
+
+		wr.array(index.data(), index.size());
+	}
+
+	// writes the model to `path`. this also runs in the sync process (see beginSnapshot), so it can't log; it
+	// returns errno instead, and removes the file if it fails.
+	static int write_snapshot(const MarkovModel& markov, const char* path)
+	{
+		int fd = open(path, O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+		if(fd < 0)
+			return errno;
+
+		// leave space for the header and directory; we only know the offsets at the end.
+		auto wr = SnapshotWriter(fd);
+
+		std::vector<uint8_t> space(sizeof(SnapshotHeader) + NUM_ARRAYS * sizeof(ArrayDesc));
+		wr.write(space.data(), space.size());
+
+		for(auto& shard : markov.shards)
+		{
+			shard.perform_read([&wr](auto& shard) {
+				if(shard.delta.empty()) write_shard(wr, shard.frozen);
+				else                    write_shard(wr, merge_shard(shard));
+			});
+		}
+
+		markov.trie.perform_read([&wr](auto& trie) {
+			write_trie(wr, trie);
+		});
+
+		markov.vocab.perform_read([&wr](auto& vocab) {
+			write_vocab(wr, vocab);
+		});
+
+		assert(wr.arrays.size() == NUM_ARRAYS);
+
+		SnapshotHeader hdr;
+		memcpy(hdr.magic, SNAPSHOT_MAGIC, 8);
+		hdr.version = SNAPSHOT_VERSION;
+		hdr.numShards = MarkovModel::NUM_SHARDS;
+		hdr.timestamp = util::getMillisecondTimestamp();
+		hdr.numArrays = NUM_ARRAYS;
+
+		memcpy(space.data(), &hdr, sizeof(SnapshotHeader));
+		memcpy(space.data() + sizeof(SnapshotHeader), wr.arrays.data(), NUM_ARRAYS * sizeof(ArrayDesc));
+
+		if(wr.error == 0)
+		{
+			if(auto ret = pwrite(fd, space.data(), space.size(), 0); ret != (ssize_t) space.size())
+				wr.error = (ret < 0 ? errno : EIO);
+		}
+
+		// this replaces the only good snapshot, so it needs to actually be on disk first.
+		if(wr.error == 0 && fsync(fd) != 0)
+			wr.error = errno;
+
+		if(close(fd) != 0 && wr.error == 0)
+			wr.error = errno;
+
+		if(wr.error != 0)
+			unlink(path);
+
+		return wr.error;
+	}
+
+	// puts the new snapshot (written by write_snapshot) in place.
+	static bool install_snapshot(const std::string& tmp, int err)
+	{
+		if(err != 0)
+			return lg::error_b("markov", "failed to write snapshot: {}", strerror(err));
+
+		std::error_code ec;
+		std::fs::rename(tmp, snapshotPath, ec);
+		if(ec)
+			return lg::error_b("markov", "failed to write snapshot: {}", ec.message());
+
+		return true;
+	}
+
+	// the offsets can't go backwards (so each entry is a valid range of the successors), neither can each entry's
+	// cumulative frequencies (select does a binary search on them), and the contexts, successors, and slots have
+	// to point at things that exist.
+	static bool check_table(const FrozenTable& table, size_t num_nodes, size_t num_words)
+	{
+		if(table.offsets[0] != 0)
+			return false;
+
+		for(size_t e = 0; e < table.size(); e++)
+		{
+			auto begin = table.offsets[e];
+			auto end = table.offsets[e + 1];
+
+			if(end < begin || end > table.words.size() || table.contexts[e] >= num_nodes)
+				return false;
+
+			uint32_t prev = 0;
+			for(auto i = begin; i < end; i++)
+			{
+				if(table.words[i] >= num_words || table.cumulative[i] < prev)
+					return false;
+
+				prev = table.cumulative[i];
+			}
+		}
+
+		for(auto e : table.slotEntries)
+		{
+			if(e != FrozenTable::EMPTY_SLOT && e >= table.size())
+				return false;
+		}
+
+		return true;
+	}
+
+	bool load_snapshot()
+	{
+		auto t = timer();
+
+		auto path = snapshotPath;
+		if(path.empty() || !std::fs::exists(path))
+		{
+			lg::warn("markov", "snapshot '{}' does not exist", path);
+			return false;
+		}
+
+		std::error_code ec;
+		if(auto sz = std::fs::file_size(path, ec); ec || sz < sizeof(SnapshotHeader) + NUM_ARRAYS * sizeof(ArrayDesc))
+			return lg::error_b("markov", "snapshot truncated");
+
+		auto [ fd, buf, len ] = util::mmapEntireFile(path);
+		if(buf == nullptr || len == 0)
+			return false;
+
+		auto snap = std::make_shared<Snapshot>(fd, buf, len);
+
+		auto hdr = (const SnapshotHeader*) buf;
+		if(strncmp(hdr->magic, SNAPSHOT_MAGIC, 8) != 0)
+			return lg::error_b("markov", "invalid snapshot identifier");
+
+		if(hdr->version != SNAPSHOT_VERSION)
+			return lg::error_b("markov", "unsupported snapshot version {} (expected {})", hdr->version, SNAPSHOT_VERSION);
+
+		if(hdr->numShards != MarkovModel::NUM_SHARDS)
+			return lg::error_b("markov", "snapshot has the wrong number of shards ({}, expected {})", hdr->numShards,
+				MarkovModel::NUM_SHARDS);
+
+		if(hdr->numArrays != NUM_ARRAYS)
+			return lg::error_b("markov", "snapshot has the wrong number of arrays ({}, expected {})", hdr->numArrays,
+				NUM_ARRAYS);
+
+		// check that the arrays are in bounds and the sizes make sense. everything that gets used as an index
+		// (into this file, or the model) is checked as well, the same way the message log checks its frame tables;
+		// it's one pass over each array, which is still a lot cheaper than parsing them.
+		auto dir = (const ArrayDesc*) (buf + sizeof(SnapshotHeader));
+		auto get = [&](size_t i, auto* out) -> bool {
+			using T = typename std::remove_pointer_t<decltype(out)>::value_type;
+
+			auto [ ofs, count ] = dir[i];
+			if(ofs % alignof(T) != 0 || ofs > len || count > (len - ofs) / sizeof(T))
+				return lg::error_b("markov", "snapshot array {} is out of bounds", i);
+
+			*out = FlatArray<T>((const T*) (buf + ofs), count);
+			return true;
+		};
+
+		auto is_index_size = [](size_t cap, size_t count) -> bool {
+			return (cap == 0 && count == 0) || ((cap & (cap - 1)) == 0 && cap > count);
+		};
+
+		FlatArray<char> arena;
+		FlatArray<DBWord> vocabWords;
+		FlatArray<uint32_t> vocabIndex;
+
+		if(!get(VOCAB_ARRAYS + 0, &arena) || !get(VOCAB_ARRAYS + 1, &vocabWords) || !get(VOCAB_ARRAYS + 2, &vocabIndex))
+			return false;
+
+		if(vocabWords.size() <= IDX_END_MARKER || !is_index_size(vocabIndex.size(), vocabWords.size()))
+			return lg::error_b("markov", "malformed vocabulary in snapshot");
+
+		for(const auto& w : vocabWords)
+		{
+			if(w.word.start() > arena.size() || w.word.size() > arena.size() - w.word.start())
+				return lg::error_b("markov", "malformed vocabulary in snapshot");
+		}
+
+		for(auto w : vocabIndex)
+		{
+			if(w != Vocabulary::EMPTY_SLOT && w >= vocabWords.size())
+				return lg::error_b("markov", "malformed vocabulary in snapshot");
+		}
+
+		ContextTrie trie;
+		trie.parents.clear();
+		trie.words.clear();
+
+		if(!get(TRIE_ARRAYS + 0, &trie.baseParents) || !get(TRIE_ARRAYS + 1, &trie.baseWords)
+			|| !get(TRIE_ARRAYS + 2, &trie.baseSlotKeys) || !get(TRIE_ARRAYS + 3, &trie.baseSlotNodes))
+			return false;
+
+		if(trie.baseParents.empty() || trie.baseParents.size() != trie.baseWords.size()
+			|| trie.baseSlotKeys.size() != trie.baseSlotNodes.size() || !is_index_size(trie.baseSlotNodes.size(), trie.size()))
+		{
+			return lg::error_b("markov", "malformed context trie in snapshot");
+		}
+
+		// a node is always added after its parent, so this also means that following the parents always
+		// gets back to the root.
+		if(trie.baseParents[0] != ContextTrie::ROOT)
+			return lg::error_b("markov", "malformed context trie in snapshot");
+
+		for(size_t n = 1; n < trie.baseParents.size(); n++)
+		{
+			if(trie.baseParents[n] >= n || trie.baseWords[n] >= vocabWords.size())
+				return lg::error_b("markov", "malformed context trie in snapshot (node {})", n);
+		}
+
+		for(auto n : trie.baseSlotNodes)
+		{
+			if(n != ContextTrie::EMPTY_SLOT && (n == ContextTrie::ROOT || n >= trie.size()))
+				return lg::error_b("markov", "malformed context trie in snapshot");
+		}
+
+		Shard shards[MarkovModel::NUM_SHARDS];
+		for(size_t s = 0; s < MarkovModel::NUM_SHARDS; s++)
+		{
+			auto& table = shards[s].frozen;
+			auto base = s * ARRAYS_PER_SHARD;
+
+			if(!get(base + 0, &table.slotKeys) || !get(base + 1, &table.slotEntries) || !get(base + 2, &table.contexts)
+				|| !get(base + 3, &table.offsets) || !get(base + 4, &table.words) || !get(base + 5, &table.cumulative))
+			{
+				return false;
+			}
+
+			if(table.slotKeys.size() != table.slotEntries.size() || !is_index_size(table.slotEntries.size(), table.size())
+				|| table.offsets.size() != table.size() + 1 || table.words.size() != table.cumulative.size()
+				|| table.offsets[table.size()] != table.words.size())
+			{
+				return lg::error_b("markov", "malformed table in snapshot (shard {})", s);
+			}
+
+			if(!check_table(table, trie.size(), vocabWords.size()))
+				return lg::error_b("markov", "malformed table in snapshot (shard {})", s);
+
+			table.snapshot = snap;
+			if(!table.slotEntries.empty())
+				table.slotShift = 64 - __builtin_ctzll(table.slotEntries.size());
+		}
+
+		// ok, everything looks fine. nobody else can see the new model yet, so the locking is just a formality.
+		auto model = new_model();
+		auto& markov = *model;
+
+		markov.vocab.perform_write([&](auto& vocab) {
+			vocab.clear();
+			vocab.snapshot = snap;
+			vocab.baseArena = std::move(arena);
+			vocab.baseWords = std::move(vocabWords);
+			vocab.baseIndex = std::move(vocabIndex);
+		});
+
+		trie.snapshot = snap;
+		*markov.trie.wlock().get() = std::move(trie);
+
+		for(size_t s = 0; s < MarkovModel::NUM_SHARDS; s++)
+			*markov.shards[s].wlock().get() = std::move(shards[s]);
+
+		markov.dirty = false;
+
+		lg::log("markov", "mapped model snapshot ({} words, {} contexts, {.1f} MB) in {.2f} ms",
+			markov.vocab.rlock()->size(), markov.trie.rlock()->size(), (double) len / (1024.0 * 1024.0), t.measure());
+
+		install_model(std::move(model));
+
+		return true;
+	}
+
+	void setSnapshotPath(const std::string& path)
+	{
+		snapshotPath = path;
+	}
+
+	void saveSnapshot()
+	{
+		if(snapshotPath.empty() || !markovModel()->dirty)
+			return;
+
+		// syncs can happen from more than one thread.
+		std::lock_guard lk(snapshotLock);
+
+		auto t = timer();
+
+		// the published model is never modified, so holding on to it is all we need for a consistent snapshot,
+		// even if it gets replaced while we're writing.
+		auto model = markovModel();
+		model->dirty = false;
+
+		auto tmp = snapshotPath + ".new";
+		if(!install_snapshot(tmp, write_snapshot(*model, tmp.c_str())))
+		{
+			model->dirty = true;
+			return;
+		}
+
+		lg::log("markov", "wrote model snapshot in {.2f} ms", t.measure());
+	}
+
+	// the snapshot that the sync process is writing (see beginSnapshot).
+	static struct {
+		std::unique_lock<std::mutex> lock;
+		std::shared_ptr<MarkovModel> model;
+		std::weak_ptr<MarkovModel> written;
+		std::string tmp;
+	} Pending;
+
+	bool beginSnapshot()
+	{
+		if(snapshotPath.empty() || !markovModel()->dirty)
+			return false;
+
+		// this stays locked until finishSnapshot, so nobody else writes the snapshot in the meantime.
+		Pending.lock = std::unique_lock(snapshotLock);
+		Pending.model = markovModel();
+		Pending.written = Pending.model;
+		Pending.tmp = snapshotPath + ".new";
+
+		Pending.model->dirty = false;
+		return true;
+	}
+
+	int writeSnapshot()
+	{
+		return write_snapshot(*Pending.model, Pending.tmp.c_str());
+	}
+
+	void releaseSnapshot()
+	{
+		Pending.model = nullptr;
+	}
+
+	void finishSnapshot(bool exited)
+	{
+		// writeSnapshot removes the file if it fails, so if it's there, it's complete -- unless the process died
+		// before it got that far.
+		std::error_code ec;
+		bool ok = false;
+
+		if(!exited || !std::fs::exists(Pending.tmp, ec))
+		{
+			std::fs::remove(Pending.tmp, ec);
+			lg::error("markov", "failed to write snapshot");
+		}
+		else if((ok = install_snapshot(Pending.tmp, 0)))
+		{
+			lg::log("markov", "wrote model snapshot");
+		}
+
+		// if it was trained since, then it's dirty already.
+		if(auto model = Pending.written.lock(); model && !ok)
+			model->dirty = true;
+
+		Pending.model = nullptr;
+		Pending.written.reset();
+		Pending.lock.unlock();
+	}
+}
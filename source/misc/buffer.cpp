@@ -3,6 +3,8 @@
 // Licensed under the Apache License Version 2.0.
 
 #include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include <string>
 #include <string_view>
@@ -26,6 +28,7 @@ namespace ikura
 		this->ptr = oth.ptr;    oth.ptr = nullptr;
 		this->len = oth.len;    oth.len = 0;
 		this->cap = oth.cap;    oth.cap = 0;
+		this->stream = oth.stream;  oth.stream = nullptr;
 	}
 
 	Buffer& Buffer::operator = (Buffer&& oth)
@@ -39,6 +42,7 @@ namespace ikura
 		this->ptr = oth.ptr;    oth.ptr = nullptr;
 		this->len = oth.len;    oth.len = 0;
 		this->cap = oth.cap;    oth.cap = 0;
+		this->stream = oth.stream;  oth.stream = nullptr;
 
 		return *this;
 	}
@@ -109,6 +113,81 @@ namespace ikura
 	}
 
 
+	bool Buffer::streaming() const  { return this->stream != nullptr; }
+	bool Buffer::flush(const void* extra, size_t extraLen)
+	{
+		if(this->stream == nullptr)
+			return false;
+
+		struct iovec iov[2] = {
+			{ this->ptr, this->len },
+			{ const_cast<void*>(extra), extraLen }
+		};
+
+		this->len = 0;
+		return this->stream->write(iov, extraLen > 0 ? 2 : 1);
+	}
+
+	Buffer Buffer::streaming(Stream* stream, size_t cap)
+	{
+		auto ret = Buffer(cap);
+		ret.stream = stream;
+
+		return ret;
+	}
+
+	bool FileStream::write(const struct iovec* iov, int count)
+	{
+		if(this->error != 0)
+			return false;
+
+		// writev can stop partway (especially for sockets), so pick up from wherever it got to.
+		struct iovec todo[8];
+		while(count > 0)
+		{
+			auto n = std::min(count, 8);
+			memcpy(todo, iov, n * sizeof(struct iovec));
+
+			auto cur = todo;
+			auto left = n;
+			while(true)
+			{
+				while(left > 0 && cur->iov_len == 0)
+					cur++, left--;
+
+				if(left == 0)
+					break;
+
+				auto ret = writev(this->fd, cur, left);
+				if(ret < 0 && errno == EINTR)
+					continue;
+
+				if(ret <= 0)
+				{
+					this->error = (ret < 0 ? errno : EIO);
+					return false;
+				}
+
+				this->written += ret;
+
+				auto k = (size_t) ret;
+				for(; left > 0 && k >= cur->iov_len; cur++, left--)
+					k -= cur->iov_len;
+
+				if(left > 0)
+				{
+					cur->iov_base = (uint8_t*) cur->iov_base + k;
+					cur->iov_len -= k;
+				}
+			}
+
+			iov += n;
+			count -= n;
+		}
+
+		return true;
+	}
+
 	Buffer Buffer::empty() { return Buffer(0); }
 	Buffer Buffer::fromString(const std::string& s)
 	{
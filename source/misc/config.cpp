@@ -110,6 +110,15 @@ namespace ikura::config
 		{
 			return config;
 		}
+
+		static ikura::string_map<uint64_t> duplicateThresholds;
+		uint64_t getDuplicateThreshold(ikura::str_view channel)
+		{
+			if(auto it = duplicateThresholds.find(channel.sv()); it != duplicateThresholds.end())
+				return it->second;
+
+			return config.duplicateThreshold;
+		}
 	}
 
 	namespace console
@@ -312,6 +321,83 @@ namespace ikura::config
 
 		markov::config.minLength = minLen;
 		markov::config.maxRetries = maxRetry;
+
+		// pruning is off by default. decay_percent is how much of every frequency is lost on each pass, and
+		// anything that ends up below min_frequency is dropped.
+		auto interval = get_integer(obj, "prune_interval", 0);
+		auto decay = get_integer(obj, "decay_percent", 0);
+		auto minFreq = get_integer(obj, "min_frequency", 1);
+		auto maxMem = get_integer(obj, "max_memory_mb", 0);
+
+		if(interval < 0)
+		{
+			lg::warn("cfg/markov", "invalid value '{}' for prune_interval", interval);
+			interval = 0;
+		}
+
+		if(decay < 0 || decay >= 100)
+		{
+			lg::warn("cfg/markov", "invalid value '{}' for decay_percent", decay);
+			decay = 0;
+		}
+
+		if(minFreq < 1)
+		{
+			lg::warn("cfg/markov", "invalid value '{}' for min_frequency", minFreq);
+			minFreq = 1;
+		}
+
+		if(maxMem < 0)
+		{
+			lg::warn("cfg/markov", "invalid value '{}' for max_memory_mb", maxMem);
+			maxMem = 0;
+		}
+
+		markov::config.pruneInterval = interval;
+		markov::config.decayPercent = decay;
+		markov::config.minFrequency = minFreq;
+		markov::config.maxMemory = maxMem;
+
+		// the duplicate filter is also off by default. duplicate_thresholds is an object, mapping channel names
+		// to their own threshold (which can be 0, to turn it off for that channel).
+		auto window = get_integer(obj, "duplicate_window", 60);
+		auto threshold = get_integer(obj, "duplicate_threshold", 0);
+
+		if(window < 1)
+		{
+			lg::warn("cfg/markov", "invalid value '{}' for duplicate_window", window);
+			window = 60;
+		}
+
+		if(threshold < 0)
+		{
+			lg::warn("cfg/markov", "invalid value '{}' for duplicate_threshold", threshold);
+			threshold = 0;
+		}
+
+		markov::config.duplicateWindow = window;
+		markov::config.duplicateThreshold = threshold;
+
+		if(auto it = obj.find("duplicate_thresholds"); it != obj.end())
+		{
+			if(!it->second.is_obj())
+			{
+				lg::error("cfg/markov", "expected object value for 'duplicate_thresholds'");
+			}
+			else
+			{
+				for(const auto& [ channel, val ] : it->second.as_obj())
+				{
+					if(!val.is_int() || val.as_int() < 0)
+					{
+						lg::warn("cfg/markov", "invalid duplicate threshold for channel '{}'", channel);
+						continue;
+					}
+
+					markov::duplicateThresholds[channel] = (uint64_t) val.as_int();
+				}
+			}
+		}
 	}
 
 
@@ -0,0 +1,191 @@
+// lz.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include "defs.h"
+
+// this is the lz4 block format (without the frame stuff around it). each sequence is a token byte (the number of
+// literals in the top 4 bits, the length of the match minus 4 in the bottom 4), then the rest of the literal
+// length (if it was 15, as a run of bytes that are added up until one isn't 255), the literals, a 2-byte offset
+// back into the output, and then the rest of the match length (same as the literals). the last sequence is only
+// literals. the compressor is the simple greedy one (one hash table lookup per position); it's not as good as
+// the real thing, but chat logs are repetitive enough that it doesn't matter much.
+namespace ikura::lz
+{
+	constexpr size_t MIN_MATCH      = 4;
+	constexpr size_t LAST_LITERALS  = 5;    // the last 5 bytes are always literals,
+	constexpr size_t MATCH_LIMIT    = 12;   // and the last match has to start before this many from the end.
+	constexpr size_t MAX_OFFSET     = 65535;
+	constexpr size_t HASH_BITS      = 14;
+
+	static uint32_t read32(const uint8_t* p)
+	{
+		uint32_t x = 0;
+		memcpy(&x, p, 4);
+		return x;
+	}
+
+	static uint32_t hash(uint32_t x)
+	{
+		return (x * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	size_t compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap)
+	{
+		size_t op = 0;
+
+		auto put_length = [&](size_t n) -> bool {
+			for(; n >= 255; n -= 255)
+			{
+				if(op >= cap) return false;
+				dst[op++] = 255;
+			}
+
+			if(op >= cap) return false;
+			dst[op++] = (uint8_t) n;
+			return true;
+		};
+
+		auto put_sequence = [&](const uint8_t* lits, size_t nlits, size_t offset, size_t mlen) -> bool {
+			if(op >= cap) return false;
+
+			auto tok = op++;
+			dst[tok] = (uint8_t) (std::min(nlits, (size_t) 15) << 4);
+
+			if(nlits >= 15 && !put_length(nlits - 15))
+				return false;
+
+			if(cap - op < nlits) return false;
+			memcpy(dst + op, lits, nlits);
+			op += nlits;
+
+			// the last one has no match.
+			if(mlen == 0)
+				return true;
+
+			if(cap - op < 2) return false;
+			dst[op++] = (uint8_t) (offset & 0xFF);
+			dst[op++] = (uint8_t) (offset >> 8);
+
+			mlen -= MIN_MATCH;
+			dst[tok] |= (uint8_t) std::min(mlen, (size_t) 15);
+
+			if(mlen >= 15 && !put_length(mlen - 15))
+				return false;
+
+			return true;
+		};
+
+		size_t ip = 0;
+		size_t anchor = 0;
+
+		if(len > MATCH_LIMIT)
+		{
+			// positions are stored +1, so that 0 means nothing.
+			auto table = std::make_unique<uint32_t[]>(1 << HASH_BITS);
+			auto limit = len - MATCH_LIMIT;
+
+			while(ip < limit)
+			{
+				auto seq = read32(src + ip);
+				auto h = hash(seq);
+
+				auto cand = (size_t) table[h];
+				table[h] = (uint32_t) (ip + 1);
+
+				if(cand == 0 || ip - (cand - 1) > MAX_OFFSET || read32(src + cand - 1) != seq)
+				{
+					// skip faster through stuff that doesn't compress.
+					ip += 1 + ((ip - anchor) >> 6);
+					continue;
+				}
+
+				auto match = cand - 1;
+				auto mlen = MIN_MATCH;
+				while(ip + mlen < len - LAST_LITERALS && src[match + mlen] == src[ip + mlen])
+					mlen++;
+
+				if(!put_sequence(src + anchor, ip - anchor, ip - match, mlen))
+					return 0;
+
+				ip += mlen;
+				anchor = ip;
+			}
+		}
+
+		if(!put_sequence(src + anchor, len - anchor, 0, 0))
+			return 0;
+
+		return op;
+	}
+
+	bool decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t outlen)
+	{
+		size_t ip = 0;
+		size_t op = 0;
+
+		auto get_length = [&](size_t& n) -> bool {
+			while(true)
+			{
+				if(ip >= len)
+					return false;
+
+				auto b = src[ip++];
+				n += b;
+
+				if(b != 255)
+					return true;
+			}
+		};
+
+		while(ip < len)
+		{
+			auto tok = src[ip++];
+
+			size_t nlits = (tok >> 4);
+			if(nlits == 15 && !get_length(nlits))
+				return false;
+
+			if(len - ip < nlits || outlen - op < nlits)
+				return false;
+
+			memcpy(dst + op, src + ip, nlits);
+			ip += nlits;
+			op += nlits;
+
+			if(ip == len)
+				break;
+
+			if(len - ip < 2)
+				return false;
+
+			size_t offset = src[ip] | ((size_t) src[ip + 1] << 8);
+			ip += 2;
+
+			if(offset == 0 || offset > op)
+				return false;
+
+			size_t mlen = (tok & 0xF);
+			if(mlen == 15 && !get_length(mlen))
+				return false;
+
+			mlen += MIN_MATCH;
+			if(outlen - op < mlen)
+				return false;
+
+			// the match can overlap with what it's writing (that's how runs work), so it can't always be a memcpy.
+			if(offset >= mlen)
+			{
+				memcpy(dst + op, dst + op - offset, mlen);
+				op += mlen;
+			}
+			else
+			{
+				for(size_t i = 0; i < mlen; i++, op++)
+					dst[op] = dst[op - offset];
+			}
+		}
+
+		return op == outlen;
+	}
+}
@@ -94,7 +94,7 @@ namespace ikura
 				}
 				else
 				{
-					auto grp = database().rlock()->sharedData.getGroup(name);
+					auto grp = db::read({ db::Section::Shared }, [&name](auto& db) { return db.sharedData.getGroup(name); });
 					if(grp == nullptr)
 						return zpr::sprint("nonexistent group '{}'", name);
 
@@ -147,7 +147,7 @@ namespace ikura
 		std::string print(const Channel* chan, const PermissionSet& perms)
 		{
 			auto get_grp_name = [](uint64_t id) -> std::string {
-				if(auto g = database().rlock()->sharedData.getGroup(id); g != nullptr)
+				if(auto g = db::read({ db::Section::Shared }, [id](auto& db) { return db.sharedData.getGroup(id); }); g != nullptr)
 					return g->name;
 
 				return "??";
@@ -193,7 +193,7 @@ namespace ikura
 		{
 			using Ret_T = std::pair<std::string, TUsr_t*>;
 
-			return database().map_write([&](auto& db) -> Ret_T {
+			return db::write({ db::Section::Twitch }, [&](auto& db) -> Ret_T {
 				auto& twch = db.twitchData.channels[chan->getName()];
 				auto userid = twch.usernameMapping[user];
 				if(userid.empty())
@@ -215,7 +215,7 @@ namespace ikura
 		{
 			using Ret_T = std::pair<std::string, IUsr_t*>;
 
-			return database().map_write([&](auto& db) -> Ret_T {
+			return db::write({ db::Section::Irc }, [&](auto& db) -> Ret_T {
 
 				auto srv = db.ircData.getServer(dynamic_cast<const irc::Channel*>(chan)->getServer()->name);
 				if(!srv) return { "", nullptr };
@@ -279,7 +279,7 @@ namespace ikura
 				return { "", nullptr };
 			}
 
-			return database().map_write([&](auto& db) -> Ret_T {
+			return db::write({ db::Section::Discord }, [&](auto& db) -> Ret_T {
 				auto g = const_cast<discord::DiscordGuild*>(guild);
 				auto usr = g->getUser(userid);
 				if(!usr) return no_user();
@@ -315,7 +315,7 @@ namespace ikura
 			if(groups == nullptr)
 				return { };
 
-			return database().map_read([&groups](auto& db) -> std::string {
+			return db::read({ db::Section::Shared }, [&groups](auto& db) -> std::string {
 				return zfu::listToString(*groups, [&db](uint64_t gid) -> auto {
 					if(auto grp = db.sharedData.getGroup(gid); grp != nullptr)
 						return zpr::sprint("({}, id: {})", grp->name, grp->id);
@@ -326,6 +326,17 @@ namespace ikura
 		}
 
 
+		static db::Section backend_section(Backend backend)
+		{
+			switch(backend)
+			{
+				case Backend::Twitch:   return db::Section::Twitch;
+				case Backend::IRC:      return db::Section::Irc;
+				case Backend::Discord:  return db::Section::Discord;
+				default:                return db::Section::Shared;
+			}
+		}
+
 		template <typename T>
 		static bool update_user_groups(const PermissionSet& ps, const Channel* chan, ikura::str_view user, Backend backend)
 		{
@@ -333,7 +344,8 @@ namespace ikura
 			if(user_and_name.first.empty() || user_and_name.second == nullptr)
 				return false;
 
-			database().perform_write([&](auto& db) {
+			// the user's groups are in the backend's section, and the group's members are in the shared one.
+			db::write({ db::Section::Shared, backend_section(backend) }, [&](auto& db) {
 				for(auto x : ps.whitelist)
 				{
 					add_to_list(user_and_name.second->groups, x);
@@ -330,41 +330,46 @@ namespace ikura
 			std::mt19937 mersenne;
 		};
 
+		// thread_local, because mt19937 isn't thread-safe and we call this from multiple threads.
 		template <typename T>
-		rd_state_t<T> rd_state;
+		rd_state_t<T>& rd_state()
+		{
+			static thread_local rd_state_t<T> state;
+			return state;
+		}
 
 		template <typename T>
 		T get()
 		{
-			auto& st = rd_state<T>;
+			auto& st = rd_state<T>();
 			return std::uniform_int_distribution<T>(std::numeric_limits<T>::min(), std::numeric_limits<T>::max())(st.mersenne);
 		}
 
 		template <typename T>
 		T get(T min, T max)
 		{
-			auto& st = rd_state<T>;
+			auto& st = rd_state<T>();
 			return std::uniform_int_distribution<T>(min, max)(st.mersenne);
 		}
 
 		template <typename T>
 		T get_normal(T mean, T stddev)
 		{
-			auto& st = rd_state<T>;
+			auto& st = rd_state<T>();
 			return std::normal_distribution<T>(mean, stddev)(st.mersenne);
 		}
 
 		template <typename T>
 		T get_float()
 		{
-			auto& st = rd_state<T>;
+			auto& st = rd_state<T>();
 			return std::uniform_real_distribution<T>(-1, +1)(st.mersenne);
 		}
 
 		template <typename T>
 		T get_float(T min, T max)
 		{
-			auto& st = rd_state<T>;
+			auto& st = rd_state<T>();
 			return std::uniform_real_distribution<T>(min, max)(st.mersenne);
 		}
 
@@ -0,0 +1,256 @@
+// markov-bench.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include <sys/resource.h>
+
+#include "db.h"
+#include "zfu.h"
+#include "defs.h"
+#include "async.h"
+#include "timer.h"
+#include "markov.h"
+
+using namespace std::chrono_literals;
+
+// replays a corpus through the markov model, without any of the backends, and reports how fast it trains
+// and generates. the corpus is either a text file (one message per line), or an existing database, in which
+// case its message logs are used (and retraining is measured as well).
+
+// these live in main.cpp, which we don't link with.
+namespace ikura
+{
+	static ThreadPool<4> pool;
+	ThreadPool<4>& dispatcher()
+	{
+		return pool;
+	}
+
+	static std::chrono::system_clock::time_point start_time;
+	std::chrono::system_clock::duration get_uptime()
+	{
+		return std::chrono::system_clock::now() - start_time;
+	}
+}
+
+namespace ikura::bench
+{
+	struct Input
+	{
+		std::string text;
+		std::vector<ikura::relative_str> emotes;
+	};
+
+	static bool load_text(const std::string& path, std::vector<Input>& out)
+	{
+		auto [ fd, buf, len ] = util::mmapEntireFile(path);
+		if(buf == nullptr)
+			return false;
+
+		auto file = ikura::str_view((const char*) buf, len);
+		while(!file.empty())
+		{
+			auto line = file.take(file.find('\n'));
+			file.remove_prefix(std::min(file.size(), line.size() + 1));
+
+			if(line = line.trim(); !line.empty())
+				out.push_back(Input { line.str(), { } });
+		}
+
+		util::munmapEntireFile(fd, buf, len);
+		return true;
+	}
+
+	// we don't go through db::load, since that would also set up syncing (and the snapshot).
+	static bool load_database(const std::string& path, std::vector<Input>& out)
+	{
+		auto [ fd, buf, len ] = util::mmapEntireFile(path);
+		if(buf == nullptr)
+			return false;
+
+		auto span = Span(buf, len);
+		auto db = db::Database::deserialise(span);
+
+		util::munmapEntireFile(fd, buf, len);
+		if(!db.has_value())
+			return false;
+
+		auto logs = db::MessageDB::Cursor(db->messageData);
+
+		auto& tlog = db->twitchData.messageLog;
+		for(size_t i = 0; i < tlog.size(); i++)
+		{
+			if(!tlog.isCommand(i))
+				out.push_back(Input { logs.get(tlog.contents[i]).str(), tlog.getEmotePositions(i).vec() });
+		}
+
+		auto& dlog = db->discordData.messageLog;
+		for(size_t i = 0; i < dlog.size(); i++)
+		{
+			if(!dlog.isCommand(i))
+				out.push_back(Input { logs.get(dlog.contents[i]).str(), dlog.getEmotePositions(i).vec() });
+		}
+
+		// retraining reads from the global one. this replaces all of it, so it needs all of it.
+		db::write_quiet({ db::Section::Twitch, db::Section::Interp, db::Section::Markov, db::Section::Shared,
+			db::Section::Discord, db::Section::Irc, db::Section::Messages, db::Section::Search }, [&db](auto& global) {
+			global = std::move(db.value());
+		});
+		return true;
+	}
+
+	static bool is_database(const std::string& path)
+	{
+		auto [ fd, buf, len ] = util::mmapEntireFile(path);
+		if(buf == nullptr)
+			return false;
+
+		bool ret = len >= 8 && memcmp(buf, "ikura_db", 8) == 0;
+		util::munmapEntireFile(fd, buf, len);
+
+		return ret;
+	}
+
+	static double peak_rss_mb()
+	{
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+
+		// linux gives this in kilobytes.
+		return (double) ru.ru_maxrss / 1024.0;
+	}
+
+	static double percentile(std::vector<double>& xs, double p)
+	{
+		if(xs.empty())
+			return 0;
+
+		auto k = std::min(xs.size() - 1, (size_t) (p * (double) xs.size()));
+		std::nth_element(xs.begin(), xs.begin() + k, xs.end());
+		return xs[k];
+	}
+
+	static void train(const std::vector<Input>& corpus)
+	{
+		markov::reset();
+
+		auto t = timer();
+		for(auto& input : corpus)
+			markov::process(input.text, input.emotes);
+
+		markov::flush();
+		auto ms = t.measure();
+
+		zpr::println("train:     {} messages in {.2f} ms ({.1f} msg/s)", corpus.size(), ms,
+			(double) corpus.size() / (ms / 1000.0));
+	}
+
+	static void retrain(size_t num_messages)
+	{
+		auto t = timer();
+		markov::retrain();
+
+		while(markov::retrainingProgress() < 1.0)
+			std::this_thread::sleep_for(10ms);
+
+		auto ms = t.measure();
+		zpr::println("retrain:   {} messages in {.2f} ms ({.1f} msg/s)", num_messages, ms,
+			(double) num_messages / (ms / 1000.0));
+	}
+
+	static void generate(size_t count)
+	{
+		std::vector<double> times;
+		times.reserve(count);
+
+		size_t words = 0;
+		auto t = timer();
+		for(size_t i = 0; i < count; i++)
+		{
+			auto g = timer();
+			auto msg = markov::generateMessage();
+			times.push_back(g.measure());
+
+			words += msg.fragments.size();
+		}
+
+		auto ms = t.measure();
+		zpr::println("generate:  {} messages in {.2f} ms ({.1f} msg/s, {.1f} words/msg)", count, ms,
+			(double) count / (ms / 1000.0), (double) words / (double) std::max(count, (size_t) 1));
+
+		auto p50 = percentile(times, 0.50);
+		auto p99 = percentile(times, 0.99);
+		zpr::println("latency:   p50 {.3f} ms, p99 {.3f} ms", p50, p99);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	using namespace ikura;
+
+	if(argc < 2)
+	{
+		zpr::println("usage: ./markov-bench <corpus.txt | database.db> [--generate <count>] [--repeat <count>]");
+		exit(1);
+	}
+
+	start_time = std::chrono::system_clock::now();
+
+	std::string path = argv[1];
+	size_t num_generate = 10000;
+	size_t repeat = 1;
+
+	for(int i = 2; i + 1 < argc; i += 2)
+	{
+		auto opt = std::string(argv[i]);
+		auto val = std::stoull(argv[i + 1]);
+
+		if(opt == "--generate")     num_generate = val;
+		else if(opt == "--repeat")  repeat = std::max((size_t) 1, (size_t) val);
+		else                        lg::fatal("bench", "unknown option '{}'", opt);
+	}
+
+	// start the worker first; loading a database might decide that the model needs retraining, and
+	// we don't want that to happen on its own.
+	markov::init();
+
+	std::vector<bench::Input> corpus;
+	bool db = bench::is_database(path);
+
+	auto t = timer();
+	if(!(db ? bench::load_database(path, corpus) : bench::load_text(path, corpus)))
+		lg::fatal("bench", "failed to load corpus '{}'", path);
+
+	zpr::println("corpus:    {} messages from {} '{}' in {.2f} ms", corpus.size(), db ? "database" : "text file",
+		path, t.measure());
+
+	// a bigger corpus, without needing a bigger file.
+	auto num_logged = corpus.size();
+	if(repeat > 1)
+	{
+		auto n = corpus.size();
+		corpus.reserve(n * repeat);
+
+		for(size_t r = 1; r < repeat; r++)
+			for(size_t i = 0; i < n; i++)
+				corpus.push_back(corpus[i]);
+	}
+
+	bench::train(corpus);
+	bench::generate(num_generate);
+
+	if(db)
+	{
+		bench::retrain(num_logged);
+		bench::generate(num_generate);
+	}
+
+	zpr::println("peak rss:  {.1f} MB", bench::peak_rss_mb());
+
+	markov::shutdown();
+	return 0;
+}
@@ -0,0 +1,233 @@
+// serialise-bench.cpp
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <algorithm>
+
+#include "db.h"
+#include "defs.h"
+#include "async.h"
+#include "timer.h"
+#include "markov.h"
+#include "serialise.h"
+
+// measures how fast serialise::Writer and Reader go, for the things that make up most of a database (strings and
+// big arrays), next to a plain memcpy of the same size -- that's as fast as it can possibly get. if a database is
+// given, loading and saving the whole thing is measured too.
+
+// these live in main.cpp, which we don't link with.
+namespace ikura
+{
+	static ThreadPool<4> pool;
+	ThreadPool<4>& dispatcher()
+	{
+		return pool;
+	}
+
+	static std::chrono::system_clock::time_point start_time;
+	std::chrono::system_clock::duration get_uptime()
+	{
+		return std::chrono::system_clock::now() - start_time;
+	}
+}
+
+namespace ikura::bench
+{
+	static size_t repeat = 3;
+
+	// runs `fn` a few times, and reports the best one (the others are mostly page faults and cache misses). it gets
+	// the timer, so it can reset it after setting things up.
+	template <typename Fn>
+	static void measure(const char* name, size_t bytes, Fn&& fn)
+	{
+		double best = 0;
+		for(size_t i = 0; i < repeat; i++)
+		{
+			auto t = timer();
+			fn(t);
+
+			auto ms = t.measure();
+			if(i == 0 || ms < best)
+				best = ms;
+		}
+
+		zpr::println("{}: {.1f} MB in {.2f} ms ({.1f} MB/s)", name, (double) bytes / (1024.0 * 1024.0), best,
+			(double) bytes / (1024.0 * 1024.0) / (best / 1000.0));
+	}
+
+	static void baseline(size_t size)
+	{
+		auto src = std::vector<uint8_t>(size, 0x55);
+		auto dst = Buffer(size);
+
+		measure("memcpy          ", size, [&](auto& t) {
+			dst.clear();
+			t.reset();
+
+			dst.write(src.data(), size);
+		});
+	}
+
+	static void strings(size_t size)
+	{
+		// about as long as a chat message.
+		std::vector<std::string> strs;
+		size_t total = 0;
+		while(total < size)
+		{
+			auto s = std::string(random::get<size_t>(8, 120), 'x');
+			for(auto& c : s)
+				c = (char) random::get<uint8_t>('a', 'z');
+
+			total += s.size();
+			strs.push_back(std::move(s));
+		}
+
+		auto buf = Buffer(total * 2);
+		measure("string write    ", total, [&](auto& t) {
+			buf.clear();
+			t.reset();
+
+			auto wr = serialise::Writer(buf);
+			for(auto& s : strs)
+				wr.write(s);
+		});
+
+		measure("string read     ", total, [&](auto&) {
+			auto span = buf.span();
+			auto rd = serialise::Reader(span);
+			for(size_t i = 0; i < strs.size(); i++)
+				rd.read<std::string>();
+		});
+
+		measure("string read view", total, [&](auto&) {
+			auto span = buf.span();
+			auto rd = serialise::Reader(span);
+			for(size_t i = 0; i < strs.size(); i++)
+				rd.read<ikura::str_view>();
+		});
+
+		// the same thing sync does; /dev/null so that we're not just measuring the disk.
+		int fd = open("/dev/null", O_WRONLY);
+		if(fd < 0)
+			return;
+
+		measure("string stream   ", total, [&](auto&) {
+			auto stream = FileStream(fd);
+			auto buf = Buffer::streaming(&stream, 256 * 1024);
+
+			auto wr = serialise::Writer(buf);
+			for(auto& s : strs)
+				wr.write(s);
+
+			buf.flush();
+		});
+
+		close(fd);
+	}
+
+	static void arrays(size_t size)
+	{
+		auto xs = std::vector<uint64_t>(size / sizeof(uint64_t));
+		for(size_t i = 0; i < xs.size(); i++)
+			xs[i] = i * 0x9E3779B97F4A7C15ULL;
+
+		auto bytes = xs.size() * sizeof(uint64_t);
+		auto buf = Buffer(bytes + 64);
+
+		measure("array write     ", bytes, [&](auto& t) {
+			buf.clear();
+			t.reset();
+
+			serialise::Writer(buf).write(xs);
+		});
+
+		std::optional<std::vector<uint64_t>> out;
+		measure("array read      ", bytes, [&](auto&) {
+			auto span = buf.span();
+			out = serialise::Reader(span).read<std::vector<uint64_t>>();
+		});
+
+		if(out != xs)
+			lg::error("bench", "array did not survive the round trip");
+	}
+
+	static void database(const std::string& path)
+	{
+		auto [ fd, buf, len ] = util::mmapEntireFile(path);
+		if(buf == nullptr)
+			lg::fatal("bench", "failed to open '{}'", path);
+
+		std::optional<db::Database> db;
+		measure("database load   ", len, [&](auto&) {
+			auto span = Span(buf, len);
+			db = db::Database::deserialise(span);
+		});
+
+		if(!db.has_value())
+			lg::fatal("bench", "failed to load database '{}'", path);
+
+		auto out = Buffer(len + 64 * 1024);
+		measure("database save   ", len, [&](auto& t) {
+			out.clear();
+			t.reset();
+
+			db->serialise(out);
+		});
+
+		// the message logs might still be pointing into the file.
+		db.reset();
+		util::munmapEntireFile(fd, buf, len);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	using namespace ikura;
+
+	start_time = std::chrono::system_clock::now();
+
+	std::string path;
+	size_t size_mb = 256;
+
+	for(int i = 1; i < argc; i++)
+	{
+		auto opt = std::string(argv[i]);
+		if(opt.find("--") != 0)
+		{
+			path = opt;
+			continue;
+		}
+
+		if(i + 1 >= argc)
+		{
+			zpr::println("usage: ./serialise-bench [database.db] [--size <mb>] [--repeat <count>]");
+			exit(1);
+		}
+
+		auto val = std::stoull(argv[++i]);
+		if(opt == "--size")         size_mb = std::max((size_t) 1, (size_t) val);
+		else if(opt == "--repeat")  bench::repeat = std::max((size_t) 1, (size_t) val);
+		else                        lg::fatal("bench", "unknown option '{}'", opt);
+	}
+
+	auto size = size_mb * 1024 * 1024;
+
+	bench::baseline(size);
+	bench::strings(size);
+	bench::arrays(size);
+
+	if(!path.empty())
+	{
+		// loading the markov section might want to retrain the model.
+		markov::init();
+		bench::database(path);
+		markov::shutdown();
+	}
+
+	return 0;
+}